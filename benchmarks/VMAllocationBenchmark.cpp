@@ -0,0 +1,77 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+// Counts the heap allocations per executed instruction. A loop over the
+// common instructions runs twice with a different number of iterations, the
+// difference of both runs is the steady state cost of the loop body. Any
+// allocation there fails the benchmark.
+
+static std::size_t allocations = 0;
+
+// noinline keeps gcc from pairing the inlined malloc with delete
+[[gnu::noinline]] auto operator new(std::size_t size) -> void* {
+  allocations += 1;
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+[[gnu::noinline]] void operator delete(void* ptr, [[maybe_unused]] std::size_t size) noexcept {
+  std::free(ptr);
+}
+
+// instructions executed by one iteration of the loop
+constexpr std::size_t LOOP_BODY = 13;
+
+struct Run {
+  std::size_t allocations;
+  double ns;
+};
+
+template <class POLICY> auto run_loop(int iterations) -> Run {
+  using VM = VirtualMachine<POLICY>;
+  VM vm(1024 * 1024);
+  vm.enable_fusion(false);
+  vm.add_program({new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(iterations), 13),
+                  new Load<VM>(1), new CAdd<VM>(VMPrimitive(1)), new Store<VM>(1), new AddRRR<VM>(3, 1, 1),
+                  new MulRRI<VM>(4, 3, VMPrimitive(2)), new Push<VM>(VMPrimitive(4)), new Pop<VM>(),
+                  new MovRI<VM>(5, VMPrimitive(7)), new CallR<VM>(VMPrimitive(std::string("id")), 5),
+                  new If<VM>(0, VMPrimitive(0), 12), new Goto<VM>(1), new Halt<VM>()});
+  vm.add_function("id", {new Return<VM>(0)}, 1);
+  vm.lower_program();
+
+  std::size_t before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  vm.run();
+  auto end = std::chrono::steady_clock::now();
+  return {.allocations = allocations - before, .ns = std::chrono::duration<double, std::nano>(end - start).count()};
+}
+
+template <class POLICY> auto measure(const char* name) -> bool {
+  constexpr int SHORT = 10'000;
+  constexpr int LONG = 1'000'000;
+  Run short_run = run_loop<POLICY>(SHORT);
+  Run long_run = run_loop<POLICY>(LONG);
+  auto instructions = static_cast<double>(LOOP_BODY * (LONG - SHORT));
+  double per_instruction = static_cast<double>(long_run.allocations - short_run.allocations) / instructions;
+  std::cout << name << ": " << per_instruction << " allocations/instruction, "
+            << (long_run.ns - short_run.ns) / instructions << " ns/instruction" << std::endl;
+  return long_run.allocations == short_run.allocations;
+}
+
+int main() {
+  bool ok = measure<AggresivPolicy>("AggresivPolicy");
+  ok = measure<ProfilingPolicy>("ProfilingPolicy") && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,68 @@
+#include "VMArithmetic.h"
+#include "VMType.h"
+#include "VMValue.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+// Compares the VMValue kernels with the generic VMType operators for the
+// same pairs of operands.
+
+constexpr std::size_t ITERATIONS = 1'000'000;
+
+template <class F> void measure(const char* name, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  std::size_t checksum = 0;
+  for (std::size_t i = 0; i < ITERATIONS; ++i) {
+    checksum += f(i);
+  }
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(ITERATIONS) << " ns/op (" << checksum << ")" << std::endl;
+}
+
+template <class T> void compare_paths(const char* name, T lhs, T rhs) {
+  VMHeap heap;
+  VMValue l(lhs);
+  VMValue r(rhs);
+  VMType tl = VMPrimitive(lhs);
+  VMType tr = VMPrimitive(rhs);
+  std::cout << name << std::endl;
+  measure("  kernel add", [&](std::size_t) { return add(l, r, heap).result().bits() & 1; });
+  measure("  VMType add", [&](std::size_t) { return ::add(tl, tr).ok() ? 1 : 0; });
+  measure("  kernel compare", [&](std::size_t i) { return compare(l, r, i % 6, heap) ? 1 : 0; });
+  measure("  VMType compare", [&](std::size_t i) {
+    return (i % 2 == 0 ? std::get<VMPrimitive>(tl) < std::get<VMPrimitive>(tr)
+                       : std::get<VMPrimitive>(tl) == std::get<VMPrimitive>(tr))
+               ? 1
+               : 0;
+  });
+}
+
+// log formatting: lines of 16 pieces built by repeated concatenation
+void compare_concat() {
+  VMHeap heap;
+  VMValue line = heap.make_string("");
+  VMValue piece = heap.make_string(" field=value");
+  VMType tline = VMPrimitive(std::string());
+  VMType tpiece = VMPrimitive(std::string(" field=value"));
+  std::cout << "string/string" << std::endl;
+  measure("  kernel concat", [&](std::size_t i) {
+    line = add(i % 16 == 0 ? heap.intern("log:") : line, piece, heap).result();
+    return heap.string(line).size();
+  });
+  measure("  VMType concat", [&](std::size_t i) {
+    tline = ::add(i % 16 == 0 ? VMType(VMPrimitive(std::string("log:"))) : tline, tpiece).result();
+    return std::get<std::string>(std::get<VMPrimitive>(tline)).size();
+  });
+}
+
+int main() {
+  compare_paths("int/int", 40, 2);
+  compare_paths("double/double", 40.5, 2.25);
+  compare_paths("size_t/size_t", std::size_t{40}, std::size_t{2});
+  compare_paths("float/float", 40.5f, 2.25f);
+  compare_concat();
+  return 0;
+}
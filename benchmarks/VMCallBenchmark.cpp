@@ -0,0 +1,76 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+// Call heavy programs: a loop of leaf calls with stack arguments (Call) and
+// register windows (CallR), and a recursive fib in register windows, once
+// more with the ProfilingPolicy to show the overhead of the profiler.
+
+using VM = VirtualMachine<AggresivPolicy>;
+
+constexpr int LOOP_CALLS = 1'000'000;
+constexpr int FIB_N = 27;
+
+template <class F> void measure(const char* name, std::size_t calls, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(calls) << " ns/call" << std::endl;
+}
+
+auto fname(const char* name) -> VMPrimitive {
+  return VMPrimitive(std::string(name));
+}
+
+template <class POLICY> void run_fib() {
+  using PVM = VirtualMachine<POLICY>;
+  PVM vm;
+  vm.add_program({new MovRI<PVM>(1, VMPrimitive(FIB_N)), new CallR<PVM>(fname("fib"), 1), new Halt<PVM>()});
+  vm.add_function("fib",
+                  {new CmpBrI<PVM>(4, 0, VMPrimitive(1), 9), new SubRRI<PVM>(2, 0, VMPrimitive(1)),
+                   new CallR<PVM>(fname("fib"), 2), new SubRRI<PVM>(3, 0, VMPrimitive(2)),
+                   new CallR<PVM>(fname("fib"), 3), new AddRRR<PVM>(0, 2, 3), new Return<PVM>(0)},
+                  1);
+  vm.run();
+  std::cout << "fib(" << FIB_N << ") = " << vm.registers()[1].as_int() << std::endl;
+}
+
+int main() {
+  measure("Call with stack arguments", LOOP_CALLS, [] {
+    VM vm;
+    vm.add_program({new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(LOOP_CALLS), 7),
+                    new Push<VM>(VMPrimitive(1)), new Call<VM>(fname("id")), new SLoad<VM>(0),
+                    new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(1), new Halt<VM>()});
+    vm.add_function("id", {new Return<VM>(0)}, 1);
+    vm.run();
+  });
+
+  measure("CallR in register windows", LOOP_CALLS, [] {
+    VM vm;
+    vm.add_program({new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(LOOP_CALLS), 6),
+                    new MovRI<VM>(2, VMPrimitive(1)), new CallR<VM>(fname("id"), 2),
+                    new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(1), new Halt<VM>()});
+    vm.add_function("id", {new Return<VM>(0)}, 1);
+    vm.run();
+  });
+
+  // fib(n) needs 2 * fib(n + 1) - 1 calls
+  std::size_t fib_calls = 0;
+  std::size_t a = 0;
+  std::size_t b = 1;
+  for (int i = 0; i <= FIB_N; ++i) {
+    std::size_t next = a + b;
+    a = b;
+    b = next;
+  }
+  fib_calls = (2 * a) - 1;
+  measure("recursive fib with CallR", fib_calls, run_fib<AggresivPolicy>);
+  measure("recursive fib with CallR, profiled", fib_calls, run_fib<ProfilingPolicy>);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+// A function summing 0 .. n - 1 in a CmpBr/AddRRR/AddRRI/Goto loop, called
+// CALLS times, compiled by the baseline JIT and interpreted. The same loop
+// running CALLS * N times in the main program, as a loop trace and interpreted.
+
+using VM = VirtualMachine<AggresivPolicy>;
+
+constexpr int CALLS = 10'000;
+constexpr int N = 1'000;
+
+template <class F> void measure(const char* name, std::size_t iterations, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(iterations) << " ns/iteration" << std::endl;
+}
+
+void run_sum(bool jit) {
+  VM vm;
+  vm.add_program({new MovRI<VM>(4, VMPrimitive(0)), new CmpBrI<VM>(5, 4, VMPrimitive(CALLS), 7),
+                  new MovRI<VM>(5, VMPrimitive(N)), new CallR<VM>(VMPrimitive(std::string("sum")), 5),
+                  new AddRRR<VM>(3, 3, 5), new AddRRI<VM>(4, 4, VMPrimitive(1)), new Goto<VM>(1), new Halt<VM>()});
+  vm.add_function("sum",
+                  {new MovRI<VM>(1, VMPrimitive(0)), new MovRI<VM>(2, VMPrimitive(0)), new CmpBr<VM>(5, 1, 0, 14),
+                   new AddRRR<VM>(2, 2, 1), new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(10),
+                   new Return<VM>(2)},
+                  1);
+  vm.enable_jit(jit);
+  vm.run();
+}
+
+void run_loop(bool jit) {
+  VM vm({new MovRI<VM>(1, VMPrimitive(0)), new MovRI<VM>(2, VMPrimitive(0)),
+         new CmpBrI<VM>(5, 1, VMPrimitive(CALLS * N), 6), new AddRRR<VM>(2, 2, 1), new AddRRI<VM>(1, 1, VMPrimitive(1)),
+         new Goto<VM>(2), new Halt<VM>()});
+  vm.enable_jit(jit);
+  vm.run();
+}
+
+int main() {
+  measure("sum loop, baseline JIT", static_cast<std::size_t>(CALLS) * N, [] { run_sum(true); });
+  measure("sum loop, interpreted", static_cast<std::size_t>(CALLS) * N, [] { run_sum(false); });
+  measure("main loop, trace", static_cast<std::size_t>(CALLS) * N, [] { run_loop(true); });
+  measure("main loop, interpreted", static_cast<std::size_t>(CALLS) * N, [] { run_loop(false); });
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+// Rounds over an int array in VM memory: every element is written with an
+// indexed StoreMem, read back with an indexed LoadMem and summed, then the
+// array is copied with one MemCopy.
+
+using VM = VirtualMachine<AggresivPolicy>;
+
+constexpr int ELEMENTS = 16 * 1024;
+constexpr int ROUNDS = 64;
+constexpr auto INT = static_cast<std::size_t>(VMTypeKind::VM_INT);
+
+template <class F> void measure(const char* name, std::size_t elements, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(elements) << " ns/element" << std::endl;
+}
+
+int main() {
+  VM vm(64 * 1024 * 1024);
+  // c(1) = a, c(5) = b, c(4) = sum of all a[i] = i, b = a
+  vm.add_program({new Allocate<VM>(ELEMENTS * sizeof(int), 1), new Allocate<VM>(ELEMENTS * sizeof(int), 5),
+                  new MovRI<VM>(6, VMPrimitive(ELEMENTS * 4)), new MovRI<VM>(4, VMPrimitive(0.0)),
+                  new MovRI<VM>(7, VMPrimitive(0)), new CmpBrI<VM>(5, 7, VMPrimitive(ROUNDS), 16),
+                  new MovRI<VM>(2, VMPrimitive(0)), new CmpBrI<VM>(5, 2, VMPrimitive(ELEMENTS), 13),
+                  new StoreMem<VM>(2, {.base = 1, .index = 2, .scale = 4}, INT),
+                  new LoadMem<VM>(3, {.base = 1, .index = 2, .scale = 4}, INT), new AddRRR<VM>(4, 4, 3),
+                  new AddRRI<VM>(2, 2, VMPrimitive(1)), new Goto<VM>(7), new MemCopy<VM>(5, 1, 6),
+                  new AddRRI<VM>(7, 7, VMPrimitive(1)), new Goto<VM>(5), new Halt<VM>()});
+  measure("StoreMem, LoadMem and MemCopy", ELEMENTS * ROUNDS, [&] { vm.run(); });
+  std::cout << "sum = " << vm.registers()[4].as_double() << std::endl;
+  return 0;
+}
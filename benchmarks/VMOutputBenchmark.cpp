@@ -0,0 +1,41 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// A loop printing a number and a newline per iteration into /dev/null, with
+// the default output buffer and unbuffered (one write per value).
+
+using VM = VirtualMachine<AggresivPolicy>;
+
+constexpr int LINES = 1'000'000;
+
+template <class F> void measure(const char* name, std::size_t lines, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(lines) << " ns/line" << std::endl;
+}
+
+void print_lines(std::size_t capacity) {
+  std::ofstream out("/dev/null");
+  VM vm;
+  vm.add_program({new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(LINES), 8),
+                  new Push<VM>(VMPrimitive(12345)), new Print<VM>(), new Push<VM>(VMPrimitive(std::string("\n"))),
+                  new Print<VM>(), new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(1), new Halt<VM>()});
+  vm.output().set_stream(&out);
+  vm.output().set_capacity(capacity);
+  vm.run();
+}
+
+int main() {
+  measure("Print buffered", LINES, [] { print_lines(VMOutput::DEFAULT_CAPACITY); });
+  measure("Print unbuffered", LINES, [] { print_lines(0); });
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include "Instruction.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+
+// Interpreted If/Add/Goto and If/CAdd/Goto loops over ints and doubles, with
+// the records quickened into their typed variants and left generic.
+
+struct GenericPolicy : public AggresivPolicy {
+  static constexpr std::size_t quicken_threshold = 0;
+};
+
+constexpr int N = 10'000'000;
+
+template <class F> void measure(const char* name, std::size_t iterations, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(iterations) << " ns/iteration" << std::endl;
+}
+
+template <class P> void run_loop(bool ints) {
+  using VM = VirtualMachine<P>;
+  VM vm(1024 * 1024);
+  if (ints) {
+    vm.add_program({new MovRI<VM>(2, VMPrimitive(1)), new CLoad<VM>(VMPrimitive(0)), new If<VM>(5, VMPrimitive(N), 5),
+                    new Add<VM>(2), new Goto<VM>(2), new Halt<VM>()});
+  } else {
+    vm.add_program({new CLoad<VM>(VMPrimitive(0.0)), new If<VM>(5, VMPrimitive(double(N)), 4),
+                    new CAdd<VM>(VMPrimitive(1.0)), new Goto<VM>(1), new Halt<VM>()});
+  }
+  vm.enable_jit(false);
+  vm.run();
+  if constexpr (P::quicken_threshold != 0) {
+    std::cout << "  " << vm.quicken_rewrites() << " rewrites, " << vm.quicken_deopts() << " deopts" << std::endl;
+  }
+}
+
+int main() {
+  measure("int Add loop, quickened", N, [] { run_loop<AggresivPolicy>(true); });
+  measure("int Add loop, generic", N, [] { run_loop<GenericPolicy>(true); });
+  measure("double CAdd loop, quickened", N, [] { run_loop<AggresivPolicy>(false); });
+  measure("double CAdd loop, generic", N, [] { run_loop<GenericPolicy>(false); });
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include "Instruction.h"
+#include "PbcFile.h"
+#include "VMMemory.h"
+#include "VMPolicy.h"
+#include "VirtualMachine.h"
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Measures how long it takes to bring up a VM with the default heap size and
+// to serve the first allocation from it, and how long a large program takes
+// to become runnable from instruction objects and from a mapped .pbc file.
+
+template <class F> auto measure(const char* name, std::size_t iterations, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    f();
+  }
+  auto end = std::chrono::steady_clock::now();
+  auto total = std::chrono::duration<double, std::micro>(end - start).count();
+  std::cout << name << ": " << total / static_cast<double>(iterations) << " us/iteration" << std::endl;
+}
+
+int main() {
+  constexpr std::size_t ITERATIONS = 1000;
+  measure("construct VMMemory (1 GiB)", ITERATIONS,
+          [] { VMMemory<VirtualMachine<AggresivPolicy>> memory(1024 * 1024 * 1024); });
+  measure("construct VirtualMachine (1 GiB)", ITERATIONS, [] { VirtualMachine<AggresivPolicy> vm; });
+  measure("construct VirtualMachine and allocate", ITERATIONS, [] {
+    VirtualMachine<AggresivPolicy> vm;
+    vm.allocate(16);
+  });
+
+  using VM = VirtualMachine<AggresivPolicy>;
+  constexpr std::size_t PROGRAM_SIZE = 1'000'000;
+  auto make_program = [] {
+    std::vector<VM::InstructionTypeV*> program;
+    for (std::size_t i = 0; i < PROGRAM_SIZE; ++i) {
+      program.push_back(new AddRRI<VM>(1, 1, VMPrimitive(1)));
+    }
+    program.push_back(new Halt<VM>());
+    return program;
+  };
+  auto path = (std::filesystem::temp_directory_path() / "palladium_startup_benchmark.pbc").string();
+  {
+    VM vm(make_program());
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    write_pbc(out, vm.image().result());
+  }
+  measure("build and lower 1M instructions", 10, [&] {
+    VM vm(make_program());
+    vm.lower_program();
+  });
+  measure("load 1M instructions from pbc", 10, [&] {
+    VM vm;
+    vm.load(PbcFile::open(path).result());
+  });
+  std::filesystem::remove(path);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef PALLADIUM_ASSEMBLER_H
+#define PALLADIUM_ASSEMBLER_H
+#include "PbcFile.h"
+#include "Util.h"
+#include <cstddef>
+#include <string_view>
+
+// Palladium assembler
+// -------------------
+// Translates pasm source into the image of a .pbc file in one pass over the
+// input, tokens are string_view slices of the source.
+//
+//   $function_section
+//     fib 1 fib_label          # name, argument count, label of the entry
+//   $end
+//   $code_section
+//     MovRI 1 15
+//     CallR fib 1
+//     Halt
+//   fib_label:
+//     CmpBrI 4 0 1 done        # labels may be used before they are defined
+//     ...
+//   done:
+//     Return 0
+//   $end
+//
+// Every instruction of Instruction.h is written with the name of its class and
+// the arguments of its constructor. Constants are ints (-3), doubles (1.5),
+// floats (1.5f), size_t (3u), bools (true) or strings ("text"). Jump targets
+// and function entries are labels or instruction indices.
+class Tokenizer {
+public:
+  explicit Tokenizer(std::string_view source) : _source(source) {
+    find_line_end();
+  }
+
+  // next token of the current line, empty at the end of the line or at a comment
+  auto next() -> std::string_view;
+  // moves to the next line, false at the end of the input
+  auto next_line() -> bool;
+  auto line() const -> std::size_t {
+    return _line;
+  }
+  auto current_line() const -> std::string_view {
+    return _source.substr(_line_start, _line_end - _line_start);
+  }
+
+private:
+  void find_line_end();
+
+  std::string_view _source;
+  std::size_t _pos = 0;
+  std::size_t _line_start = 0;
+  std::size_t _line_end = 0;
+  std::size_t _line = 1;
+};
+
+auto assemble(std::string_view source) -> ResultOr<PbcImage>;
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef PALLADIUM_BYTECODE_H
+#define PALLADIUM_BYTECODE_H
+#include <cstddef>
+#include <cstdint>
+
+// Flat bytecode executed by the VirtualMachine dispatch loop
+// ---------------------------------------------------------
+// Every Instruction<VM> lowers into exactly one fixed size record, so the
+// program counter stays an instruction index and jump targets need no
+// relocation while lowering, only the fusion pass (Fusion.h) remaps them.
+// Operands which do not fit inline (VMType constants, struct field types)
+// live in side tables of the VM and are referenced by index.
+//
+// [ op (2 Byte) | a (2 Byte) | b (4 Byte) | c (8 Byte) ]   16 Byte
+//
+// The meaning of a, b and c is defined by the instruction which lowers
+// into the record, see Instruction.h.
+
+#if defined(__GNUC__)
+#define PALLADIUM_COMPUTED_GOTO 1
+#else
+#define PALLADIUM_COMPUTED_GOTO 0
+#endif
+
+// X(instruction class, opcode, byte) - the bytes are the ones listed in
+// docs/vm-opt-code.md. The records from 0x0180 on are never lowered, the VM
+// quickens generic records into them while it runs.
+#define PALLADIUM_OPCODES(X)                                                                                           \
+  X(Load, LOAD, 0x0010)                                                                                                \
+  X(CLoad, CLOAD, 0x0020)                                                                                              \
+  X(INDLoad, INDLOAD, 0x0030)                                                                                          \
+  X(SLoad, SLOAD, 0x0040)                                                                                              \
+  X(Store, STORE, 0x0050)                                                                                              \
+  X(INDStore, INDSTORE, 0x0060)                                                                                        \
+  X(Add, ADD, 0x0070)                                                                                                  \
+  X(CAdd, CADD, 0x0080)                                                                                                \
+  X(INDAdd, INDADD, 0x0090)                                                                                            \
+  X(If, IF, 0x00A0)                                                                                                    \
+  X(Goto, GOTO, 0x00B0)                                                                                                \
+  X(Halt, HALT, 0x00C0)                                                                                                \
+  X(Push, PUSH, 0x00D0)                                                                                                \
+  X(Pop, POP, 0x00E0)                                                                                                  \
+  X(Print, PRINT, 0x0100)                                                                                              \
+  X(PrintRegStructField, PRINT_REG_STRUCT_FIELD, 0x0101)                                                               \
+  X(Flush, FLUSH, 0x0102)                                                                                              \
+  X(Call, CALL, 0x0110)                                                                                                \
+  X(CallNative, CALL_NATIVE, 0x0111)                                                                                   \
+  X(CallR, CALL_R, 0x0112)                                                                                             \
+  X(RetVoid, RET_VOID, 0x0120)                                                                                         \
+  X(Return, RETURN, 0x0121)                                                                                            \
+  X(StructCreate, STRUCT_CREATE, 0x0130)                                                                               \
+  X(GetField, GET_FIELD, 0x0131)                                                                                       \
+  X(SetField, SET_FIELD, 0x0132)                                                                                       \
+  X(Allocate, ALLOCATE, 0x0140)                                                                                        \
+  X(Deallocate, DEALLOCATE, 0x0141)                                                                                    \
+  X(WriteMem, WRITE_MEM, 0x0142)                                                                                       \
+  X(ReadMem, READ_MEM, 0x0143)                                                                                         \
+  X(MemCopy, MEM_COPY, 0x0144)                                                                                         \
+  X(MemSet, MEM_SET, 0x0145)                                                                                           \
+  X(MemCmp, MEM_CMP, 0x0146)                                                                                           \
+  X(LoadMem, LOAD_MEM, 0x0147)                                                                                         \
+  X(StoreMem, STORE_MEM, 0x0148)                                                                                       \
+  X(Mov, MOV, 0x0150)                                                                                                  \
+  X(AddRRR, ADD_RRR, 0x0160)                                                                                           \
+  X(AddRRI, ADD_RRI, 0x0161)                                                                                           \
+  X(SubRRR, SUB_RRR, 0x0162)                                                                                           \
+  X(SubRRI, SUB_RRI, 0x0163)                                                                                           \
+  X(MulRRR, MUL_RRR, 0x0164)                                                                                           \
+  X(MulRRI, MUL_RRI, 0x0165)                                                                                           \
+  X(DivRRR, DIV_RRR, 0x016A)                                                                                           \
+  X(DivRRI, DIV_RRI, 0x016B)                                                                                           \
+  X(ModRRR, MOD_RRR, 0x016C)                                                                                           \
+  X(ModRRI, MOD_RRI, 0x016D)                                                                                           \
+  X(MovRR, MOV_RR, 0x0166)                                                                                             \
+  X(MovRI, MOV_RI, 0x0167)                                                                                             \
+  X(CmpBr, CMP_BR, 0x0168)                                                                                             \
+  X(CmpBrI, CMP_BR_I, 0x0169)                                                                                          \
+  X(IncReg, INC_REG, 0x0170)                                                                                           \
+  X(CLoadRet, CLOAD_RET, 0x0171)                                                                                       \
+  X(CmpImmBranch, CMP_IMM_BRANCH, 0x0172)                                                                              \
+  X(AddIntInt, ADD_INT_INT, 0x0180)                                                                                    \
+  X(AddDoubleDouble, ADD_DOUBLE_DOUBLE, 0x0181)                                                                        \
+  X(CAddIntImm, CADD_INT_IMM, 0x0182)                                                                                  \
+  X(CAddDoubleImm, CADD_DOUBLE_IMM, 0x0183)                                                                            \
+  X(INDAddIntInt, INDADD_INT_INT, 0x0184)                                                                              \
+  X(IfIntImm, IF_INT_IMM, 0x0185)
+
+enum class OpCode : std::uint16_t {
+#define PALLADIUM_OPCODE_ENUM(NAME, OP, BYTE) OP = BYTE,
+  PALLADIUM_OPCODES(PALLADIUM_OPCODE_ENUM)
+#undef PALLADIUM_OPCODE_ENUM
+};
+
+// size of the dispatch table, every opcode byte has to be smaller
+inline constexpr std::size_t OPCODE_TABLE_SIZE = 0x0200;
+
+// opcode of the first quickened record
+inline constexpr std::size_t FIRST_QUICKENED_OPCODE = 0x0180;
+
+// name of the instruction class which lowers into op
+constexpr auto opcode_name(OpCode op) -> const char* {
+  switch (op) {
+#define PALLADIUM_OPCODE_NAME(NAME, OP, BYTE)                                                                          \
+  case OpCode::OP:                                                                                                     \
+    return #NAME;
+    PALLADIUM_OPCODES(PALLADIUM_OPCODE_NAME)
+#undef PALLADIUM_OPCODE_NAME
+  }
+  return "Invalid";
+}
+
+// the generic opcode a quickened record was rewritten from, op otherwise
+constexpr auto generic_opcode(OpCode op) -> OpCode {
+  switch (op) {
+  case OpCode::ADD_INT_INT:
+  case OpCode::ADD_DOUBLE_DOUBLE:
+    return OpCode::ADD;
+  case OpCode::CADD_INT_IMM:
+  case OpCode::CADD_DOUBLE_IMM:
+    return OpCode::CADD;
+  case OpCode::INDADD_INT_INT:
+    return OpCode::INDADD;
+  case OpCode::IF_INT_IMM:
+    return OpCode::IF;
+  default:
+    return op;
+  }
+}
+
+struct Bytecode {
+  OpCode op;
+  std::uint16_t a = 0;
+  std::uint32_t b = 0;
+  std::uint64_t c = 0;
+};
+
+static_assert(sizeof(Bytecode) == 16, "Bytecode record has to stay 16 byte");
+
+// register operands index the window of the current function
+inline constexpr std::size_t REGISTER_COUNT = 10;
+
+#endif
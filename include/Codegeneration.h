@@ -1,6 +1,7 @@
 #ifndef PALLADIUM_CODEGENERATION_H
 #define PALLADIUM_CODEGENERATION_H
 #include <memory>
+#include <optional>
 #include "ast/AstNode.h"
 #include "ast/VariableDeclarationNode.h"
 #include "ast/FunctionNode.h"
@@ -12,13 +13,43 @@
 using VMPtr = std::shared_ptr<VirtualMachine<AggresivPolicy>>;
 using Code = std::vector<Instruction<VirtualMachine<AggresivPolicy>>*>;
 
+// local variables live in the registers after the accumulator c(0)
+inline constexpr std::size_t LOCAL_REGISTER_BASE = 1;
+
 struct LocalVariableContainer {
   std::string name;
   VMType type;
   std::size_t index;
   AstPtr expression;
+
+  auto register_index() const -> std::size_t {
+    return LOCAL_REGISTER_BASE + index;
+  }
 };
 using LocalVarContainerPtr = std::shared_ptr<std::vector<LocalVariableContainer>>;
+// accept() drops the VisitResult of begin() and end(), so every visitor keeps
+// the first error itself and its parent takes it over in end()
+class CodegenVisitor : public Visitor {
+public:
+  auto result() const -> VisitResult {
+    if (_error) {
+      return *_error;
+    }
+    return true;
+  }
+
+protected:
+  auto record(const VisitResult& res) -> VisitResult {
+    if (!res.ok() && !_error) {
+      _error = res.error_value();
+    }
+    return res;
+  }
+
+private:
+  std::optional<Error> _error;
+};
+
 //------------------FORWARD DECLARATION--------------------
 class FunctionVisitor;
 class StatementsVisitor;
@@ -28,7 +59,7 @@ class ReturnStatementVisitor;
 class ExpressionVisitor;
 //---------------------------------------------------------
 
-class TranslationUnitVisitor : public Visitor {
+class TranslationUnitVisitor : public CodegenVisitor {
 public:
   TranslationUnitVisitor();
   auto begin(const std::shared_ptr<TranslationUnitNode>& node) -> VisitResult override;
@@ -50,7 +81,7 @@ private:
 };
 
 //-----------------------------------------------------
-class FunctionVisitor : public Visitor {
+class FunctionVisitor : public CodegenVisitor {
 public:
   FunctionVisitor(const VMPtr& vm) : _vm(vm) {
   }
@@ -68,7 +99,7 @@ private:
 };
 
 //-----------------------------------------------------
-class StatementsVisitor : public Visitor {
+class StatementsVisitor : public CodegenVisitor {
 public:
   StatementsVisitor() = default;
   auto begin(const std::shared_ptr<StatementsNode>& node) -> VisitResult override;
@@ -91,7 +122,7 @@ private:
 };
 
 //-----------------------------------------------------
-class StatementVisitor : public Visitor {
+class StatementVisitor : public CodegenVisitor {
 public:
   StatementVisitor(const LocalVarContainerPtr& local_variables) : _local_variables(local_variables) {
   }
@@ -112,11 +143,12 @@ private:
   Code _code;
   std::shared_ptr<ReturnStatementVisitor> _return_statement_visitor;
   std::shared_ptr<VariableDeclarationVisitor> _var_dec_visitor;
+  std::shared_ptr<ExpressionVisitor> _expression_visitor;
   LocalVarContainerPtr _local_variables;
 };
 
 //-----------------------------------------------------
-class VariableDeclarationVisitor : public Visitor {
+class VariableDeclarationVisitor : public CodegenVisitor {
 public:
   VariableDeclarationVisitor(const LocalVarContainerPtr& local_variables) : _local_variables(local_variables) {
   }
@@ -128,12 +160,18 @@ public:
   using Visitor::end;
   using Visitor::visit;
 
+public:
+  auto code() const -> const Code& {
+    return _code;
+  }
+
 private:
+  Code _code;
   LocalVarContainerPtr _local_variables;
 };
 
 //-----------------------------------------------------
-class ReturnStatementVisitor : public Visitor {
+class ReturnStatementVisitor : public CodegenVisitor {
 public:
   ReturnStatementVisitor(const LocalVarContainerPtr& local_variables) : _local_variables(local_variables) {
   }
@@ -157,9 +195,14 @@ private:
 };
 
 //-----------------------------------------------------
-class ExpressionVisitor : public Visitor {
+// Generates three address code which leaves the value of the expression in
+// the register dst. With DISCARD only the side effects are kept.
+class ExpressionVisitor : public CodegenVisitor {
 public:
-  ExpressionVisitor(const LocalVarContainerPtr& local_variables) : _local_variables(local_variables) {
+  static constexpr std::size_t DISCARD = static_cast<std::size_t>(-1);
+
+  ExpressionVisitor(const LocalVarContainerPtr& local_variables, std::size_t dst = 0)
+      : _local_variables(local_variables), _dst(dst) {
   }
   auto begin(const std::shared_ptr<ExpressionNode>& node) -> VisitResult override;
   auto visit(const std::shared_ptr<ExpressionNode>& node) -> std::shared_ptr<Visitor> override;
@@ -175,8 +218,13 @@ public:
   }
 
 private:
+  auto generate(const std::shared_ptr<ExpressionNode>& node, std::size_t dst) -> VisitResult;
+  auto generate_binary(const std::shared_ptr<BinaryExpressionNode>& node, std::size_t dst) -> VisitResult;
+  auto local_register(const std::string& name) const -> ResultOr<std::size_t>;
+
   Code _code;
   LocalVarContainerPtr _local_variables;
+  std::size_t _dst;
 };
 
 #endif
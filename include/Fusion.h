@@ -0,0 +1,61 @@
+#ifndef PALLADIUM_FUSION_H
+#define PALLADIUM_FUSION_H
+#include "Bytecode.h"
+#include "Util.h"
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Superinstruction fusion
+// -----------------------
+// Rewrites short sequences of lowered bytecode into one fused record, so the
+// dispatch loop runs one handler instead of two or three. The sequences live
+// in the static FUSION_RULES table. A sequence is never fused if one of its
+// records behind the first is a jump target, jump targets and function entry
+// points are remapped to the shrunken program.
+//
+// A FusionProfile of a training run restricts fusion to the sequences which
+// were executed at least threshold times.
+
+struct FusionRule {
+  const char* name;
+  std::size_t length;
+  // code holds at least length records
+  auto (*match)(const Bytecode* code) -> bool;
+  auto (*fuse)(const Bytecode* code) -> Bytecode;
+};
+
+extern const std::vector<FusionRule> FUSION_RULES;
+
+// execution count of every pc of the unfused program
+struct FusionProfile {
+  std::vector<std::uint64_t> counts;
+  std::uint64_t threshold = 1;
+
+  auto hot(std::size_t pc) const -> bool {
+    return pc < counts.size() && counts[pc] >= threshold;
+  }
+  // text dump, one "pc count" line for every executed pc
+  void save(std::ostream& out) const;
+  static auto load(std::istream& in) -> ResultOr<FusionProfile>;
+};
+
+struct FusionResult {
+  std::vector<Bytecode> code;
+  // new pc of every old pc, the fused records map onto their first record
+  std::vector<std::size_t> pc_map;
+  std::size_t fused = 0;
+};
+
+// jump target of a control flow record, function calls are not included
+auto jump_target(const Bytecode& code) -> std::optional<std::size_t>;
+// code has to be a record with a jump target
+void set_jump_target(Bytecode& code, std::size_t target);
+
+auto fuse_bytecode(const std::vector<Bytecode>& code, std::span<const std::size_t> entry_points,
+                   const FusionProfile* profile = nullptr) -> FusionResult;
+
+#endif
@@ -1,11 +1,20 @@
 #ifndef _PALLADIUM_INSTRUCTION_H
 #define _PALLADIUM_INSTRUCTION_H
 
+#include "Bytecode.h"
 #include "Util.h"
+#include "VMArithmetic.h"
 #include "VMType.h"
+#include "VMValue.h"
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -14,26 +23,37 @@
 
 using InstructionResult = ResultOr<bool>;
 
+// Front end of the instruction set. An instruction lowers itself into a
+// Bytecode record, the static execute function of the same class runs
+// that record inside the dispatch loop of the VM.
 template <class VM> struct Instruction {
   Instruction() = default;
   virtual ~Instruction() = default;
-  virtual InstructionResult execute(VM* vm) = 0;
+  virtual auto lower(VM* vm) const -> Bytecode = 0;
   virtual auto to_string() const -> std::string = 0;
 };
 
+inline auto operand16(std::size_t value) -> std::uint16_t {
+  return static_cast<std::uint16_t>(value);
+}
+
 // c(0) = c(i)
 template <class VM> struct Load : public Instruction<VM> {
   Load(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Load " + std::to_string(_i));
-    VM::P::check_register_bounds(vm, _i);
-    auto& registers = vm->registers();
-    registers[0] = registers[_i];
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Load " + std::to_string(code.a); });
+    VM::P::check_register_bounds(vm, code.a);
+    auto registers = vm->registers();
+    registers[0] = registers[code.a];
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::LOAD, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "Load " + std::to_string(_i);
   }
@@ -47,14 +67,16 @@ template <class VM> struct CLoad : public Instruction<VM> {
   CLoad(const VMType& value) : _value(value) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("CLoad " + ::to_string(_value).result_or("Unknown"));
-    auto& registers = vm->registers();
-    registers[0] = _value;
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "CLoad " + vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown"); });
+    auto registers = vm->registers();
+    registers[0] = VMValue::from_bits(code.c);
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CLOAD, .c = vm->heap().constant(_value).bits()};
+  }
   auto to_string() const -> std::string override {
     return "CLoad " + ::to_string(_value).result_or("Unknown");
   }
@@ -68,18 +90,22 @@ template <class VM> struct INDLoad : public Instruction<VM> {
   INDLoad(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("IndLoad " + std::to_string(_i));
-    auto& registers = vm->registers();
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "IndLoad " + std::to_string(code.a); });
+    auto registers = vm->registers();
 
-    if (is_vm_type<int>(registers[_i])) {
-      int index = vm_type_get<int>(registers[_i]);
+    if (registers[code.a].is_int()) {
+      int index = registers[code.a].as_int();
       registers[0] = registers[index];
     }
 
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::INDLOAD, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "IndLoad " + std::to_string(_i);
   }
@@ -94,16 +120,18 @@ template <class VM> struct SLoad : public Instruction<VM> {
   SLoad(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("SLoad " + std::to_string(_i));
-    auto& registers = vm->registers();
-    registers[0] = vm->stack_top();
-    vm->stack_pop();
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "SLoad " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    registers[0] = vm->stack_pop();
     vm->inc_pc();
 
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::SLOAD, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "SLoad " + std::to_string(_i);
   }
@@ -117,14 +145,17 @@ template <class VM> struct Store : public Instruction<VM> {
   Store(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Store " + std::to_string(_i));
-    auto& registers = vm->registers();
-    registers[_i] = registers[0];
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Store " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    registers[code.a] = registers[0];
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::STORE, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "Store " + std::to_string(_i);
   }
@@ -138,17 +169,21 @@ template <class VM> struct INDStore : public Instruction<VM> {
   INDStore(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("INDStore " + std::to_string(_i));
-    auto& registers = vm->registers();
-    if (is_vm_type<int>(registers[_i])) {
-      int index = vm_type_get<int>(registers[_i]);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "INDStore " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    if (registers[code.a].is_int()) {
+      int index = registers[code.a].as_int();
       registers[index] = registers[0];
       vm->inc_pc();
+      return true;
     }
-    return err("expected int in register reg(" + std::to_string(_i) + ")");
+    return err("expected int in register reg(" + std::to_string(code.a) + ")");
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::INDSTORE, .a = operand16(_i)};
   }
-
   auto to_string() const -> std::string override {
     return "IndStore " + std::to_string(_i);
   }
@@ -157,16 +192,28 @@ private:
   std::size_t _i;
 };
 
+// type feedback of the generic add records, see VirtualMachine::quicken
+template <class VM> void add_feedback(VM* vm, VMValue lhs, VMValue rhs, OpCode ints, OpCode doubles) {
+  if constexpr (VM::P::quicken_threshold != 0) {
+    if (lhs.is_int() && rhs.is_int()) {
+      vm->quicken(ints);
+    } else if (lhs.is_double() && rhs.is_double()) {
+      vm->quicken(doubles);
+    }
+  }
+}
+
 // c(0) = c(0) +c(i)
 template <class VM> struct Add : public Instruction<VM> {
   Add(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Add " + std::to_string(_i));
-    auto& registers = vm->registers();
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Add " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    add_feedback(vm, registers[0], registers[code.a], OpCode::ADD_INT_INT, OpCode::ADD_DOUBLE_DOUBLE);
 
-    auto res = add(registers[0], registers[_i]);
+    auto res = add(registers[0], registers[code.a], vm->heap());
     if (res.ok()) {
       registers[0] = res.result();
       vm->inc_pc();
@@ -174,7 +221,10 @@ template <class VM> struct Add : public Instruction<VM> {
     }
     return res.error_value();
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::ADD, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "Add " + std::to_string(_i);
   }
@@ -188,10 +238,11 @@ template <class VM> struct CAdd : public Instruction<VM> {
   CAdd(const VMType& i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("CAdd " + ::to_string(_i).result_or("Unknown"));
-    auto& registers = vm->registers();
-    auto res = add(registers[0], _i);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "CAdd " + vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown"); });
+    auto registers = vm->registers();
+    add_feedback(vm, registers[0], VMValue::from_bits(code.c), OpCode::CADD_INT_IMM, OpCode::CADD_DOUBLE_IMM);
+    auto res = add(registers[0], VMValue::from_bits(code.c), vm->heap());
     if (res.ok()) {
       registers[0] = res.result();
       vm->inc_pc();
@@ -199,7 +250,9 @@ template <class VM> struct CAdd : public Instruction<VM> {
     }
     return res.error_value();
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CADD, .c = vm->heap().constant(_i).bits()};
+  }
   auto to_string() const -> std::string override {
     return "CAdd " + ::to_string(_i).result_or("Unknown");
   }
@@ -213,12 +266,17 @@ template <class VM> struct INDAdd : public Instruction<VM> {
   INDAdd(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("INDAdd " + std::to_string(_i));
-    auto& registers = vm->registers();
-    if (is_vm_type<int>(registers[_i])) {
-      int index = vm_type_get<int>(registers[_i]);
-      auto res = add(registers[0], registers[index]);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "INDAdd " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    if (registers[code.a].is_int()) {
+      int index = registers[code.a].as_int();
+      if constexpr (VM::P::quicken_threshold != 0) {
+        if (registers[0].is_int() && registers[index].is_int()) {
+          vm->quicken(OpCode::INDADD_INT_INT);
+        }
+      }
+      auto res = add(registers[0], registers[index], vm->heap());
       if (res.ok()) {
         registers[0] = res.result();
         vm->inc_pc();
@@ -226,9 +284,12 @@ template <class VM> struct INDAdd : public Instruction<VM> {
       }
       return res.error_value();
     }
-    return err("expected int in register reg(" + std::to_string(_i) + ")");
+    return err("expected int in register reg(" + std::to_string(code.a) + ")");
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::INDADD, .a = operand16(_i)};
   }
-
   auto to_string() const -> std::string override {
     return "INDAdd " + std::to_string(_i);
   }
@@ -243,42 +304,30 @@ template <class VM> struct If : public Instruction<VM> {
   If(std::size_t cond, const VMType& value, std::size_t target) : _cond(cond), _value(value), _target(target) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("if c(0) op(" + std::to_string(_cond) + ") v: " + ::to_string(_value).result_or("Unknown") +
-                     " jmp: " + std::to_string(_target));
-    auto& registers = vm->registers();
-    auto register_value = std::get<VMPrimitive>(registers[0]);
-    auto value = std::get<VMPrimitive>(_value);
-    bool condition = false;
-
-    switch (_cond) {
-    case 0:
-      condition = (register_value < value);
-      break;
-    case 1:
-      condition = (register_value > value);
-      break;
-    case 2:
-      condition = (register_value == value);
-      break;
-    case 3:
-      condition = (register_value != value);
-      break;
-    case 4:
-      condition = (register_value <= value);
-      break;
-    case 5:
-      condition = (register_value >= value);
-      break;
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "if c(0) op(" + std::to_string(code.a) + ") v: " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown") + " jmp: " + std::to_string(code.b);
+    });
+    auto registers = vm->registers();
+    if constexpr (VM::P::quicken_threshold != 0) {
+      if (registers[0].is_int() && VMValue::from_bits(code.c).is_int()) {
+        vm->quicken(OpCode::IF_INT_IMM);
+      }
     }
-    if (condition) {
-      vm->set_pc(_target);
+    if (compare(registers[0], VMValue::from_bits(code.c), code.a, vm->heap())) {
+      vm->set_pc(code.b);
     } else {
       vm->inc_pc();
     }
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::IF,
+            .a = operand16(_cond),
+            .b = static_cast<std::uint32_t>(_target),
+            .c = vm->heap().constant(_value).bits()};
+  }
   auto to_string() const -> std::string override {
     return "If " + std::to_string(_cond) + ::to_string(_value).result_or("Unknown") + std::to_string(_target);
   }
@@ -289,16 +338,125 @@ private:
   std::size_t _target;
 };
 
+// Quickened variants
+// ------------------
+// Never lowered: the VM rewrites a generic Add, CAdd, INDAdd or If record in
+// place into its variant once the operand types were the same for
+// P::quicken_threshold executions (VirtualMachine::quicken). The operands of
+// the record stay the same. A variant only guards the types, if they changed
+// it rewrites the record back and runs the generic instruction.
+
+// Add, c(0) and c(i) are ints
+template <class VM> struct AddIntInt {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "AddIntInt " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    if (!registers[0].is_int() || !registers[code.a].is_int()) [[unlikely]] {
+      vm->dequicken(OpCode::ADD);
+      return Add<VM>::execute(vm, code);
+    }
+    registers[0] = VMValue(kernel::wrapping<ArithmeticOp::ADD>(registers[0].as_int(), registers[code.a].as_int()));
+    vm->inc_pc();
+    return true;
+  }
+};
+
+// Add, c(0) and c(i) are doubles
+template <class VM> struct AddDoubleDouble {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "AddDoubleDouble " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    if (!registers[0].is_double() || !registers[code.a].is_double()) [[unlikely]] {
+      vm->dequicken(OpCode::ADD);
+      return Add<VM>::execute(vm, code);
+    }
+    registers[0] = VMValue(registers[0].as_double() + registers[code.a].as_double());
+    vm->inc_pc();
+    return true;
+  }
+};
+
+// CAdd of an int constant, c(0) is an int
+template <class VM> struct CAddIntImm {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "CAddIntImm " + std::to_string(VMValue::from_bits(code.c).as_int()); });
+    auto registers = vm->registers();
+    if (!registers[0].is_int()) [[unlikely]] {
+      vm->dequicken(OpCode::CADD);
+      return CAdd<VM>::execute(vm, code);
+    }
+    registers[0] = VMValue(kernel::wrapping<ArithmeticOp::ADD>(registers[0].as_int(), VMValue::from_bits(code.c).as_int()));
+    vm->inc_pc();
+    return true;
+  }
+};
+
+// CAdd of a double constant, c(0) is a double
+template <class VM> struct CAddDoubleImm {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "CAddDoubleImm " + std::to_string(VMValue::from_bits(code.c).as_double()); });
+    auto registers = vm->registers();
+    if (!registers[0].is_double()) [[unlikely]] {
+      vm->dequicken(OpCode::CADD);
+      return CAdd<VM>::execute(vm, code);
+    }
+    registers[0] = VMValue(registers[0].as_double() + VMValue::from_bits(code.c).as_double());
+    vm->inc_pc();
+    return true;
+  }
+};
+
+// INDAdd, c(i), c(0) and c(c(i)) are ints
+template <class VM> struct INDAddIntInt {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "INDAddIntInt " + std::to_string(code.a); });
+    auto registers = vm->registers();
+    if (!registers[code.a].is_int() || !registers[0].is_int() ||
+        !registers[registers[code.a].as_int()].is_int()) [[unlikely]] {
+      vm->dequicken(OpCode::INDADD);
+      return INDAdd<VM>::execute(vm, code);
+    }
+    auto rhs = registers[registers[code.a].as_int()].as_int();
+    registers[0] = VMValue(kernel::wrapping<ArithmeticOp::ADD>(registers[0].as_int(), rhs));
+    vm->inc_pc();
+    return true;
+  }
+};
+
+// If with an int constant, c(0) is an int
+template <class VM> struct IfIntImm {
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "IfIntImm c(0) op(" + std::to_string(code.a) + ") v: " +
+             std::to_string(VMValue::from_bits(code.c).as_int()) + " jmp: " + std::to_string(code.b);
+    });
+    auto registers = vm->registers();
+    if (!registers[0].is_int()) [[unlikely]] {
+      vm->dequicken(OpCode::IF);
+      return If<VM>::execute(vm, code);
+    }
+    if (kernel::compare_numeric<int, int>(registers[0], VMValue::from_bits(code.c), code.a, vm->heap())) {
+      vm->set_pc(code.b);
+    } else {
+      vm->inc_pc();
+    }
+    return true;
+  }
+};
+
 template <class VM> struct Goto : public Instruction<VM> {
   Goto(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Goto " + std::to_string(_i));
-    vm->set_pc(_i);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Goto " + std::to_string(code.c); });
+    vm->set_pc(code.c);
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::GOTO, .c = _i};
+  }
   auto to_string() const -> std::string override {
     return "Goto " + std::to_string(_i);
   }
@@ -307,15 +465,20 @@ private:
   std::size_t _i;
 };
 
+// stops the dispatch loop of the VM
 template <class VM> struct Halt : public Instruction<VM> {
   Halt() {
   }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Halt ");
-    UNUSED(vm);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Halt "; });
+    UNUSED(code);
+    vm->output().flush();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::HALT};
+  }
   auto to_string() const -> std::string override {
     return "Halt ";
   }
@@ -325,13 +488,15 @@ template <class VM> struct Push : public Instruction<VM> {
   Push(const VMType& value) : _value(value) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Push " + ::to_string(_value).result_or("Unknown"));
-    vm->stack_push(_value);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Push " + vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown"); });
+    vm->stack_push(VMValue::from_bits(code.c));
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::PUSH, .c = vm->heap().constant(_value).bits()};
+  }
   auto to_string() const -> std::string override {
     return "Push " + ::to_string(_value).result_or("Unknown");
   }
@@ -343,12 +508,17 @@ private:
 template <class VM> struct Pop : public Instruction<VM> {
   Pop() {
   }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Pop ");
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Pop "; });
+    UNUSED(code);
     vm->stack_pop();
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::POP};
+  }
   auto to_string() const -> std::string override {
     return "Pop ";
   }
@@ -358,43 +528,117 @@ template <class VM> struct Pop : public Instruction<VM> {
 template <class VM> struct Print : public Instruction<VM> {
   Print() {
   }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Print ");
-    auto v = vm->stack_top();
-    vm->stack_pop();
-    auto res = ::to_string(v);
-    if (res.ok()) {
-      std::cout << res.result();
-      std::flush(std::cout);
-      vm->inc_pc();
-      return true;
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Print "; });
+    UNUSED(code);
+    auto v = vm->stack_pop();
+    auto res = vm->output().write(v, vm->heap());
+    if (!res.ok()) {
+      return res.error_value();
     }
-    return res.error_value();
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::PRINT};
   }
-
   auto to_string() const -> std::string override {
     return "Print ";
   }
 };
 
+// writes the buffered output of Print and PrintRegStructField
+template <class VM> struct Flush : public Instruction<VM> {
+  Flush() {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Flush "; });
+    UNUSED(code);
+    vm->output().flush();
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::FLUSH};
+  }
+  auto to_string() const -> std::string override {
+    return "Flush ";
+  }
+};
+
+// instance of the struct in register i and the field at index, nullptr if
+// the register holds no instance of StructCreate or it has no such field
+template <class VM>
+auto struct_field(VM* vm, std::size_t i, std::uint64_t index, VMStructShape::Field& field) -> std::byte* {
+  auto value = vm->registers()[i];
+  if (!vm->is_instance(value)) {
+    return nullptr;
+  }
+  auto* data = VMStructShape::data(value);
+  auto fields = vm->heap().shape(VMStructShape::shape_index(data)).fields();
+  if (index >= fields.size()) {
+    return nullptr;
+  }
+  field = fields[index];
+  return data;
+}
+
+inline auto struct_field_error(std::size_t i, std::uint64_t index) -> Error {
+  return err("no field " + std::to_string(index) + " in the struct of reg(" + std::to_string(i) + ")");
+}
+
+// field index and inline cache slot of a field access site, packed into c
+inline auto field_operand(std::size_t field, std::uint32_t slot) -> std::uint64_t {
+  return (static_cast<std::uint64_t>(slot) << 32) | static_cast<std::uint32_t>(field);
+}
+inline auto field_index(const Bytecode& code) -> std::uint64_t {
+  return code.c & 0xFFFF'FFFF;
+}
+inline auto field_slot(const Bytecode& code) -> std::uint32_t {
+  return static_cast<std::uint32_t>(code.c >> 32);
+}
+
+// instance of the struct in register i if its shape is the one cached for the site
+template <class VM> auto cached_struct(VM* vm, std::size_t i, const VMFieldCache& cache) -> std::byte* {
+  auto value = vm->registers()[i];
+  if (!vm->is_instance(value)) {
+    return nullptr;
+  }
+  auto* data = VMStructShape::data(value);
+  return VMStructShape::shape_index(data) == cache.shape ? data : nullptr;
+}
+
 template <class VM> struct PrintRegStructField : public Instruction<VM> {
   PrintRegStructField(std::size_t i, std::size_t adr) : _i(i), _adr(adr) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("PrintRegStructField " + std::to_string(_i) + " " + std::to_string(_adr));
-    auto& v = std::get<VMStruct>(vm->registers()[_i]).get_field(_adr);
-    VMType field_value = std::get<VMPrimitive>(v);
-    auto res = ::to_string(field_value);
-    if (res.ok()) {
-      std::cout << res.result();
-      std::flush(std::cout);
-      vm->inc_pc();
-      return true;
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg(
+        [&] { return "PrintRegStructField " + std::to_string(code.a) + " " + std::to_string(field_index(code)); });
+    auto& cache = vm->field_cache(field_slot(code));
+    const auto* data = cached_struct(vm, code.a, cache);
+    vm->profiler().inline_cache(OpCode::PRINT_REG_STRUCT_FIELD, data != nullptr);
+    if (data == nullptr) {
+      VMStructShape::Field field{};
+      data = struct_field(vm, code.a, field_index(code), field);
+      if (data == nullptr) {
+        return struct_field_error(code.a, field_index(code));
+      }
+      cache.shape = VMStructShape::shape_index(data);
+      cache.field = field;
     }
-    return res.error_value();
+    auto res = vm->output().write(VMStructShape::load(data, cache.field), vm->heap());
+    if (!res.ok()) {
+      return res.error_value();
+    }
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::PRINT_REG_STRUCT_FIELD, .a = operand16(_i), .c = field_operand(_adr, vm->add_field_cache())};
   }
-
   auto to_string() const -> std::string override {
     return "PrintRegStructField " + std::to_string(_i) + " " + std::to_string(_adr);
   }
@@ -408,24 +652,24 @@ template <class VM> struct Call : public Instruction<VM> {
   Call(const VMType& fname) : _fname(fname) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    std::string fname = vm_type_get<std::string>(_fname).result_or("");
-    VM::P::print_dbg("Call " + fname);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    const auto& entry = vm->function_entry(code.c);
+    VM::P::print_dbg([&] { return "Call " + entry.name(); });
 
-    const auto& entry = vm->function_entry(fname);
-    vm->make_stack_frame();
+    vm->enter_function(code.c);
     if (vm->registers().size() <= entry.argument_count()) {
-      return err("Function " + fname + " not enough registers to store arguments");
+      return err("Function " + entry.name() + " not enough registers to store arguments");
     }
     for (uint8_t i = 0; i < entry.argument_count(); ++i) {
-      auto value = vm->stack_top();
-      vm->registers()[i] = value;
-      vm->stack_pop();
+      vm->registers()[i] = vm->stack_pop();
     }
-    vm->set_pc(entry.address());
+    vm->run_compiled();
     return true;
   }
-
+  // links the call against the function section of the VM
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CALL, .c = vm->link_function(vm_type_get<std::string>(_fname).result())};
+  }
   auto to_string() const -> std::string override {
     return "Call " + vm_type_get<std::string>(_fname).result_or("Unknown");
   }
@@ -438,25 +682,18 @@ template <class VM> struct CallNative : public Instruction<VM> {
   CallNative(const VMType& fname) : _fname(fname) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    std::string fname = vm_type_get<std::string>(_fname).result_or("");
-    VM::P::print_dbg("CallNative " + fname);
-
-    const auto& entry = vm->native_function_entry(fname);
-    std::vector<VMType> args;
-    for (uint8_t i = 0; i < entry.argument_count(); ++i) {
-      auto value = vm->stack_top();
-      args.push_back(value);
-      vm->stack_pop();
-    }
-    auto res = entry(vm, args);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "CallNative " + vm->native_function_entry(code.c).name(); });
+    auto res = vm->call_native(code.c);
     if (!res) {
       return res;
     }
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CALL_NATIVE, .c = vm->link_native_function(vm_type_get<std::string>(_fname).result())};
+  }
   auto to_string() const -> std::string override {
     return "CallNative " + vm_type_get<std::string>(_fname).result_or("Unknown");
   }
@@ -465,14 +702,48 @@ private:
   VMType _fname;
 };
 
+// Calls fname in a register window which starts at c(first) of the caller.
+// c(first)... hold the arguments and c(first) receives the return value, the
+// registers from c(first) upwards are clobbered by the callee.
+template <class VM> struct CallR : public Instruction<VM> {
+  CallR(const VMType& fname, std::size_t first) : _fname(fname), _first(first) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    const auto& entry = vm->function_entry(code.c);
+    VM::P::print_dbg([&] { return "CallR " + entry.name() + " " + std::to_string(code.a); });
+    if (code.a + entry.argument_count() > VM::REGISTER_COUNT) {
+      return err("Function " + entry.name() + " arguments exceed the register window");
+    }
+    vm->enter_function(code.c, code.a, code.a);
+    vm->run_compiled();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CALL_R,
+            .a = operand16(_first),
+            .c = vm->link_function(vm_type_get<std::string>(_fname).result())};
+  }
+  auto to_string() const -> std::string override {
+    return "CallR " + vm_type_get<std::string>(_fname).result_or("Unknown") + " " + std::to_string(_first);
+  }
+
+private:
+  VMType _fname;
+  std::size_t _first;
+};
 template <class VM> struct RetVoid : public Instruction<VM> {
   RetVoid() {
   }
-  auto execute(VM* vm) -> InstructionResult override {
-    vm->restore_from_call_stack();
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    UNUSED(code);
+    vm->return_void();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::RET_VOID};
+  }
   auto to_string() const -> std::string override {
     return "RetVoid";
   }
@@ -482,14 +753,16 @@ template <class VM> struct Return : public Instruction<VM> {
   Return(std::size_t i) : _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("RetVoid");
-    const VMType ret_value = vm->registers()[_i];
-    vm->restore_from_call_stack();
-    vm->stack_push(ret_value);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "RetVoid"; });
+    const VMValue ret_value = vm->registers()[code.a];
+    vm->return_from_call(ret_value);
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::RETURN, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
     return "Return " + std::to_string(_i);
   }
@@ -498,56 +771,104 @@ public:
   std::size_t _i;
 };
 
+// reg(i) = new struct, fields holds the type and default value of every field
 template <class VM> struct StructCreate : public Instruction<VM> {
-  StructCreate(std::size_t i, std::size_t sz) : _i(i), _sz(sz) {
+  StructCreate(std::size_t i, std::vector<VMStructTypes> fields) : _i(i), _fields(std::move(fields)) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("StructCreate " + std::to_string(_i) + " " + std::to_string(_sz));
-    vm->registers()[_i] = VMStruct(_sz);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "StructCreate " + std::to_string(code.a) + " " + std::to_string(code.b); });
+    auto value = vm->make_struct(code.b);
+    if (!value.ok()) {
+      return err("StructCreate: " + value.error_value().msg());
+    }
+    vm->registers()[code.a] = value.result();
     vm->inc_pc();
     return true;
   }
+  // b is the shape, c the range of its default values in the field constants
+  auto lower(VM* vm) const -> Bytecode override {
+    auto [first, shape] = vm->add_struct_shape(_fields);
+    return {.op = OpCode::STRUCT_CREATE,
+            .a = operand16(_i),
+            .b = shape,
+            .c = (static_cast<std::uint64_t>(_fields.size()) << 32) | first};
+  }
   auto to_string() const -> std::string override {
-    return "StructCreate " + std::to_string(_i) + " " + std::to_string(_sz);
+    return "StructCreate " + std::to_string(_i) + " " + std::to_string(_fields.size());
   }
 
 private:
   std::size_t _i;
-  std::size_t _sz;
+  std::vector<VMStructTypes> _fields;
 };
 
-template <class VM> struct AddField : public Instruction<VM> {
-  AddField(std::size_t i, const VMStructTypes& type) : _i(i), _type(type) {
+// reg(dst) = reg(src).field
+template <class VM> struct GetField : public Instruction<VM> {
+  GetField(std::size_t dst, std::size_t src, std::size_t field) : _dst(dst), _src(src), _field(field) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    auto& s = std::get<VMStruct>(vm->registers()[_i]);
-    s.add_field(_type);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "GetField " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VMStructShape::Field field{};
+    const auto* data = struct_field(vm, code.b, code.c, field);
+    if (data == nullptr) {
+      return struct_field_error(code.b, code.c);
+    }
+    vm->registers()[code.a] = VMStructShape::load(data, field);
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::GET_FIELD, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_src), .c = _field};
+  }
   auto to_string() const -> std::string override {
-    return "AddField ";
+    return "GetField " + std::to_string(_dst) + " " + std::to_string(_src) + " " + std::to_string(_field);
   }
 
 private:
-  std::size_t _i;
-  VMStructTypes _type;
+  std::size_t _dst;
+  std::size_t _src;
+  std::size_t _field;
 };
 
+// reg(i).field_adr = value, numeric values are widened to the type of the field
 template <class VM> struct SetField : public Instruction<VM> {
   SetField(std::size_t i, std::size_t field_adr, const VMStructTypes& type)
       : _i(i), _field_adr(field_adr), _type(type) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    auto& s = std::get<VMStruct>(vm->registers()[_i]);
-    s.set_field(_field_adr, _type);
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "SetField " + std::to_string(code.a) + " " + std::to_string(field_index(code)); });
+    auto& cache = vm->field_cache(field_slot(code));
+    auto* data = cached_struct(vm, code.a, cache);
+    vm->profiler().inline_cache(OpCode::SET_FIELD, data != nullptr);
+    if (data == nullptr) {
+      // the value is a constant of the site, only the shape of the struct can change
+      VMStructShape::Field field{};
+      data = struct_field(vm, code.a, field_index(code), field);
+      if (data == nullptr) {
+        return struct_field_error(code.a, field_index(code));
+      }
+      auto value = VMStructShape::convert(field, vm->field_value(code.b));
+      if (!value) {
+        return err("type mismatch in SetField of field " + std::to_string(field_index(code)));
+      }
+      cache = {.shape = VMStructShape::shape_index(data), .field = field, .value = *value};
+    }
+    VMStructShape::store_converted(data, cache.field, cache.value);
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::SET_FIELD,
+            .a = operand16(_i),
+            .b = vm->add_field_constant(_type),
+            .c = field_operand(_field_adr, vm->add_field_cache())};
+  }
   auto to_string() const -> std::string override {
     return "SetField " + std::to_string(_i) + " " + std::to_string(_field_adr);
   }
@@ -558,85 +879,112 @@ private:
   VMStructTypes _type;
 };
 
+// reg(i) = address of size new bytes
 template <class VM> struct Allocate : public Instruction<VM> {
-  Allocate(std::size_t size) : _size(size) {
+  Allocate(std::size_t size, std::size_t i = 9) : _size(size), _i(i) {
   }
 
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Allocate " + std::to_string(_size));
-    VMAddress adr = vm->allocate(_size);
-    vm->registers()[9] = adr;
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Allocate " + std::to_string(code.c) + " " + std::to_string(code.a); });
+    vm->registers()[code.a] = vm->allocate(code.c);
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::ALLOCATE, .a = operand16(_i), .c = _size};
+  }
   auto to_string() const -> std::string override {
-    return "Allocate " + std::to_string(_size);
+    return "Allocate " + std::to_string(_size) + " " + std::to_string(_i);
   }
 
 private:
   std::size_t _size;
+  std::size_t _i;
 };
 
+// free(reg(i)), an address of Allocate or a struct of StructCreate, which is
+// reset to the null struct
 template <class VM> struct Deallocate : public Instruction<VM> {
-  Deallocate() {
-  }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("Deallocate ");
-    const VMType& adrT = vm->registers()[9];
-    const VMAddress& adr = std::get<VMAddress>(adrT);
-    vm->deallocate(adr);
+  Deallocate(std::size_t i = 9) : _i(i) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "Deallocate " + std::to_string(code.a); });
+    auto& value = vm->registers()[code.a];
+    if (value.is_struct()) {
+      if (!vm->is_instance(value)) {
+        return err("Deallocate: register " + std::to_string(code.a) + " holds no struct of StructCreate");
+      }
+      vm->deallocate(VMAddress{value.handle()});
+      value = VMValue::struct_handle(0);
+    } else if (value.is_address()) {
+      vm->deallocate(value.as_address());
+    } else {
+      return err("Deallocate: register " + std::to_string(code.a) + " holds no address or struct");
+    }
     vm->inc_pc();
     return true;
   }
-
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::DEALLOCATE, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
-    return "Deallocate";
+    return "Deallocate " + std::to_string(_i);
   }
+
+private:
+  std::size_t _i;
 };
 
+// the value on top of the stack to the bytes at reg(i)
 template <class VM> struct WriteMem : public Instruction<VM> {
-  WriteMem() {
-  }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("WriteMem");
-    auto valueT = vm->stack_top();
-    auto value_and_size = get_data_ptr_and_size(valueT);
-    vm->stack_pop();
-    char* ptr = reinterpret_cast<char*>((std::get<VMAddress>(vm->registers()[9])).get());
-    for (std::size_t i = 0; std::cmp_less(i, value_and_size.second); ++i) {
-      *(ptr + i) = reinterpret_cast<const char*>(value_and_size.first)[i];
+  WriteMem(std::size_t i = 9) : _i(i) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "WriteMem " + std::to_string(code.a); });
+    char* ptr = reinterpret_cast<char*>(vm->registers()[code.a].as_address().get());
+    auto value = vm->stack_pop();
+    if (value.is_string()) {
+      auto str = vm->heap().string(value);
+      std::copy(str.begin(), str.end(), ptr);
+      vm->inc_pc();
+      return true;
     }
+    auto valueT = vm->heap().unbox(value);
+    auto value_and_size = get_data_ptr_and_size(valueT);
+    std::memcpy(ptr, value_and_size.first, value_and_size.second);
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::WRITE_MEM, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
-    return "WriteMem";
+    return "WriteMem " + std::to_string(_i);
   }
+
+private:
+  std::size_t _i;
 };
 
-template <class T> auto convert_to_primary(char* ptr, int sz) -> VMType {
-  T res;
-  char* p = reinterpret_cast<char*>(&res);
-  for (std::size_t i = 0; std::cmp_less(i, sz); ++i) {
-    *(p + i) = *(ptr + i);
-  }
+template <class T> auto convert_to_primary(char* ptr, int sz) -> VMValue {
+  T res{};
+  std::memcpy(&res, ptr, std::min(static_cast<std::size_t>(sz), sizeof(T)));
   return res;
 }
 
+// pops size and type and pushes the value read from the bytes at reg(i)
 template <class VM> struct ReadMem : public Instruction<VM> {
-  ReadMem() {
-  }
-  auto execute(VM* vm) -> InstructionResult override {
-    VM::P::print_dbg("ReadMem");
-    char* ptr = reinterpret_cast<char*>((std::get<VMAddress>(vm->registers()[9])).get());
-    auto sizeT = vm->stack_top();
-    auto size = std::get<int>(std::get<VMPrimitive>(sizeT));
-    vm->stack_pop();
-    auto typeT = vm->stack_top();
-    auto type = std::get<int>(std::get<VMPrimitive>(typeT));
-    vm->stack_pop();
-    VMType result;
+  ReadMem(std::size_t i = 9) : _i(i) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "ReadMem " + std::to_string(code.a); });
+    char* ptr = reinterpret_cast<char*>(vm->registers()[code.a].as_address().get());
+    auto size = vm->stack_pop().as_int();
+    auto type = vm->stack_pop().as_int();
+    VMValue result;
     switch (static_cast<VMTypeKind>(type)) {
     case VMTypeKind::VM_INT:
       result = convert_to_primary<int>(ptr, size);
@@ -653,13 +1001,9 @@ template <class VM> struct ReadMem : public Instruction<VM> {
     case VMTypeKind::VM_BOOL:
       result = convert_to_primary<bool>(ptr, size);
       break;
-    case VMTypeKind::VM_STRING: {
-      std::string res;
-      for (std::size_t i = 0; std::cmp_less(i, size); ++i) {
-        res += *(ptr + i);
-      }
-      result = res;
-    } break;
+    case VMTypeKind::VM_STRING:
+      result = vm->heap().make_string(std::string_view(ptr, static_cast<std::size_t>(size)));
+      break;
 
     case VMTypeKind::VM_STRUCT:
     case VMTypeKind::VM_STRUCT_PTR:
@@ -671,38 +1015,967 @@ template <class VM> struct ReadMem : public Instruction<VM> {
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::READ_MEM, .a = operand16(_i)};
+  }
   auto to_string() const -> std::string override {
-    return "ReadMem";
+    return "ReadMem " + std::to_string(_i);
   }
 
 private:
+  std::size_t _i;
 };
 
-// stack[stack_adr] = c(reg_adr)
-template <class VM> struct Mov : public Instruction<VM> {
-  Mov(std::size_t stack_adr, std::size_t reg_adr) : _stack_adr(stack_adr), _reg_adr(reg_adr) {
+// byte count in a register, ints and size_ts
+inline auto memory_count(VMValue value) -> std::optional<std::size_t> {
+  if (value.is_int() && value.as_int() >= 0) {
+    return static_cast<std::size_t>(value.as_int());
   }
+  if (value.is_size_t()) {
+    return value.as_size_t();
+  }
+  return std::nullopt;
+}
+
+inline auto memory_error(const char* name, std::size_t i, std::size_t n) -> Error {
+  return err(std::string(name) + ": reg(" + std::to_string(i) + ") holds no address of " + std::to_string(n) +
+             " bytes in the VM memory");
+}
 
+// MemCopy, MemSet and MemCmp take the addresses and the byte count from
+// registers and run libc's memmove, memset and memcmp on the VM memory.
+// Every range has to lie in the committed VM memory.
+
+// copy reg(n) bytes from reg(src) to reg(dst), the ranges may overlap
+template <class VM> struct MemCopy : public Instruction<VM> {
+  MemCopy(std::size_t dst, std::size_t src, std::size_t n) : _dst(dst), _src(src), _n(n) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "MemCopy " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    auto n = memory_count(vm->registers()[code.c]);
+    if (!n) {
+      return err("MemCopy: reg(" + std::to_string(code.c) + ") holds no byte count");
+    }
+    auto* dst = vm->memory_range(vm->registers()[code.a], *n);
+    const auto* src = vm->memory_range(vm->registers()[code.b], *n);
+    if (dst == nullptr || src == nullptr) {
+      return memory_error("MemCopy", dst == nullptr ? code.a : code.b, *n);
+    }
+    std::memmove(dst, src, *n);
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MEM_COPY, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_src), .c = _n};
+  }
   auto to_string() const -> std::string override {
-    return "Mov " + std::to_string(_stack_adr) + " " + std::to_string(_reg_adr);
+    return "MemCopy " + std::to_string(_dst) + " " + std::to_string(_src) + " " + std::to_string(_n);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _src;
+  std::size_t _n;
+};
+
+// set reg(n) bytes at reg(dst) to the low byte of the int in reg(value)
+template <class VM> struct MemSet : public Instruction<VM> {
+  MemSet(std::size_t dst, std::size_t value, std::size_t n) : _dst(dst), _value(value), _n(n) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "MemSet " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    auto value = vm->registers()[code.b];
+    auto n = memory_count(vm->registers()[code.c]);
+    if (!value.is_int() || !n) {
+      return err("MemSet: value and byte count have to be ints");
+    }
+    auto* dst = vm->memory_range(vm->registers()[code.a], *n);
+    if (dst == nullptr) {
+      return memory_error("MemSet", code.a, *n);
+    }
+    std::memset(dst, value.as_int(), *n);
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MEM_SET, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_value), .c = _n};
+  }
+  auto to_string() const -> std::string override {
+    return "MemSet " + std::to_string(_dst) + " " + std::to_string(_value) + " " + std::to_string(_n);
   }
-  auto execute(VM* vm) -> InstructionResult override {
-    vm->store_on_stack(_stack_adr, vm->registers()[_reg_adr]);
+
+private:
+  std::size_t _dst;
+  std::size_t _value;
+  std::size_t _n;
+};
+
+// reg(dst) = -1, 0 or 1 as the reg(n) bytes at reg(lhs) compare to the ones at reg(rhs)
+template <class VM> struct MemCmp : public Instruction<VM> {
+  MemCmp(std::size_t dst, std::size_t lhs, std::size_t rhs, std::size_t n) : _dst(dst), _lhs(lhs), _rhs(rhs), _n(n) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    std::size_t lhs_reg = code.b & 0xFFFF;
+    std::size_t rhs_reg = code.b >> 16;
+    VM::P::print_dbg([&] {
+      return "MemCmp " + std::to_string(code.a) + " " + std::to_string(lhs_reg) + " " + std::to_string(rhs_reg) + " " +
+             std::to_string(code.c);
+    });
+    auto n = memory_count(vm->registers()[code.c]);
+    if (!n) {
+      return err("MemCmp: reg(" + std::to_string(code.c) + ") holds no byte count");
+    }
+    const auto* lhs = vm->memory_range(vm->registers()[lhs_reg], *n);
+    const auto* rhs = vm->memory_range(vm->registers()[rhs_reg], *n);
+    if (lhs == nullptr || rhs == nullptr) {
+      return memory_error("MemCmp", lhs == nullptr ? lhs_reg : rhs_reg, *n);
+    }
+    int res = std::memcmp(lhs, rhs, *n);
+    vm->registers()[code.a] = VMValue((res > 0) - (res < 0));
     vm->inc_pc();
     return true;
   }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MEM_CMP,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs | (_rhs << 16)),
+            .c = _n};
+  }
+  auto to_string() const -> std::string override {
+    return "MemCmp " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs) + " " +
+           std::to_string(_n);
+  }
 
 private:
-  std::size_t _stack_adr;
-  std::size_t _reg_adr;
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+  std::size_t _n;
+};
+
+// [reg(base) + reg(index) * scale + offset] of LoadMem and StoreMem
+struct MemoryOperand {
+  static constexpr std::size_t NO_INDEX = 0xFF;
+
+  std::size_t base;
+  std::size_t index = NO_INDEX;
+  std::size_t scale = 1;
+  std::int64_t offset = 0;
 };
 
-/*template <class VM>
-structing InstructionType =
-    std::variant<Load<VM>, CLoad<VM>, INDLoad<VM>, SLoad<VM>, Store<VM>, INDStore<VM>, Add<VM>, CAdd<VM>, INDAdd<VM>,
-                 If<VM>, Goto<VM>, Halt<VM>, Push<VM>, Pop<VM>, Print<VM>, PrintRegStructField<VM>, Call<VM>,
-                 CallNative<VM>, RetVoid<VM>, Return<VM>, StructCreate<VM>, AddField<VM>, SetField<VM>, Allocate<VM>,
-                 Deallocate<VM>, WriteMem<VM>, ReadMem<VM>, Mov<VM>>;
+inline auto to_string(const MemoryOperand& adr) -> std::string {
+  std::string res = "[" + std::to_string(adr.base);
+  if (adr.index != MemoryOperand::NO_INDEX) {
+    res += " + " + std::to_string(adr.index) + "*" + std::to_string(adr.scale);
+  }
+  if (adr.offset != 0) {
+    res += (adr.offset < 0 ? " - " : " + ") + std::to_string(adr.offset < 0 ? -adr.offset : adr.offset);
+  }
+  return res + "]";
+}
+
+inline auto is_memory_scale(std::size_t scale) -> bool {
+  return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+// bytes of a value of kind in VM memory, 0 for kinds which are not stored there
+inline auto memory_size(VMTypeKind kind) -> std::size_t {
+  switch (kind) {
+  case VMTypeKind::VM_INT:
+    return sizeof(int);
+  case VMTypeKind::VM_FLOAT:
+    return sizeof(float);
+  case VMTypeKind::VM_DOUBLE:
+    return sizeof(double);
+  case VMTypeKind::VM_BOOL:
+    return 1;
+  case VMTypeKind::VM_SIZE_T:
+  case VMTypeKind::VM_ADDRESS:
+    return sizeof(std::size_t);
+  default:
+    return 0;
+  }
+}
+
+// b holds base, index, log2(scale) and the VMTypeKind in one byte each, c the offset
+inline auto memory_operand(const MemoryOperand& adr, std::size_t kind) -> std::uint32_t {
+  if (!is_memory_scale(adr.scale)) {
+    panic("invalid scale " + std::to_string(adr.scale) + " of memory operand " + to_string(adr));
+  }
+  auto shift = static_cast<std::uint32_t>(std::countr_zero(adr.scale));
+  return static_cast<std::uint32_t>((adr.base & 0xFF) | ((adr.index & 0xFF) << 8) | (shift << 16) | (kind << 24));
+}
+inline auto memory_base(const Bytecode& code) -> std::size_t {
+  return code.b & 0xFF;
+}
+inline auto memory_index(const Bytecode& code) -> std::size_t {
+  return (code.b >> 8) & 0xFF;
+}
+inline auto memory_shift(const Bytecode& code) -> std::size_t {
+  return (code.b >> 16) & 0xFF;
+}
+inline auto memory_kind(const Bytecode& code) -> VMTypeKind {
+  return static_cast<VMTypeKind>(code.b >> 24);
+}
+inline auto memory_operand_string(const Bytecode& code) -> std::string {
+  return to_string(MemoryOperand{.base = memory_base(code),
+                                 .index = memory_index(code),
+                                 .scale = std::size_t{1} << std::min<std::size_t>(memory_shift(code), 63),
+                                 .offset = static_cast<std::int64_t>(code.c)});
+}
+
+// the bytes of a memory operand, nullptr if base holds no address, index no
+// int or the value of kind does not lie in the committed VM memory
+template <class VM> auto memory_address(VM* vm, const Bytecode& code) -> std::byte* {
+  auto base = vm->registers()[memory_base(code)];
+  std::size_t size = memory_size(memory_kind(code));
+  if (!base.is_address() || size == 0 || memory_shift(code) > 3) {
+    return nullptr;
+  }
+  // unsigned arithmetic wraps, an address below base ends up behind the memory
+  std::size_t adr = base.as_address().get() + code.c;
+  if (memory_index(code) != MemoryOperand::NO_INDEX) {
+    auto index = vm->registers()[memory_index(code)];
+    if (!index.is_int() && !index.is_size_t()) {
+      return nullptr;
+    }
+    auto i = index.is_int() ? static_cast<std::size_t>(std::int64_t{index.as_int()}) : index.as_size_t();
+    adr += i << memory_shift(code);
+  }
+  return vm->memory_range(adr, size);
+}
+
+inline auto memory_operand_error(const char* name, const Bytecode& code) -> Error {
+  return err(std::string(name) + ": invalid address " + memory_operand_string(code));
+}
+
+// values in VM memory are stored unboxed: int, float, size_t, double, bool
+// and addresses
+inline auto load_memory(const std::byte* ptr, VMTypeKind kind) -> ResultOr<VMValue> {
+  auto read = [ptr]<class T>(T value) {
+    std::memcpy(&value, ptr, sizeof(T));
+    return value;
+  };
+  switch (kind) {
+  case VMTypeKind::VM_INT:
+    return VMValue(read(int{}));
+  case VMTypeKind::VM_FLOAT:
+    return VMValue(read(float{}));
+  case VMTypeKind::VM_DOUBLE:
+    return VMValue(read(double{}));
+  case VMTypeKind::VM_BOOL:
+    return VMValue(std::to_integer<bool>(*ptr));
+  case VMTypeKind::VM_SIZE_T:
+  case VMTypeKind::VM_ADDRESS: {
+    auto value = read(std::size_t{});
+    if (!VMValue::fits_payload(value)) {
+      return err("value " + std::to_string(value) + " exceeds the 48 bit range of VMValue");
+    }
+    return kind == VMTypeKind::VM_SIZE_T ? VMValue(value) : VMValue(VMAddress{value});
+  }
+  default:
+    return err("kind " + std::to_string(static_cast<int>(kind)) + " is not stored in memory");
+  }
+}
+
+// false if the value can not be widened to kind
+inline auto store_memory(std::byte* ptr, VMTypeKind kind, VMValue value) -> bool {
+  auto write = [ptr]<class T>(T v) {
+    std::memcpy(ptr, &v, sizeof(T));
+    return true;
+  };
+  if (kind == VMTypeKind::VM_ADDRESS) {
+    return value.is_address() && write(value.as_address().get());
+  }
+  auto converted = VMStructShape::convert({.kind = kind, .offset = 0}, value);
+  if (!converted) {
+    return false;
+  }
+  switch (kind) {
+  case VMTypeKind::VM_INT:
+    return write(converted->as_int());
+  case VMTypeKind::VM_FLOAT:
+    return write(converted->as_float());
+  case VMTypeKind::VM_SIZE_T:
+    return write(converted->as_size_t());
+  case VMTypeKind::VM_DOUBLE:
+    return write(converted->as_double());
+  case VMTypeKind::VM_BOOL:
+    return write(converted->as_bool());
+  default:
+    return false;
+  }
+}
+
+// reg(dst) = value of kind at [reg(base) + reg(index) * scale + offset]
+template <class VM> struct LoadMem : public Instruction<VM> {
+  LoadMem(std::size_t dst, const MemoryOperand& adr, std::size_t kind) : _dst(dst), _adr(adr), _kind(kind) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "LoadMem " + std::to_string(code.a) + " " + memory_operand_string(code) + " " +
+             std::to_string(static_cast<int>(memory_kind(code)));
+    });
+    const auto* ptr = memory_address(vm, code);
+    if (ptr == nullptr) {
+      return memory_operand_error("LoadMem", code);
+    }
+    auto value = load_memory(ptr, memory_kind(code));
+    if (!value.ok()) {
+      return err("LoadMem: " + value.error_value().msg());
+    }
+    vm->registers()[code.a] = value.result();
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::LOAD_MEM,
+            .a = operand16(_dst),
+            .b = memory_operand(_adr, _kind),
+            .c = static_cast<std::uint64_t>(_adr.offset)};
+  }
+  auto to_string() const -> std::string override {
+    return "LoadMem " + std::to_string(_dst) + " " + ::to_string(_adr) + " " + std::to_string(_kind);
+  }
+
+private:
+  std::size_t _dst;
+  MemoryOperand _adr;
+  std::size_t _kind;
+};
+
+// value of kind at [reg(base) + reg(index) * scale + offset] = reg(src), numeric
+// values are widened to kind
+template <class VM> struct StoreMem : public Instruction<VM> {
+  StoreMem(std::size_t src, const MemoryOperand& adr, std::size_t kind) : _src(src), _adr(adr), _kind(kind) {
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "StoreMem " + std::to_string(code.a) + " " + memory_operand_string(code) + " " +
+             std::to_string(static_cast<int>(memory_kind(code)));
+    });
+    auto* ptr = memory_address(vm, code);
+    if (ptr == nullptr) {
+      return memory_operand_error("StoreMem", code);
+    }
+    if (!store_memory(ptr, memory_kind(code), vm->registers()[code.a])) {
+      return err("StoreMem: reg(" + std::to_string(code.a) + ") can not be stored as kind " +
+                 std::to_string(static_cast<int>(memory_kind(code))));
+    }
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::STORE_MEM,
+            .a = operand16(_src),
+            .b = memory_operand(_adr, _kind),
+            .c = static_cast<std::uint64_t>(_adr.offset)};
+  }
+  auto to_string() const -> std::string override {
+    return "StoreMem " + std::to_string(_src) + " " + ::to_string(_adr) + " " + std::to_string(_kind);
+  }
+
+private:
+  std::size_t _src;
+  MemoryOperand _adr;
+  std::size_t _kind;
+};
+
+// stack[stack_adr] = c(reg_adr)
+template <class VM> struct Mov : public Instruction<VM> {
+  Mov(std::size_t stack_adr, std::size_t reg_adr) : _stack_adr(stack_adr), _reg_adr(reg_adr) {
+  }
+
+  auto to_string() const -> std::string override {
+    return "Mov " + std::to_string(_stack_adr) + " " + std::to_string(_reg_adr);
+  }
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    vm->store_on_stack(code.c, vm->registers()[code.a]);
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MOV, .a = operand16(_reg_adr), .c = _stack_adr};
+  }
+
+private:
+  std::size_t _stack_adr;
+  std::size_t _reg_adr;
+};
+
+// Three address instructions
+// --------------------------
+// Operate directly on the register file instead of the accumulator c(0):
+// a is the destination register, b the left hand register and c either the
+// right hand register (RRR) or a boxed constant (RRI).
+
+template <class VM> auto store_result(VM* vm, std::size_t dst, const ResultOr<VMValue>& res) -> InstructionResult {
+  if (!res.ok()) {
+    return res.error_value();
+  }
+  vm->registers()[dst] = res.result();
+  vm->inc_pc();
+  return true;
+}
+
+// c(dst) = c(lhs) + c(rhs)
+template <class VM> struct AddRRR : public Instruction<VM> {
+  AddRRR(std::size_t dst, std::size_t lhs, std::size_t rhs) : _dst(dst), _lhs(lhs), _rhs(rhs) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "AddRRR " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, add(registers[code.b], registers[code.c], vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::ADD_RRR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_lhs), .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "AddRRR " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+};
+
+// c(dst) = c(lhs) + i
+template <class VM> struct AddRRI : public Instruction<VM> {
+  AddRRI(std::size_t dst, std::size_t lhs, const VMType& value) : _dst(dst), _lhs(lhs), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "AddRRI " + std::to_string(code.a) + " " + std::to_string(code.b) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, add(registers[code.b], VMValue::from_bits(code.c), vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::ADD_RRI,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "AddRRI " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  VMType _value;
+};
+
+// c(dst) = c(lhs) - c(rhs)
+template <class VM> struct SubRRR : public Instruction<VM> {
+  SubRRR(std::size_t dst, std::size_t lhs, std::size_t rhs) : _dst(dst), _lhs(lhs), _rhs(rhs) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "SubRRR " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, sub(registers[code.b], registers[code.c], vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::SUB_RRR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_lhs), .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "SubRRR " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+};
+
+// c(dst) = c(lhs) - i
+template <class VM> struct SubRRI : public Instruction<VM> {
+  SubRRI(std::size_t dst, std::size_t lhs, const VMType& value) : _dst(dst), _lhs(lhs), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "SubRRI " + std::to_string(code.a) + " " + std::to_string(code.b) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, sub(registers[code.b], VMValue::from_bits(code.c), vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::SUB_RRI,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "SubRRI " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  VMType _value;
+};
+
+// c(dst) = c(lhs) * c(rhs)
+template <class VM> struct MulRRR : public Instruction<VM> {
+  MulRRR(std::size_t dst, std::size_t lhs, std::size_t rhs) : _dst(dst), _lhs(lhs), _rhs(rhs) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "MulRRR " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, mult(registers[code.b], registers[code.c], vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MUL_RRR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_lhs), .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "MulRRR " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+};
+
+// c(dst) = c(lhs) * i
+template <class VM> struct MulRRI : public Instruction<VM> {
+  MulRRI(std::size_t dst, std::size_t lhs, const VMType& value) : _dst(dst), _lhs(lhs), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "MulRRI " + std::to_string(code.a) + " " + std::to_string(code.b) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, mult(registers[code.b], VMValue::from_bits(code.c), vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::MUL_RRI,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "MulRRI " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  VMType _value;
+};
+
+// c(dst) = c(lhs) / c(rhs)
+template <class VM> struct DivRRR : public Instruction<VM> {
+  DivRRR(std::size_t dst, std::size_t lhs, std::size_t rhs) : _dst(dst), _lhs(lhs), _rhs(rhs) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "DivRRR " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, div(registers[code.b], registers[code.c], vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::DIV_RRR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_lhs), .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "DivRRR " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+};
+
+// c(dst) = c(lhs) / i
+template <class VM> struct DivRRI : public Instruction<VM> {
+  DivRRI(std::size_t dst, std::size_t lhs, const VMType& value) : _dst(dst), _lhs(lhs), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "DivRRI " + std::to_string(code.a) + " " + std::to_string(code.b) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, div(registers[code.b], VMValue::from_bits(code.c), vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::DIV_RRI,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "DivRRI " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  VMType _value;
+};
+
+// c(dst) = c(lhs) % c(rhs)
+template <class VM> struct ModRRR : public Instruction<VM> {
+  ModRRR(std::size_t dst, std::size_t lhs, std::size_t rhs) : _dst(dst), _lhs(lhs), _rhs(rhs) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "ModRRR " + std::to_string(code.a) + " " + std::to_string(code.b) + " " + std::to_string(code.c);
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, mod(registers[code.b], registers[code.c], vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MOD_RRR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_lhs), .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "ModRRR " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  std::size_t _rhs;
+};
+
+// c(dst) = c(lhs) % i
+template <class VM> struct ModRRI : public Instruction<VM> {
+  ModRRI(std::size_t dst, std::size_t lhs, const VMType& value) : _dst(dst), _lhs(lhs), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "ModRRI " + std::to_string(code.a) + " " + std::to_string(code.b) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    return store_result(vm, code.a, mod(registers[code.b], VMValue::from_bits(code.c), vm->heap()));
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::MOD_RRI,
+            .a = operand16(_dst),
+            .b = static_cast<std::uint32_t>(_lhs),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "ModRRI " + std::to_string(_dst) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _lhs;
+  VMType _value;
+};
+
+// c(dst) = c(src)
+template <class VM> struct MovRR : public Instruction<VM> {
+  MovRR(std::size_t dst, std::size_t src) : _dst(dst), _src(src) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] { return "MovRR " + std::to_string(code.a) + " " + std::to_string(code.b); });
+    VM::P::check_register_bounds(vm, code.a);
+    VM::P::check_register_bounds(vm, code.b);
+    auto registers = vm->registers();
+    registers[code.a] = registers[code.b];
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::MOV_RR, .a = operand16(_dst), .b = static_cast<std::uint32_t>(_src)};
+  }
+  auto to_string() const -> std::string override {
+    return "MovRR " + std::to_string(_dst) + " " + std::to_string(_src);
+  }
+
+private:
+  std::size_t _dst;
+  std::size_t _src;
+};
+
+// c(dst) = i
+template <class VM> struct MovRI : public Instruction<VM> {
+  MovRI(std::size_t dst, const VMType& value) : _dst(dst), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "MovRI " + std::to_string(code.a) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    vm->registers()[code.a] = VMValue::from_bits(code.c);
+    vm->inc_pc();
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::MOV_RI, .a = operand16(_dst), .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "MovRI " + std::to_string(_dst) + " " + ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _dst;
+  VMType _value;
+};
+
+// lower 8 bits of a hold the left hand register, the upper 8 bits the condition
+inline auto compare_operand(std::size_t cond, std::size_t lhs) -> std::uint16_t {
+  return operand16((cond << 8) | (lhs & 0xFF));
+}
+
+// if c(lhs) op c(rhs) jmp target
+// in (0 is <, 1 is >,2 is ==,3 is !=,4 is <=, 5 is >=)
+template <class VM> struct CmpBr : public Instruction<VM> {
+  CmpBr(std::size_t cond, std::size_t lhs, std::size_t rhs, std::size_t target)
+      : _cond(cond), _lhs(lhs), _rhs(rhs), _target(target) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    std::size_t lhs = code.a & 0xFF;
+    std::size_t cond = code.a >> 8;
+    VM::P::print_dbg([&] {
+      return "CmpBr op(" + std::to_string(cond) + ") " + std::to_string(lhs) + " " + std::to_string(code.c) + " jmp: " +
+             std::to_string(code.b);
+    });
+    VM::P::check_register_bounds(vm, lhs);
+    VM::P::check_register_bounds(vm, code.c);
+    auto registers = vm->registers();
+    if (compare(registers[lhs], registers[code.c], cond, vm->heap())) {
+      vm->set_pc(code.b);
+    } else {
+      vm->inc_pc();
+    }
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    UNUSED(vm);
+    return {.op = OpCode::CMP_BR,
+            .a = compare_operand(_cond, _lhs),
+            .b = static_cast<std::uint32_t>(_target),
+            .c = _rhs};
+  }
+  auto to_string() const -> std::string override {
+    return "CmpBr " + std::to_string(_cond) + " " + std::to_string(_lhs) + " " + std::to_string(_rhs) + " " +
+           std::to_string(_target);
+  }
+
+private:
+  std::size_t _cond;
+  std::size_t _lhs;
+  std::size_t _rhs;
+  std::size_t _target;
+};
+
+// if c(lhs) op i jmp target
+template <class VM> struct CmpBrI : public Instruction<VM> {
+  CmpBrI(std::size_t cond, std::size_t lhs, const VMType& value, std::size_t target)
+      : _cond(cond), _lhs(lhs), _value(value), _target(target) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    std::size_t lhs = code.a & 0xFF;
+    std::size_t cond = code.a >> 8;
+    VM::P::print_dbg([&] {
+      return "CmpBrI op(" + std::to_string(cond) + ") " + std::to_string(lhs) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown") + " jmp: " + std::to_string(code.b);
+    });
+    VM::P::check_register_bounds(vm, lhs);
+    auto registers = vm->registers();
+    if (compare(registers[lhs], VMValue::from_bits(code.c), cond, vm->heap())) {
+      vm->set_pc(code.b);
+    } else {
+      vm->inc_pc();
+    }
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CMP_BR_I,
+            .a = compare_operand(_cond, _lhs),
+            .b = static_cast<std::uint32_t>(_target),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "CmpBrI " + std::to_string(_cond) + " " + std::to_string(_lhs) + " " +
+           ::to_string(_value).result_or("Unknown") + " " + std::to_string(_target);
+  }
+
+private:
+  std::size_t _cond;
+  std::size_t _lhs;
+  VMType _value;
+  std::size_t _target;
+};
+
+// Superinstructions, see Fusion.h. Each one keeps the register effects of the
+// sequence it replaces.
+
+// Load i; CAdd k; Store i
+// c(0) = c(i) + k, c(i) = c(0)
+template <class VM> struct IncReg : public Instruction<VM> {
+  IncReg(std::size_t i, const VMType& value) : _i(i), _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "IncReg " + std::to_string(code.a) + " " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    VM::P::check_register_bounds(vm, code.a);
+    auto registers = vm->registers();
+    auto res = add(registers[code.a], VMValue::from_bits(code.c), vm->heap());
+    if (res.ok()) {
+      registers[0] = res.result();
+      registers[code.a] = res.result();
+      vm->inc_pc();
+      return true;
+    }
+    return res.error_value();
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::INC_REG, .a = operand16(_i), .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "IncReg " + std::to_string(_i) + " " + ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  std::size_t _i;
+  VMType _value;
+};
+
+// CLoad k; Return 0
+template <class VM> struct CLoadRet : public Instruction<VM> {
+  CLoadRet(const VMType& value) : _value(value) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    VM::P::print_dbg([&] {
+      return "CLoadRet " + vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown");
+    });
+    vm->return_from_call(VMValue::from_bits(code.c));
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CLOAD_RET, .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "CLoadRet " + ::to_string(_value).result_or("Unknown");
+  }
+
+private:
+  VMType _value;
+};
+
+// Load i; If cond k target
+// c(0) = c(i), if c(0) op k jmp target
+template <class VM> struct CmpImmBranch : public Instruction<VM> {
+  CmpImmBranch(std::size_t i, std::size_t cond, const VMType& value, std::size_t target)
+      : _i(i), _cond(cond), _value(value), _target(target) {
+  }
+
+  static auto execute(VM* vm, const Bytecode& code) -> InstructionResult {
+    std::size_t lhs = code.a & 0xFF;
+    std::size_t cond = code.a >> 8;
+    VM::P::print_dbg([&] {
+      return "CmpImmBranch " + std::to_string(lhs) + " op(" + std::to_string(cond) + ") " +
+             vm->heap().to_string(VMValue::from_bits(code.c)).result_or("Unknown") + " jmp: " + std::to_string(code.b);
+    });
+    VM::P::check_register_bounds(vm, lhs);
+    auto registers = vm->registers();
+    registers[0] = registers[lhs];
+    if (compare(registers[0], VMValue::from_bits(code.c), cond, vm->heap())) {
+      vm->set_pc(code.b);
+    } else {
+      vm->inc_pc();
+    }
+    return true;
+  }
+  auto lower(VM* vm) const -> Bytecode override {
+    return {.op = OpCode::CMP_IMM_BRANCH,
+            .a = compare_operand(_cond, _i),
+            .b = static_cast<std::uint32_t>(_target),
+            .c = vm->heap().constant(_value).bits()};
+  }
+  auto to_string() const -> std::string override {
+    return "CmpImmBranch " + std::to_string(_i) + " " + std::to_string(_cond) + " " +
+           ::to_string(_value).result_or("Unknown") + " " + std::to_string(_target);
+  }
+
+private:
+  std::size_t _i;
+  std::size_t _cond;
+  VMType _value;
+  std::size_t _target;
+};
 
-*/
 #endif
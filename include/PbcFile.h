@@ -0,0 +1,127 @@
+#ifndef PALLADIUM_PBC_FILE_H
+#define PALLADIUM_PBC_FILE_H
+#include "Bytecode.h"
+#include "Util.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Palladium bytecode container (.pbc)
+// -----------------------------------
+// A lowered program as it is executed by the VM, written in native byte
+// order. All offsets are byte offsets from the start of the file.
+//
+// [ PbcHeader | functions | constant pool | string index | string bytes | code ]
+//
+// - functions: PbcFunction records of the functions followed by the natives,
+//   the names live in the string bytes
+// - constant pool: boxed VMValues of the struct fields (StructCreate, SetField)
+// - string index: PbcString records, entry i is the string handle i of the heap
+// - code: Bytecode records, aligned to 16 bytes
+//
+// Boxed string operands in the code are heap handles, so the strings have to
+// be loaded into an empty heap in index order.
+
+struct PbcHeader {
+  static constexpr std::uint32_t MAGIC = 0x00434250; // "PBC\0"
+  static constexpr std::uint16_t VERSION = 3;
+  static constexpr std::uint16_t BYTE_ORDER_MARK = 0x0102;
+
+  std::uint32_t magic = MAGIC;
+  std::uint16_t version = VERSION;
+  std::uint16_t byte_order = BYTE_ORDER_MARK;
+  std::uint32_t function_count = 0;
+  std::uint32_t constant_count = 0;
+  std::uint32_t string_count = 0;
+  std::uint32_t code_count = 0;
+  std::uint64_t function_offset = 0;
+  std::uint64_t constant_offset = 0;
+  std::uint64_t string_offset = 0;
+  std::uint64_t code_offset = 0;
+  std::uint64_t file_size = 0;
+};
+
+struct PbcString {
+  std::uint64_t offset;
+  std::uint64_t length;
+};
+
+// Native functions are registered by the host, the loader checks that the
+// VM has them at the same index. Their argument count is the registered one,
+// the count in the file is ignored.
+struct PbcFunction {
+  static constexpr std::uint8_t FUNCTION = 0;
+  static constexpr std::uint8_t NATIVE = 1;
+
+  PbcString name;
+  std::uint32_t address;
+  std::uint8_t argument_count;
+  std::uint8_t kind;
+  std::uint8_t padding[2] = {};
+};
+
+static_assert(sizeof(PbcHeader) == 64, "pbc header layout changed");
+static_assert(sizeof(PbcFunction) == 24, "pbc function layout changed");
+
+// everything write_pbc needs, filled by VirtualMachine::image()
+struct PbcImage {
+  struct Function {
+    std::string name;
+    std::uint8_t argument_count;
+    std::size_t address;
+    std::uint8_t kind = PbcFunction::FUNCTION;
+  };
+
+  std::vector<Function> functions;
+  std::vector<std::uint64_t> constants;
+  std::vector<std::string> strings;
+  std::vector<Bytecode> code;
+};
+
+auto write_pbc(std::ostream& out, const PbcImage& image) -> ResultOr<bool>;
+
+// Read only mapping of a .pbc file. The header, the offsets, the opcodes, the
+// jump targets and the register, native and string operands are validated
+// once, afterwards the VM executes the code directly from the mapped pages.
+// Copies share the mapping.
+class PbcFile {
+public:
+  static auto open(const std::string& path) -> ResultOr<PbcFile>;
+
+  auto header() const -> const PbcHeader& {
+    return *reinterpret_cast<const PbcHeader*>(_data.get());
+  }
+  auto functions() const -> std::span<const PbcFunction> {
+    return section<PbcFunction>(header().function_offset, header().function_count);
+  }
+  auto constants() const -> std::span<const std::uint64_t> {
+    return section<std::uint64_t>(header().constant_offset, header().constant_count);
+  }
+  auto strings() const -> std::span<const PbcString> {
+    return section<PbcString>(header().string_offset, header().string_count);
+  }
+  auto string(const PbcString& str) const -> std::string_view {
+    return {reinterpret_cast<const char*>(_data.get()) + str.offset, str.length};
+  }
+  auto code() const -> std::span<const Bytecode> {
+    return section<Bytecode>(header().code_offset, header().code_count);
+  }
+
+private:
+  PbcFile(std::shared_ptr<const std::byte> data, std::size_t size) : _data(std::move(data)), _size(size) {
+  }
+  template <class T> auto section(std::uint64_t offset, std::uint32_t count) const -> std::span<const T> {
+    return {reinterpret_cast<const T*>(_data.get() + offset), count};
+  }
+  auto validate() const -> ResultOr<bool>;
+
+  std::shared_ptr<const std::byte> _data;
+  std::size_t _size;
+};
+
+#endif
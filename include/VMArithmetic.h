@@ -0,0 +1,268 @@
+#ifndef PALLADIUM_VM_ARITHMETIC_H
+#define PALLADIUM_VM_ARITHMETIC_H
+#include "Util.h"
+#include "VMValue.h"
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// Arithmetic and comparison on VMValue
+// ------------------------------------
+// int/int and double/double are handled inline in the instruction. Every
+// other pair goes through a table of kernels indexed by (lhs kind, rhs kind):
+// numeric pairs get a kernel specialized for both types, two strings are
+// concatenated and compared on the heap strings, every other pair falls back
+// to the slow path over VMType.
+
+enum class ArithmeticOp { ADD, SUB, MULT, DIV, MOD };
+
+using ArithmeticKernel = ResultOr<VMValue> (*)(VMValue lhs, VMValue rhs, VMHeap& heap);
+using CompareKernel = bool (*)(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap);
+
+auto arithmetic_slow(ArithmeticOp op, VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue>;
+auto compare_slow(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap) -> bool;
+
+namespace kernel {
+// type held by a value of VMValue::kind_index() I, void if it lives in the heap
+template <std::size_t I> struct kind_type {
+  using type = void;
+};
+template <> struct kind_type<0> {
+  using type = double;
+};
+template <> struct kind_type<1> {
+  using type = int;
+};
+template <> struct kind_type<2> {
+  using type = float;
+};
+template <> struct kind_type<3> {
+  using type = std::size_t;
+};
+template <> struct kind_type<4> {
+  using type = bool;
+};
+
+template <class T> constexpr auto unbox(VMValue value) -> T {
+  if constexpr (std::is_same_v<T, double>) {
+    return value.as_double();
+  } else if constexpr (std::is_same_v<T, int>) {
+    return value.as_int();
+  } else if constexpr (std::is_same_v<T, float>) {
+    return value.as_float();
+  } else if constexpr (std::is_same_v<T, std::size_t>) {
+    return value.as_size_t();
+  } else {
+    return value.as_bool();
+  }
+}
+
+// int + - * wrap around in two's complement, the JIT computes them the same way
+template <ArithmeticOp OP> constexpr auto wrapping(int l, int r) -> int {
+  auto ul = static_cast<std::uint32_t>(l);
+  auto ur = static_cast<std::uint32_t>(r);
+  if constexpr (OP == ArithmeticOp::ADD) {
+    return static_cast<int>(ul + ur);
+  } else if constexpr (OP == ArithmeticOp::SUB) {
+    return static_cast<int>(ul - ur);
+  } else {
+    static_assert(OP == ArithmeticOp::MULT, "division has no wrapping form");
+    return static_cast<int>(ul * ur);
+  }
+}
+
+// size_t results outside of the 48 bit payload fail instead of being truncated
+template <class C> auto boxed(C value) -> ResultOr<VMValue> {
+  if constexpr (std::is_same_v<C, std::size_t>) {
+    if (!VMValue::fits_payload(value)) [[unlikely]] {
+      return err("size_t result " + std::to_string(value) + " exceeds the 48 bit range of VMValue");
+    }
+  }
+  return VMValue(value);
+}
+
+// same promotion rules as the VMType operators
+template <ArithmeticOp OP, class L, class R>
+auto numeric(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  UNUSED(heap);
+  using C = std::common_type_t<L, R>;
+  C l = static_cast<C>(unbox<L>(lhs));
+  C r = static_cast<C>(unbox<R>(rhs));
+  if constexpr (std::is_same_v<C, int>) {
+    if constexpr (OP == ArithmeticOp::ADD || OP == ArithmeticOp::SUB || OP == ArithmeticOp::MULT) {
+      return VMValue(wrapping<OP>(l, r));
+    } else {
+      if (r == 0) [[unlikely]] {
+        return err("Division by zero");
+      }
+      // INT_MIN / -1 traps on x86, the quotient wraps to INT_MIN and the remainder is 0
+      if (r == -1) [[unlikely]] {
+        return VMValue(OP == ArithmeticOp::DIV ? wrapping<ArithmeticOp::SUB>(0, l) : 0);
+      }
+      return VMValue(OP == ArithmeticOp::DIV ? l / r : l % r);
+    }
+  } else if constexpr (OP == ArithmeticOp::ADD) {
+    return boxed(l + r);
+  } else if constexpr (OP == ArithmeticOp::SUB) {
+    return boxed(l - r);
+  } else if constexpr (OP == ArithmeticOp::MULT) {
+    return boxed(l * r);
+  } else {
+    if (r == 0) [[unlikely]] {
+      return err("Division by zero");
+    }
+    if constexpr (OP == ArithmeticOp::DIV) {
+      return boxed(l / r);
+    } else if constexpr (std::is_floating_point_v<C>) {
+      return VMValue(std::fmod(l, r));
+    } else {
+      return boxed(l % r);
+    }
+  }
+}
+
+// kind_index() of strings
+inline constexpr std::size_t STRING_KIND = VMValue::STRING_TAG - (VMValue::BOX_PREFIX >> 48);
+
+inline auto concat(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return heap.concat(lhs, rhs);
+}
+
+template <ArithmeticOp OP> auto slow(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic_slow(OP, lhs, rhs, heap);
+}
+
+// cond: 0 is <, 1 is >, 2 is ==, 3 is !=, 4 is <=, 5 is >=
+template <class L, class R>
+auto compare_numeric(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap) -> bool {
+  UNUSED(heap);
+  using C = std::common_type_t<L, R>;
+  C l = static_cast<C>(unbox<L>(lhs));
+  C r = static_cast<C>(unbox<R>(rhs));
+  switch (cond) {
+  case 0:
+    return l < r;
+  case 1:
+    return l > r;
+  case 2:
+    return l == r;
+  case 3:
+    return l != r;
+  case 4:
+    return l <= r;
+  case 5:
+    return l >= r;
+  }
+  return false;
+}
+
+inline auto compare_string(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap) -> bool {
+  const auto& l = heap.vm_string(lhs);
+  const auto& r = heap.vm_string(rhs);
+  switch (cond) {
+  case 0:
+    return l < r;
+  case 1:
+    return l > r;
+  case 2:
+    return l == r;
+  case 3:
+    return l != r;
+  case 4:
+    return l <= r;
+  case 5:
+    return l >= r;
+  }
+  return false;
+}
+
+template <ArithmeticOp OP, std::size_t L, std::size_t R> constexpr auto select_arithmetic() -> ArithmeticKernel {
+  using LT = typename kind_type<L>::type;
+  using RT = typename kind_type<R>::type;
+  if constexpr (OP == ArithmeticOp::ADD && L == STRING_KIND && R == STRING_KIND) {
+    return &concat;
+  } else if constexpr (std::is_void_v<LT> || std::is_void_v<RT>) {
+    return &slow<OP>;
+  } else {
+    return &numeric<OP, LT, RT>;
+  }
+}
+
+template <std::size_t L, std::size_t R> constexpr auto select_compare() -> CompareKernel {
+  using LT = typename kind_type<L>::type;
+  using RT = typename kind_type<R>::type;
+  if constexpr (L == STRING_KIND && R == STRING_KIND) {
+    return &compare_string;
+  } else if constexpr (std::is_void_v<LT> || std::is_void_v<RT>) {
+    return &compare_slow;
+  } else {
+    return &compare_numeric<LT, RT>;
+  }
+}
+
+inline constexpr std::size_t TABLE_SIZE = VMValue::KIND_COUNT * VMValue::KIND_COUNT;
+
+template <ArithmeticOp OP> constexpr auto make_arithmetic_table() -> std::array<ArithmeticKernel, TABLE_SIZE> {
+  return []<std::size_t... I>(std::index_sequence<I...>) {
+    return std::array<ArithmeticKernel, TABLE_SIZE>{
+        select_arithmetic<OP, I / VMValue::KIND_COUNT, I % VMValue::KIND_COUNT>()...};
+  }(std::make_index_sequence<TABLE_SIZE>{});
+}
+
+constexpr auto make_compare_table() -> std::array<CompareKernel, TABLE_SIZE> {
+  return []<std::size_t... I>(std::index_sequence<I...>) {
+    return std::array<CompareKernel, TABLE_SIZE>{
+        select_compare<I / VMValue::KIND_COUNT, I % VMValue::KIND_COUNT>()...};
+  }(std::make_index_sequence<TABLE_SIZE>{});
+}
+
+template <ArithmeticOp OP> inline constexpr auto ARITHMETIC_TABLE = make_arithmetic_table<OP>();
+inline constexpr auto COMPARE_TABLE = make_compare_table();
+
+constexpr auto table_index(VMValue lhs, VMValue rhs) -> std::size_t {
+  return (lhs.kind_index() * VMValue::KIND_COUNT) + rhs.kind_index();
+}
+} // namespace kernel
+
+template <ArithmeticOp OP> inline auto arithmetic(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  if (lhs.is_int() && rhs.is_int()) [[likely]] {
+    return kernel::numeric<OP, int, int>(lhs, rhs, heap);
+  }
+  if (lhs.is_double() && rhs.is_double()) {
+    return kernel::numeric<OP, double, double>(lhs, rhs, heap);
+  }
+  return kernel::ARITHMETIC_TABLE<OP>[kernel::table_index(lhs, rhs)](lhs, rhs, heap);
+}
+
+inline auto add(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic<ArithmeticOp::ADD>(lhs, rhs, heap);
+}
+inline auto sub(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic<ArithmeticOp::SUB>(lhs, rhs, heap);
+}
+inline auto mult(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic<ArithmeticOp::MULT>(lhs, rhs, heap);
+}
+inline auto div(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic<ArithmeticOp::DIV>(lhs, rhs, heap);
+}
+inline auto mod(VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  return arithmetic<ArithmeticOp::MOD>(lhs, rhs, heap);
+}
+
+// cond: 0 is <, 1 is >, 2 is ==, 3 is !=, 4 is <=, 5 is >=
+inline auto compare(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap) -> bool {
+  if (lhs.is_int() && rhs.is_int()) [[likely]] {
+    return kernel::compare_numeric<int, int>(lhs, rhs, cond, heap);
+  }
+  if (lhs.is_double() && rhs.is_double()) {
+    return kernel::compare_numeric<double, double>(lhs, rhs, cond, heap);
+  }
+  return kernel::COMPARE_TABLE[kernel::table_index(lhs, rhs)](lhs, rhs, cond, heap);
+}
+
+#endif
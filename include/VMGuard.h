@@ -0,0 +1,16 @@
+#ifndef PALLADIUM_VM_GUARD_H
+#define PALLADIUM_VM_GUARD_H
+
+// Guard page faults
+// -----------------
+// The operand and the call stack end in PROT_NONE guard pages (VMStack.h).
+// guarded() runs body with a SIGSEGV handler installed which checks the
+// faulting address with is_guard and, if it lies in a guard page, jumps back
+// and returns false instead of crashing. Other faults are passed on to the
+// previous handler.
+//
+// The jump skips the destructors of the interrupted frames, after a false
+// return the state of the VM is only good enough to report the error.
+auto guarded(void (*body)(void* context), bool (*is_guard)(void* context, const void* adr), void* context) -> bool;
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef PALLADIUM_VM_JIT_H
+#define PALLADIUM_VM_JIT_H
+#include "Bytecode.h"
+#include "VMValue.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Baseline template JIT
+// ---------------------
+// Copies a machine code template per bytecode record of a function into an
+// executable mapping. The templates work on the register window in memory,
+// so the interpreter can take over at any pc: the compiled code returns the
+// pc at which the interpreter resumes.
+//
+// - Moves, int arithmetic and compare and branch are compiled inline. The
+//   int templates guard the tag of their operands, a failing guard returns
+//   the pc of the record with JIT_DEOPT set and the interpreter executes it.
+// - Call, CallR, Return, RetVoid, CLoadRet and Halt leave the compiled code,
+//   the VM enters it again at the callee or the return address.
+// - Every other record calls step, which runs its interpreter handler and
+//   returns JIT_CONTINUE if the execution goes on at the next record.
+// - A backward jump over a record which calls step calls safepoint first, the
+//   values are all in the register window, so the VM can collect its heap.
+//
+// Only x86-64 Linux is supported, elsewhere jit_compile returns nothing and
+// the functions stay interpreted.
+#if defined(__x86_64__) && defined(__linux__)
+#define PALLADIUM_JIT 1
+#else
+#define PALLADIUM_JIT 0
+#endif
+
+inline constexpr std::size_t JIT_CONTINUE = static_cast<std::size_t>(-1);
+inline constexpr std::size_t JIT_DEOPT = std::size_t{1} << 63;
+// a function is dropped back to the interpreter after this many deopts
+inline constexpr std::size_t JIT_DEOPT_LIMIT = 16;
+
+// runs the record at pc in the interpreter, returns JIT_CONTINUE or the pc
+// at which the interpreter resumes
+using JitStep = std::size_t (*)(void* vm, std::size_t pc);
+// called on the backward jumps of loops which can allocate
+using JitSafepoint = void (*)(void* vm);
+
+class JitCode {
+public:
+  using Entry = std::size_t (*)(VMValue* registers, void* vm, const void* entry);
+
+  JitCode(std::span<const std::uint8_t> code, std::size_t first, std::vector<std::uint32_t> offsets);
+  JitCode(JitCode&& other) noexcept;
+  auto operator=(JitCode&& other) noexcept -> JitCode&;
+  JitCode(const JitCode&) = delete;
+  auto operator=(const JitCode&) -> JitCode& = delete;
+  ~JitCode();
+
+  // executes from pc on, which has to lie in the compiled function
+  auto run(VMValue* registers, void* vm, std::size_t pc) const -> std::size_t {
+    return reinterpret_cast<Entry>(_code)(registers, vm, _code + _offsets[pc - _first]);
+  }
+  auto valid() const -> bool {
+    return _code != nullptr;
+  }
+  auto size() const -> std::size_t {
+    return _size;
+  }
+  auto deopt() -> std::size_t {
+    return ++_deopts;
+  }
+
+private:
+  std::uint8_t* _code = nullptr;
+  std::size_t _size = 0;
+  std::size_t _first = 0;
+  std::vector<std::uint32_t> _offsets;
+  std::size_t _deopts = 0;
+};
+
+// compiles the records [first, last) of code, register operands have to be
+// smaller than register_count to be compiled inline
+auto jit_compile(std::span<const Bytecode> code, std::size_t first, std::size_t last, std::size_t register_count,
+                 JitStep step, JitSafepoint safepoint) -> std::optional<JitCode>;
+
+// Loop traces
+// -----------
+// A trace is the path of one iteration of a hot loop as the interpreter
+// executed it, from the loop header back to it. Only int moves, arithmetic and
+// branches are recorded. The compiled trace
+//
+// - checks once on entry that every register it uses holds an int,
+// - keeps these registers unboxed in machine registers while it loops,
+// - folds constants known inside the iteration,
+// - turns every branch into a guard for the recorded direction.
+//
+// A failing branch guard is a side exit: the registers are written back and
+// the trace returns the pc of the other direction. A failing entry check
+// returns the header with JIT_DEOPT set.
+
+inline constexpr std::size_t JIT_TRACE_LIMIT = 128;
+
+struct TraceRecord {
+  std::size_t pc;
+  Bytecode code;
+  // the branch at pc jumped
+  bool taken;
+};
+
+// true if code can be part of a trace with the current register values
+auto jit_traceable(const Bytecode& code, std::span<const VMValue> registers) -> bool;
+// the trace has to end with a jump back to the pc of its first record
+auto jit_compile_trace(std::span<const TraceRecord> trace, std::size_t register_count) -> std::optional<JitCode>;
+
+#endif
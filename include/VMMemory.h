@@ -1,6 +1,8 @@
 #ifndef PALLADIUM_VM_MEMORY_H_
 #define PALLADIUM_VM_MEMORY_H_
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <bitset>
 #include <cassert>
 #include <cstddef>
@@ -8,7 +10,7 @@
 #include <iostream>
 #include <sys/mman.h>
 #include <sys/types.h>
-#include <tuple>
+#include <utility>
 #include <vector>
 
 // Memory Layout for Segments and Blocks
@@ -27,6 +29,14 @@
 //     - 2 blocks of 16 bytes each.
 // - The indices in square brackets ([...]) denote the memory range for each
 // set of blocks.
+//
+// Allocations of up to 128 bytes find their segment in bitmaps with one bit
+// per segment, kept per size class and per length of the longest run of free
+// sub blocks, so they do not walk the heap.
+//
+// The whole capacity is reserved as address space up front, but segment
+// metadata is created and pages are committed in chunks of SEGMENT_CHUNK
+// segments when an allocation does not fit into the segments seen so far.
 
 struct VMMemorySegment {
   static constexpr std::size_t ONE_BYTE_BLOCK_START = 0;
@@ -37,64 +47,114 @@ struct VMMemorySegment {
   static constexpr std::size_t EIGHT_BYTE_BLOCK_END = 43;
   static constexpr std::size_t SIXTEEN_BYTE_BLOCK_START = 44;
   static constexpr std::size_t SIXTEEN_BYTE_BLOCK_END = 45;
+  static constexpr std::size_t SUB_BLOCK_COUNT = 46;
 
   char* start_adr;
-  std::bitset<46> sub_blocks_free_list;
-  std::array<std::pair<std::size_t, std::size_t>, 46> free_list;
+  std::bitset<SUB_BLOCK_COUNT> sub_blocks_free_list;
+  std::array<std::pair<std::size_t, std::size_t>, SUB_BLOCK_COUNT> free_list;
+};
+
+// Bitmap with one bit per segment. All words below first_word are zero,
+// so a search for the first set bit skips 64 full segments per step and
+// starts behind the part of the heap which is known to be full.
+struct VMMemorySummary {
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  void resize(std::size_t bits) {
+    _words.resize((bits + 63) / 64, 0);
+  }
+  void set(std::size_t i) {
+    _words[i / 64] |= std::uint64_t{1} << (i % 64);
+    _first_word = std::min(_first_word, i / 64);
+  }
+  void reset(std::size_t i) {
+    _words[i / 64] &= ~(std::uint64_t{1} << (i % 64));
+  }
+  void assign(std::size_t i, bool value) {
+    if (value) {
+      set(i);
+    } else {
+      reset(i);
+    }
+  }
+  auto test(std::size_t i) const -> bool {
+    return (_words[i / 64] >> (i % 64)) & 1;
+  }
+
+  auto find_first() -> std::size_t {
+    while (_first_word < _words.size() && _words[_first_word] == 0) {
+      ++_first_word;
+    }
+    if (_first_word == _words.size()) {
+      return npos;
+    }
+    return _first_word * 64 + std::countr_zero(_words[_first_word]);
+  }
+
+  // first set bit at or behind i
+  auto find_next(std::size_t i) const -> std::size_t {
+    std::size_t word = i / 64;
+    if (word >= _words.size()) {
+      return npos;
+    }
+    std::uint64_t bits = _words[word] & (~std::uint64_t{0} << (i % 64));
+    while (bits == 0) {
+      if (++word == _words.size()) {
+        return npos;
+      }
+      bits = _words[word];
+    }
+    return word * 64 + std::countr_zero(bits);
+  }
+
+private:
+  std::vector<std::uint64_t> _words;
+  std::size_t _first_word = 0;
 };
 
 template <class VM, std::size_t SSIZE = 128> struct VMMemory {
   static constexpr std::size_t SEGMENT_SIZE = SSIZE;
+  static constexpr std::size_t SEGMENT_CHUNK = 1024;
 
   VMMemory(std::size_t capacity) : _capacity(capacity) {
     _segment_count = _capacity / SEGMENT_SIZE;
-    _base = static_cast<char*>(
-        mmap(nullptr, _segment_count * SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
-
-    assert(_base != MAP_FAILED && "Allocation memory failed");
-
-    for (std::size_t i = 0; i < _segment_count; ++i) {
-      _segment_list.push_back({.start_adr = _base + (i * _segment_count), .sub_blocks_free_list = {}, .free_list = {}});
+    void* base = mmap(nullptr, _segment_count * SEGMENT_SIZE, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                      -1, 0);
+    // without address space the memory stays empty and allocate() returns 0
+    if (base == MAP_FAILED) {
+      _segment_count = 0;
+    } else {
+      _base = static_cast<char*>(base);
     }
   }
 
   auto allocate(std::size_t size) -> std::size_t {
-    if (size <= 16) {
-      return allocate_small_sub_block(size);
+    std::size_t adr = allocate_in_segments(size);
+    while (adr == 0 && grow()) {
+      adr = allocate_in_segments(size);
     }
-    if (size <= SSIZE) {
-      return allocate_sub_blocks(size);
-    } else {
-      return allocate_segments_and_blocks(size);
+    if (adr == 0 && size > 16 && size <= SSIZE) {
+      adr = allocate_sub_blocks_in_any_segment(size);
     }
+    return adr;
   }
 
   void deallocate(std::size_t adr) {
     std::size_t base_adr = reinterpret_cast<std::size_t>(_base);
     VM::P::check_memory_adress(base_adr, adr);
     std::size_t segmentnr = (adr - base_adr) / SSIZE;
+    assert(segmentnr < _segment_list.size() && "Illigal memory access, adress not found");
     auto& free_list = _segment_list[segmentnr].free_list;
-    std::size_t sadr = reinterpret_cast<std::size_t>(_segment_list[segmentnr].start_adr);
-
-    std::size_t index = (adr - sadr);
-    auto limits = find_sub_block_by_index(index);
-    bool found_adr = false;
-    for (std::size_t i = limits.first; i <= limits.second; ++i) {
-      if (free_list[i].first == adr) {
-        index = i;
-        found_adr = true;
-        break;
-      }
-    }
-
-    assert(found_adr && "Illigal memory access, adress not found");
 
+    std::size_t index = sub_block_by_offset((adr - base_adr) % SSIZE);
     auto item = free_list[index];
     VM::P::check_equal_adress(adr, item.first);
+    free_list[index] = {};
+
     std::size_t total = 0;
-    std::size_t tmp_index = index;
     while (total < item.second) {
-      if (index >= free_list.size()) {
+      if (index >= VMMemorySegment::SUB_BLOCK_COUNT) {
+        update_summary(segmentnr);
         index = 0;
         segmentnr++;
       }
@@ -106,143 +166,257 @@ template <class VM, std::size_t SSIZE = 128> struct VMMemory {
       _segment_list[segmentnr].sub_blocks_free_list[index] = false;
       index++;
     }
-    free_list[tmp_index] = {};
+    update_summary(segmentnr);
   }
 
   ~VMMemory() {
-    munmap(_base, _capacity);
+    if (_base != nullptr) {
+      munmap(_base, _capacity);
+    }
   }
   auto base() -> std::size_t {
     return reinterpret_cast<std::size_t>(_base);
   };
+  // true if adr lies in the reserved address space
+  auto contains(std::size_t adr) const -> bool {
+    auto base_adr = reinterpret_cast<std::size_t>(_base);
+    return adr >= base_adr && adr < base_adr + (_segment_count * SEGMENT_SIZE);
+  }
+  // true if the n bytes at adr lie in the committed segments
+  auto contains(std::size_t adr, std::size_t n) const -> bool {
+    auto base_adr = reinterpret_cast<std::size_t>(_base);
+    std::size_t end = base_adr + (_segment_list.size() * SEGMENT_SIZE);
+    return adr >= base_adr && adr <= end && n <= end - adr;
+  }
+  // segments which have been materialized so far
   auto segments() const -> const std::vector<VMMemorySegment>& {
     return _segment_list;
   }
 
 private:
+  auto allocate_in_segments(std::size_t size) -> std::size_t {
+    if (size <= 16) {
+      return allocate_small_sub_block(size);
+    }
+    if (size <= SSIZE) {
+      return allocate_sub_blocks(size);
+    } else {
+      return allocate_segments_and_blocks(size);
+    }
+  }
+
+  // commits the pages of the next chunk of segments and creates their
+  // metadata, false if the memory is full or the pages can not be committed
+  auto grow() -> bool {
+    std::size_t first = _segment_list.size();
+    if (first >= _segment_count) {
+      return false;
+    }
+    std::size_t last = std::min(first + SEGMENT_CHUNK, _segment_count);
+    if (mprotect(_base + (first * SEGMENT_SIZE), (last - first) * SEGMENT_SIZE, PROT_READ | PROT_WRITE) != 0) {
+      return false;
+    }
+
+    for (auto& summary : _summaries) {
+      summary.resize(last);
+    }
+    for (std::size_t i = first; i < last; ++i) {
+      _segment_list.push_back({.start_adr = _base + (i * SEGMENT_SIZE), .sub_blocks_free_list = {}, .free_list = {}});
+      update_summary(i);
+    }
+    return true;
+  }
+
+  // indices into _summaries, the first four are the size classes
+  static constexpr std::size_t ONE_BYTE_CLASS = 0;
+  static constexpr std::size_t FOUR_BYTE_CLASS = 1;
+  static constexpr std::size_t EIGHT_BYTE_CLASS = 2;
+  static constexpr std::size_t SIXTEEN_BYTE_CLASS = 3;
+  static constexpr std::size_t ANY_FREE = 4;
+  static constexpr std::size_t EMPTY = 5;
+  // segments whose longest run of free sub blocks holds at least
+  // RUN_CLASS_BYTES * (k + 2) bytes, k = 0 for 32 up to 6 for 128 bytes
+  static constexpr std::size_t RUN_CLASS = 6;
+  static constexpr std::size_t RUN_CLASS_BYTES = 16;
+  static constexpr std::size_t RUN_CLASS_COUNT = 7;
+
+  // offset of every sub block and the end of the segment
+  static constexpr std::array<std::uint8_t, VMMemorySegment::SUB_BLOCK_COUNT + 1> SUB_BLOCK_OFFSET = [] {
+    std::array<std::uint8_t, VMMemorySegment::SUB_BLOCK_COUNT + 1> offsets{};
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < offsets.size(); ++i) {
+      offsets[i] = static_cast<std::uint8_t>(offset);
+      offset += i < 32 ? 1 : i < 40 ? 4 : i < 44 ? 8 : 16;
+    }
+    return offsets;
+  }();
+
+  static constexpr std::array<std::uint64_t, 4> CLASS_MASK = {
+      0x0000'0000'FFFF'FFFF, // 32 blocks of 1 byte
+      0x0000'00FF'0000'0000, // 8 blocks of 4 byte
+      0x0000'0F00'0000'0000, // 4 blocks of 8 byte
+      0x0000'3000'0000'0000, // 2 blocks of 16 byte
+  };
+  static constexpr std::uint64_t SEGMENT_MASK = 0x0000'3FFF'FFFF'FFFF;
+
+  auto used_sub_blocks(std::size_t segmentnr) const -> std::uint64_t {
+    return _segment_list[segmentnr].sub_blocks_free_list.to_ullong();
+  }
+
+  // bytes of the longest run of free sub blocks
+  static auto longest_free_run(std::uint64_t used) -> std::size_t {
+    std::uint64_t free = ~used & SEGMENT_MASK;
+    std::size_t longest = 0;
+    while (free != 0) {
+      std::size_t start = std::countr_zero(free);
+      std::size_t end = start + std::countr_one(free >> start);
+      longest = std::max<std::size_t>(longest, SUB_BLOCK_OFFSET[end] - SUB_BLOCK_OFFSET[start]);
+      free &= ~std::uint64_t{0} << end;
+    }
+    return longest;
+  }
+
+  // has to be called after every change of the sub blocks of a segment
+  void update_summary(std::size_t segmentnr) {
+    std::uint64_t used = used_sub_blocks(segmentnr);
+    for (std::size_t c = 0; c < CLASS_MASK.size(); ++c) {
+      _summaries[c].assign(segmentnr, (used & CLASS_MASK[c]) != CLASS_MASK[c]);
+    }
+    _summaries[ANY_FREE].assign(segmentnr, used != SEGMENT_MASK);
+    _summaries[EMPTY].assign(segmentnr, used == 0);
+    std::size_t run = longest_free_run(used);
+    for (std::size_t k = 0; k < RUN_CLASS_COUNT; ++k) {
+      _summaries[RUN_CLASS + k].assign(segmentnr, run >= RUN_CLASS_BYTES * (k + 2));
+    }
+  }
+
   auto allocate_small_sub_block(std::size_t size) -> std::size_t {
     if (size == 1) {
-      return allocate_sub_block(VMMemorySegment::ONE_BYTE_BLOCK_START, VMMemorySegment::ONE_BYTE_BLOCK_END, 1);
+      return allocate_sub_block(ONE_BYTE_CLASS, 1);
     }
     if (size <= 4) {
-      return allocate_sub_block(VMMemorySegment::FOUR_BYTE_BLOCK_START, VMMemorySegment::FOUR_BYTE_BLOCK_END, 4);
+      return allocate_sub_block(FOUR_BYTE_CLASS, 4);
     }
     if (size <= 8) {
-      return allocate_sub_block(VMMemorySegment::EIGHT_BYTE_BLOCK_START, VMMemorySegment::EIGHT_BYTE_BLOCK_END, 8);
+      return allocate_sub_block(EIGHT_BYTE_CLASS, 8);
     }
     if (size <= 16) {
-      return allocate_sub_block(VMMemorySegment::SIXTEEN_BYTE_BLOCK_START, VMMemorySegment::SIXTEEN_BYTE_BLOCK_END, 16);
+      return allocate_sub_block(SIXTEEN_BYTE_CLASS, 16);
     }
     return 0;
   }
 
+  // first segment whose run class guarantees a fit, the size is rounded up
+  // to the class so the search does not depend on the size of the heap
   auto allocate_sub_blocks(std::size_t size) -> std::size_t {
-    for (auto& x : _segment_list) {
-      std::int8_t index = find_free_start_index_in_segment(x, size);
-      if (index >= 0) {
-        std::uint8_t total = 0;
-        std::size_t adr = reinterpret_cast<std::size_t>(x.start_adr + start_adr_of_sub_block(index));
-        x.free_list[index] = std::make_tuple(adr, size);
-
-        while (total < size) {
-          total += sizeof_sub_block(index);
-          x.sub_blocks_free_list[index] = true;
-
-          index++;
-        }
-        return adr;
+    std::size_t k = ((size + RUN_CLASS_BYTES - 1) / RUN_CLASS_BYTES) - 2;
+    std::size_t s = _summaries[RUN_CLASS + k].find_first();
+    return s == VMMemorySummary::npos ? 0 : allocate_sub_blocks_in_segment(s, size);
+  }
+
+  // a shorter run can still fit a size below its class, they are only
+  // searched once the memory can not grow anymore
+  auto allocate_sub_blocks_in_any_segment(std::size_t size) -> std::size_t {
+    auto& any_free = _summaries[ANY_FREE];
+    for (std::size_t s = any_free.find_first(); s != VMMemorySummary::npos; s = any_free.find_next(s + 1)) {
+      if (longest_free_run(used_sub_blocks(s)) >= size) {
+        return allocate_sub_blocks_in_segment(s, size);
       }
     }
     return 0;
   }
 
+  auto allocate_sub_blocks_in_segment(std::size_t s, std::size_t size) -> std::size_t {
+    auto& x = _segment_list[s];
+    std::int8_t index = find_free_start_index_in_segment(x, size);
+    assert(index >= 0 && "segment has no run of free sub blocks for the size");
+    std::uint8_t total = 0;
+    std::size_t adr = reinterpret_cast<std::size_t>(x.start_adr + offset_of_sub_block(index));
+    x.free_list[index] = std::make_pair(adr, size);
+
+    while (total < size) {
+      total += sizeof_sub_block(index);
+      x.sub_blocks_free_list[index] = true;
+
+      index++;
+    }
+    update_summary(s);
+    return adr;
+  }
+
   auto allocate_segments_and_blocks(std::size_t size) -> std::size_t {
     std::size_t amount_segments = size / SSIZE;
     std::size_t rest_size = size % SSIZE;
-    for (auto iter = _segment_list.begin(); iter != _segment_list.end(); ++iter) {
-      if (iter->sub_blocks_free_list.none()) {
-        std::size_t adr = reinterpret_cast<std::size_t>(iter->start_adr);
-        bool empty_segments = true;
-        for (std::size_t i = 1; i < amount_segments; ++i) {
-          ++iter;
-          if (iter == _segment_list.end()) {
-            return 0;
-          }
-
-          if (iter->sub_blocks_free_list.none() == false) {
-            empty_segments = false;
-            break;
-          }
-        }
-        if (empty_segments == false) {
-          continue;
-        }
-        if (rest_size == 0) {
-          for (std::size_t i = 0; i < amount_segments; ++i) {
-            mark_segment(*iter);
-            --iter;
-          }
-          ++iter;
-          (*iter).free_list[0] = std::make_tuple(adr, size);
-          return adr;
-        }
-
-        ++iter;
-        if (iter == _segment_list.end()) {
-          return 0;
-        }
-        if (is_left_free(*iter, rest_size)) {
-          mark_partial(*iter, rest_size);
-          for (std::size_t i = 0; i < amount_segments; ++i) {
-            --iter;
-            mark_segment(*iter);
-          }
-          (*iter).free_list[0] = std::make_tuple(adr, size);
-          return adr;
-        }
+    std::size_t needed = amount_segments + (rest_size > 0 ? 1 : 0);
+    auto& empty = _summaries[EMPTY];
+    for (std::size_t s = empty.find_first(); s != VMMemorySummary::npos; s = empty.find_next(s + 1)) {
+      if (s + needed > _segment_list.size()) {
+        return 0;
+      }
+      std::size_t i = 1;
+      while (i < amount_segments && empty.test(s + i)) {
+        ++i;
+      }
+      if (i < amount_segments) {
+        continue;
+      }
+      if (rest_size > 0 && !is_left_free(_segment_list[s + amount_segments], rest_size)) {
+        continue;
+      }
+      for (std::size_t k = 0; k < amount_segments; ++k) {
+        mark_segment(_segment_list[s + k]);
+        update_summary(s + k);
+      }
+      if (rest_size > 0) {
+        mark_partial(_segment_list[s + amount_segments], rest_size);
+        update_summary(s + amount_segments);
       }
+      std::size_t adr = reinterpret_cast<std::size_t>(_segment_list[s].start_adr);
+      _segment_list[s].free_list[0] = std::make_pair(adr, size);
+      return adr;
     }
     return 0;
   }
 
-  auto allocate_sub_block(std::size_t start, std::size_t end, u_int8_t step) -> std::size_t {
-    for (auto& segment : _segment_list) {
-      for (std::size_t i = start; i <= end; ++i) {
-        if (segment.sub_blocks_free_list[i] == false) {
-          segment.sub_blocks_free_list[i] = true;
-          std::uint8_t offset = start_adr_of_sub_block(start);
-          offset += step * (i - start);
-          char* adr = segment.start_adr + offset;
-          segment.free_list[i] = std::make_tuple(reinterpret_cast<size_t>(adr), step);
-          return reinterpret_cast<std::size_t>(adr);
-        }
-      }
+  // first free block of a size class in the first segment which has one
+  auto allocate_sub_block(std::size_t size_class, std::uint8_t step) -> std::size_t {
+    std::size_t s = _summaries[size_class].find_first();
+    if (s == VMMemorySummary::npos) {
+      return 0;
     }
-    return 0;
+    auto& segment = _segment_list[s];
+    std::uint64_t free = ~used_sub_blocks(s) & CLASS_MASK[size_class];
+    std::size_t i = std::countr_zero(free);
+    segment.sub_blocks_free_list[i] = true;
+    char* adr = segment.start_adr + offset_of_sub_block(i);
+    segment.free_list[i] = std::make_pair(reinterpret_cast<size_t>(adr), step);
+    update_summary(s);
+    return reinterpret_cast<std::size_t>(adr);
   }
 
-  auto start_adr_of_sub_block(std::uint8_t sub_block_index) const -> std::uint8_t {
+  // offset of a sub block inside of a segment
+  auto offset_of_sub_block(std::size_t sub_block_index) const -> std::size_t {
     if (sub_block_index <= VMMemorySegment::ONE_BYTE_BLOCK_END)
-      return 0;
+      return sub_block_index - VMMemorySegment::ONE_BYTE_BLOCK_START;
     if (sub_block_index <= VMMemorySegment::FOUR_BYTE_BLOCK_END)
-      return 32;
+      return 32 + 4 * (sub_block_index - VMMemorySegment::FOUR_BYTE_BLOCK_START);
     if (sub_block_index <= VMMemorySegment::EIGHT_BYTE_BLOCK_END)
-      return 64;
+      return 64 + 8 * (sub_block_index - VMMemorySegment::EIGHT_BYTE_BLOCK_START);
     if (sub_block_index <= VMMemorySegment::SIXTEEN_BYTE_BLOCK_END)
-      return 96;
+      return 96 + 16 * (sub_block_index - VMMemorySegment::SIXTEEN_BYTE_BLOCK_START);
     assert(false && "failed calculation of start adress in sub block");
   }
 
-  auto find_sub_block_by_index(std::uint8_t index) const -> std::pair<std::size_t, std::size_t> {
-    if (index < 32)
-      return {VMMemorySegment::ONE_BYTE_BLOCK_START, VMMemorySegment::ONE_BYTE_BLOCK_END};
-    if (index < 64)
-      return {VMMemorySegment::FOUR_BYTE_BLOCK_START, VMMemorySegment::FOUR_BYTE_BLOCK_END};
-    if (index < 96)
-      return {VMMemorySegment::EIGHT_BYTE_BLOCK_START, VMMemorySegment::EIGHT_BYTE_BLOCK_END};
-    return {VMMemorySegment::SIXTEEN_BYTE_BLOCK_START, VMMemorySegment::SIXTEEN_BYTE_BLOCK_END};
+  // index of the sub block which starts at offset inside of a segment
+  auto sub_block_by_offset(std::size_t offset) const -> std::size_t {
+    if (offset < 32)
+      return VMMemorySegment::ONE_BYTE_BLOCK_START + offset;
+    if (offset < 64)
+      return VMMemorySegment::FOUR_BYTE_BLOCK_START + (offset - 32) / 4;
+    if (offset < 96)
+      return VMMemorySegment::EIGHT_BYTE_BLOCK_START + (offset - 64) / 8;
+    return VMMemorySegment::SIXTEEN_BYTE_BLOCK_START + (offset - 96) / 16;
   }
-
   auto sizeof_sub_block(std::uint8_t index) const -> std::uint8_t {
     if (index <= VMMemorySegment::ONE_BYTE_BLOCK_END)
       return 1;
@@ -308,9 +482,10 @@ private:
 
 private:
   std::size_t _capacity;
-  char* _base;
+  char* _base = nullptr;
   std::size_t _segment_count;
   std::vector<VMMemorySegment> _segment_list;
+  std::array<VMMemorySummary, RUN_CLASS + RUN_CLASS_COUNT> _summaries;
 };
 
 template <class VM, std::size_t SSIZE> std::ostream& operator<<(std::ostream& os, const VMMemory<VM, SSIZE>& memory) {
@@ -0,0 +1,55 @@
+#ifndef PALLADIUM_VM_OUTPUT_H
+#define PALLADIUM_VM_OUTPUT_H
+#include "Util.h"
+#include "VMValue.h"
+#include <cstddef>
+#include <iosfwd>
+#include <string_view>
+#include <vector>
+
+// Buffered program output
+// -----------------------
+// Print and PrintRegStructField append to the output buffer of the VM, which
+// is written to the stream when it is full, on Flush and on Halt. Numbers are
+// formatted with std::to_chars directly into the buffer, in the format of
+// std::to_string.
+//
+// A capacity of 0 is the unbuffered mode for interactive use: every value is
+// written and the stream flushed at once.
+class VMOutput {
+public:
+  static constexpr std::size_t DEFAULT_CAPACITY = 64 * 1024;
+
+  explicit VMOutput(std::ostream* out = nullptr, std::size_t capacity = DEFAULT_CAPACITY);
+  VMOutput(const VMOutput&) = delete;
+  auto operator=(const VMOutput&) -> VMOutput& = delete;
+  ~VMOutput();
+
+  // both flush the pending output first
+  void set_stream(std::ostream* out);
+  void set_capacity(std::size_t capacity);
+
+  void write(std::string_view text);
+  auto write(VMValue value, const VMHeap& heap) -> ResultOr<bool>;
+  void flush();
+
+  auto capacity() const -> std::size_t {
+    return _capacity;
+  }
+  auto pending() const -> std::size_t {
+    return _size;
+  }
+
+private:
+  // room for n more bytes, flushes if the buffer has less
+  auto reserve(std::size_t n) -> char*;
+  template <class T> void write_number(T value);
+  void commit();
+
+  std::ostream* _out;
+  std::size_t _capacity;
+  std::vector<char> _buffer;
+  std::size_t _size = 0;
+};
+
+#endif
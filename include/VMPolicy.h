@@ -2,14 +2,46 @@
 #define PALLADIUM_VM_POLICY_H
 
 #include "Util.h"
+#include "VMOutput.h"
+#include "VMProfiler.h"
+#include <cctype>
 #include <cstddef>
+#include <iostream>
 #include <string>
-#include <utility>
 
-struct AggresivPolicy {
-  static void check_stack_bounds([[maybe_unused]] int sp, [[maybe_unused]] std::size_t max_size) {
+// one line of the instruction trace, control characters are escaped
+inline void print_trace_line(const std::string& inst) {
+  std::string msg;
+  for (auto c : inst) {
+    if (std::isspace(static_cast<unsigned char>(c)) && c != ' ') {
+      msg += "\\n";
+    } else {
+      msg += c;
+    }
   }
-  static void print_dbg([[maybe_unused]] const std::string& inst) {
+  std::cout << msg << std::endl;
+}
+
+struct AggresivPolicy {
+  using Profiler = NoProfiler;
+  static constexpr bool tracing_enabled = false;
+  static constexpr std::size_t output_capacity = VMOutput::DEFAULT_CAPACITY;
+  // stack overflows crash on the guard page
+  static constexpr bool guard_stacks = false;
+  // calls after which a function is compiled by the baseline JIT, 0 disables it
+  static constexpr std::size_t jit_threshold = 100;
+  // backward branches to a pc after which its loop is traced, 0 disables traces
+  static constexpr std::size_t trace_threshold = 50;
+  // executions with the same operand types after which Add, CAdd, INDAdd and
+  // If are quickened into their specialized variant, 0 disables it
+  static constexpr std::size_t quicken_threshold = 8;
+
+  // message is a callable returning the trace line, it is only invoked if
+  // tracing_enabled is set
+  template <class F> static void print_dbg([[maybe_unused]] F&& message) {
+    if constexpr (tracing_enabled) {
+      print_trace_line(message());
+    }
   }
   template <class VM> static void check_register_bounds([[maybe_unused]] VM* vm, [[maybe_unused]] std::size_t index) {
   }
@@ -30,25 +62,21 @@ struct AggresivPolicy {
 };
 
 struct DebugPolicy {
-  static void check_stack_bounds(int sp, std::size_t max_size) {
-    if (sp < -1) {
-      panic("Stack underflow");
-    }
-    if (std::cmp_greater_equal(sp, max_size)) {
-      panic("Stack overflow");
-    }
-  }
+  using Profiler = NoProfiler;
+  static constexpr bool tracing_enabled = true;
+  // unbuffered, program output stays in order with the trace
+  static constexpr std::size_t output_capacity = 0;
+  // stack overflows become a "Stack overflow in <function>" error
+  static constexpr bool guard_stacks = true;
+  // every record is traced, nothing is compiled
+  static constexpr std::size_t jit_threshold = 0;
+  static constexpr std::size_t trace_threshold = 0;
+  static constexpr std::size_t quicken_threshold = 0;
 
-  static void print_dbg(const std::string& inst) {
-    std::string msg;
-    for (auto& c : inst) {
-      if (std::isspace(c) && c != ' ') {
-        msg += "\\n";
-      } else {
-        msg += c;
-      }
+  template <class F> static void print_dbg([[maybe_unused]] F&& message) {
+    if constexpr (tracing_enabled) {
+      print_trace_line(message());
     }
-    std::cout << msg << std::endl;
   }
 
   static void check_memory_bound(std::size_t index, std::size_t sz) {
@@ -76,4 +104,12 @@ struct DebugPolicy {
   }
 };
 
+// AggresivPolicy with the VMProfiler attached, cheap enough to stay enabled
+struct ProfilingPolicy : public AggresivPolicy {
+  using Profiler = VMProfiler;
+  // compiled code bypasses the per opcode counters
+  static constexpr std::size_t jit_threshold = 0;
+  static constexpr std::size_t trace_threshold = 0;
+};
+
 #endif
@@ -0,0 +1,149 @@
+#ifndef PALLADIUM_VM_PROFILER_H
+#define PALLADIUM_VM_PROFILER_H
+#include "Bytecode.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Execution profiler
+// ------------------
+// The VM owns one P::Profiler and reports every dispatched record, every
+// function call and return and the final Halt to it. NoProfiler compiles all
+// hooks away, VMProfiler records
+//
+// - count and time of every opcode, hits and misses of its inline caches
+// - call count and inclusive time of every function
+// - a histogram of the executed pcs
+// - the self time of every call path for flamegraphs
+//
+// Time is measured in rdtsc ticks on x86 and in nanoseconds elsewhere.
+
+struct NoProfiler {
+  struct Token {};
+
+  auto begin([[maybe_unused]] std::size_t pc, [[maybe_unused]] OpCode op) -> Token {
+    return {};
+  }
+  void end([[maybe_unused]] const Token& token) {
+  }
+  void enter([[maybe_unused]] std::size_t function, [[maybe_unused]] const std::string& name) {
+  }
+  void leave() {
+  }
+  void halt() {
+  }
+  void inline_cache([[maybe_unused]] OpCode op, [[maybe_unused]] bool hit) {
+  }
+};
+
+class VMProfiler {
+public:
+  enum class Format { JSON, FOLDED };
+
+  struct Token {
+    std::size_t pc;
+    OpCode op;
+    std::size_t path;
+    std::uint64_t start;
+  };
+  struct OpcodeStats {
+    std::uint64_t count = 0;
+    std::uint64_t ticks = 0;
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+  };
+  struct FunctionStats {
+    std::string name;
+    std::uint64_t calls = 0;
+    std::uint64_t inclusive_ticks = 0;
+    std::size_t active = 0;
+  };
+  // node of the call path tree, path 0 is the program outside of any call
+  struct CallPath {
+    std::size_t parent;
+    std::size_t function;
+    std::uint64_t self_ticks = 0;
+  };
+
+  VMProfiler();
+
+  static auto now() -> std::uint64_t {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  auto begin(std::size_t pc, OpCode op) -> Token {
+    return {.pc = pc, .op = op, .path = _path, .start = now()};
+  }
+  void end(const Token& token) {
+    std::uint64_t ticks = now() - token.start;
+    auto& stats = _opcodes[static_cast<std::size_t>(token.op)];
+    stats.count += 1;
+    stats.ticks += ticks;
+    _paths[token.path].self_ticks += ticks;
+    if (token.pc >= _pc_histogram.size()) [[unlikely]] {
+      _pc_histogram.resize(token.pc + 1, 0);
+    }
+    _pc_histogram[token.pc] += 1;
+  }
+  void enter(std::size_t function, const std::string& name);
+  void leave();
+  void inline_cache(OpCode op, bool hit) {
+    auto& stats = _opcodes[static_cast<std::size_t>(op)];
+    stats.cache_hits += hit ? 1 : 0;
+    stats.cache_misses += hit ? 0 : 1;
+  }
+  // writes the profile to the output, if one is set
+  void halt();
+
+  // the profile is written to out at Halt, out has to outlive the VM
+  void output(std::ostream* out, Format format = Format::JSON) {
+    _out = out;
+    _format = format;
+  }
+  void write_json(std::ostream& out, std::size_t hot_pcs = 16) const;
+  void write_folded(std::ostream& out) const;
+
+  auto opcode(OpCode op) const -> const OpcodeStats& {
+    return _opcodes[static_cast<std::size_t>(op)];
+  }
+  auto functions() const -> const std::vector<FunctionStats>& {
+    return _functions;
+  }
+  auto pc_histogram() const -> const std::vector<std::uint64_t>& {
+    return _pc_histogram;
+  }
+
+private:
+  struct Frame {
+    std::size_t function;
+    std::size_t path;
+    std::uint64_t start;
+  };
+
+  std::array<OpcodeStats, OPCODE_TABLE_SIZE> _opcodes{};
+  std::vector<FunctionStats> _functions;
+  std::vector<std::uint64_t> _pc_histogram;
+  std::vector<CallPath> _paths;
+  // children of every path node as (function, path) pairs
+  std::vector<std::vector<std::pair<std::size_t, std::size_t>>> _children;
+  std::vector<Frame> _frames;
+  std::size_t _path = 0;
+  std::ostream* _out = nullptr;
+  Format _format = Format::JSON;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef PALLADIUM_VM_STACK_H
+#define PALLADIUM_VM_STACK_H
+#include <cassert>
+#include <cstddef>
+#include <span>
+#include <sys/mman.h>
+#include <type_traits>
+#include <unistd.h>
+
+// Operand stack in reserved address space
+// ---------------------------------------
+// [ guard page | capacity * T ... | guard page ]
+//
+// The whole capacity is reserved with MAP_NORESERVE when the stack is created,
+// pages are only backed once they are touched, so push and pop are a pointer
+// bump and never reallocate. Instead of a bounds check per operation the
+// PROT_NONE guard pages on both ends fault on an overflow or on reading an
+// empty stack.
+
+// the guard page below the entries faults on an underflow, the one above on
+// an overflow
+enum class StackGuard { NONE, LOWER, UPPER };
+
+template <class T> class VMStack {
+  static_assert(std::is_trivially_copyable_v<T>, "stack entries are moved with plain copies");
+
+public:
+  explicit VMStack(std::size_t capacity) : _capacity(capacity) {
+    _page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t bytes = (capacity * sizeof(T) + _page - 1) / _page * _page;
+    _region_size = bytes + 2 * _page;
+    void* region = mmap(nullptr, _region_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    assert(region != MAP_FAILED && "Reserving the stack failed");
+    _region = static_cast<std::byte*>(region);
+    mprotect(_region + _page, bytes, PROT_READ | PROT_WRITE);
+    _data = reinterpret_cast<T*>(_region + _page);
+    _top = _data;
+  }
+  VMStack(const VMStack&) = delete;
+  auto operator=(const VMStack&) -> VMStack& = delete;
+  ~VMStack() {
+    munmap(_region, _region_size);
+  }
+
+  void push(const T& value) {
+    *_top++ = value;
+  }
+  auto pop() -> T {
+    return *--_top;
+  }
+  void drop(std::size_t n = 1) {
+    _top -= n;
+  }
+  auto top() -> T& {
+    return _top[-1];
+  }
+
+  // index of the top entry, -1 if the stack is empty
+  auto pointer() const -> int {
+    return static_cast<int>(_top - _data) - 1;
+  }
+  void set_pointer(int sp) {
+    _top = _data + sp + 1;
+  }
+  auto size() const -> std::size_t {
+    return static_cast<std::size_t>(_top - _data);
+  }
+  auto empty() const -> bool {
+    return _top == _data;
+  }
+  auto capacity() const -> std::size_t {
+    return _capacity;
+  }
+  auto operator[](std::size_t i) -> T& {
+    return _data[i];
+  }
+  auto data() -> T* {
+    return _data;
+  }
+  auto entries() const -> std::span<const T> {
+    return {_data, size()};
+  }
+
+  // the guard page adr lies in
+  auto guard(const void* adr) const -> StackGuard {
+    const auto* p = static_cast<const std::byte*>(adr);
+    if (p >= _region && p < _region + _page) {
+      return StackGuard::LOWER;
+    }
+    if (p >= _region + _region_size - _page && p < _region + _region_size) {
+      return StackGuard::UPPER;
+    }
+    return StackGuard::NONE;
+  }
+  auto is_guard(const void* adr) const -> bool {
+    return guard(adr) != StackGuard::NONE;
+  }
+
+private:
+  std::size_t _capacity;
+  std::size_t _page;
+  std::size_t _region_size;
+  std::byte* _region;
+  T* _data;
+  T* _top;
+};
+
+#endif
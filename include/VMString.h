@@ -0,0 +1,114 @@
+#ifndef PALLADIUM_VM_STRING_H
+#define PALLADIUM_VM_STRING_H
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Immutable VM string
+// -------------------
+// Strings up to INLINE_CAPACITY bytes live inside the object, longer ones in a
+// reference counted buffer which is shared by all copies. Length and hash are
+// computed once when the string is created.
+//
+// A buffer may hold more bytes than the strings which point into it. concat()
+// appends in place if the left hand side ends at the used end of its buffer
+// and the buffer has room left, the bytes of existing strings never change.
+// A loop of s = s + x copies every byte about twice instead of the whole
+// prefix in every iteration.
+//
+// The reference count is not atomic, strings are owned by one VM.
+class VMString {
+public:
+  static constexpr std::size_t INLINE_CAPACITY = 15;
+
+  VMString() = default;
+  explicit VMString(std::string_view value);
+  VMString(const VMString& other);
+  VMString(VMString&& other) noexcept;
+  auto operator=(const VMString& other) -> VMString&;
+  auto operator=(VMString&& other) noexcept -> VMString&;
+  ~VMString();
+
+  static auto concat(const VMString& lhs, std::string_view rhs) -> VMString;
+
+  auto view() const -> std::string_view {
+    return {data(), _size};
+  }
+  auto str() const -> std::string {
+    return std::string(view());
+  }
+  auto size() const -> std::size_t {
+    return _size;
+  }
+  auto hash() const -> std::uint64_t {
+    return _hash;
+  }
+  auto is_inline() const -> bool {
+    return _size <= INLINE_CAPACITY;
+  }
+
+  friend auto operator==(const VMString& lhs, const VMString& rhs) -> bool {
+    return lhs._size == rhs._size && lhs._hash == rhs._hash && lhs.view() == rhs.view();
+  }
+  friend auto operator==(const VMString& lhs, std::string_view rhs) -> bool {
+    return lhs.view() == rhs;
+  }
+  friend auto operator<=>(const VMString& lhs, const VMString& rhs) -> std::strong_ordering {
+    return lhs.view() <=> rhs.view();
+  }
+
+  // FNV-1a, hash(a + b) continues from hash(a)
+  static constexpr std::uint64_t HASH_SEED = 0xcbf2'9ce4'8422'2325;
+  static constexpr auto hash(std::string_view value, std::uint64_t seed = HASH_SEED) -> std::uint64_t {
+    for (char c : value) {
+      seed = (seed ^ static_cast<unsigned char>(c)) * 0x0000'0100'0000'01b3;
+    }
+    return seed;
+  }
+
+private:
+  struct Buffer {
+    std::size_t refs;
+    std::size_t capacity;
+    std::size_t used;
+
+    auto bytes() -> char* {
+      return reinterpret_cast<char*>(this + 1);
+    }
+  };
+
+  static auto allocate(std::size_t capacity) -> Buffer*;
+  void release();
+  auto data() const -> const char* {
+    return is_inline() ? _inline : _buffer->bytes();
+  }
+
+  union {
+    char _inline[INLINE_CAPACITY + 1] = {};
+    Buffer* _buffer;
+  };
+  std::size_t _size = 0;
+  std::uint64_t _hash = HASH_SEED;
+};
+
+// Collects the pieces of a string and creates it without intermediate copies.
+class VMStringBuilder {
+public:
+  auto append(std::string_view value) -> VMStringBuilder& {
+    _value = VMString::concat(_value, value);
+    return *this;
+  }
+  auto size() const -> std::size_t {
+    return _value.size();
+  }
+  auto build() -> VMString {
+    return std::move(_value);
+  }
+
+private:
+  VMString _value;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _PALLADIUM_VM_TPYE_H
 #define _PALLADIUM_VM_TPYE_H
 #include "Util.h"
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <type_traits>
@@ -40,17 +41,10 @@ template <class T, class VARIANT> struct get_index {
   static constexpr size_t value = VARIANT{T{}}.index();
 };
 
+// A struct outside of the VM memory: the packed bytes of an instance, laid
+// out by its VMStructShape (VMValue.h).
 struct VMStruct {
-  VMStruct(VMPrimitive size);
-  auto max_index() const -> std::size_t;
-  void add_field(const VMStructTypes& type);
-  void set_field(std::size_t index, const VMStructTypes& value);
-  auto get_field(std::size_t index) -> VMStructTypes&;
-  auto size() const -> int;
-
-private:
-  std::vector<VMStructTypes> _fields;
-  std::size_t _currentIndex;
+  std::vector<std::byte> bytes;
 };
 
 using VMType = std::variant<VMPrimitive, VMStruct, VMAddress>;
@@ -67,10 +61,11 @@ enum class VMTypeKind {
   VM_ADDRESS = 8,
 };
 
-auto add(VMType& lhs, VMType& rhs) -> ResultOr<VMType>;
-auto sub(VMType& lhs, VMType& rhs) -> ResultOr<VMType>;
-auto mult(VMType& lhs, VMType& rhs) -> ResultOr<VMType>;
-auto div(VMType& lhs, VMType& rhs) -> ResultOr<VMType>;
+auto add(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType>;
+auto sub(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType>;
+auto mult(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType>;
+auto div(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType>;
+auto mod(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType>;
 auto to_string(const VMType& value) -> ResultOr<std::string>;
 
 auto operator<(const VMPrimitive& lhs, const VMPrimitive& rhs) -> bool;
@@ -0,0 +1,379 @@
+#ifndef PALLADIUM_VM_VALUE_H
+#define PALLADIUM_VM_VALUE_H
+#include "Util.h"
+#include "VMString.h"
+#include "VMType.h"
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// NaN boxed runtime value
+// -----------------------
+// A double is stored as it is. Every other type lives in the payload of a
+// negative quiet NaN, the three bits below the quiet bit select the type:
+//
+// [ 1 | 11111111111 | 1 | tag (3 Bit) | payload (48 Bit) ]
+//
+// - int, float and bool use the lower 32 bits of the payload.
+// - size_t and addresses are limited to 48 bits. The constructors require
+//   fits_payload(), arithmetic, LoadMem and field stores check it and fail
+//   with an error for larger values.
+// - strings are handles into the VMHeap, structs hold the address of their
+//   instance.
+//
+// Doubles which are NaN are canonicalized to a positive quiet NaN, so a
+// boxed value can never be mistaken for a double.
+class VMValue {
+public:
+  static constexpr std::uint64_t BOX_PREFIX = 0xFFF8'0000'0000'0000;
+  static constexpr std::uint64_t PAYLOAD_MASK = 0x0000'FFFF'FFFF'FFFF;
+  static constexpr std::uint64_t CANONICAL_NAN = 0x7FF8'0000'0000'0000;
+
+  static constexpr auto fits_payload(std::uint64_t value) -> bool {
+    return value <= PAYLOAD_MASK;
+  }
+
+  static constexpr std::uint16_t INT_TAG = 0xFFF9;
+  static constexpr std::uint16_t FLOAT_TAG = 0xFFFA;
+  static constexpr std::uint16_t SIZE_T_TAG = 0xFFFB;
+  static constexpr std::uint16_t BOOL_TAG = 0xFFFC;
+  static constexpr std::uint16_t STRING_TAG = 0xFFFD;
+  static constexpr std::uint16_t STRUCT_TAG = 0xFFFE;
+  static constexpr std::uint16_t ADDRESS_TAG = 0xFFFF;
+
+  // number of distinct kind_index() values
+  static constexpr std::size_t KIND_COUNT = 8;
+
+  constexpr VMValue() : VMValue(0) {
+  }
+  constexpr VMValue(int value) : _bits(box(INT_TAG, static_cast<std::uint32_t>(value))) {
+  }
+  constexpr VMValue(float value) : _bits(box(FLOAT_TAG, std::bit_cast<std::uint32_t>(value))) {
+  }
+  constexpr VMValue(std::size_t value) : _bits(box(SIZE_T_TAG, value)) {
+    assert(fits_payload(value) && "size_t value exceeds the 48 bit payload");
+  }
+  constexpr VMValue(double value) : _bits(value != value ? CANONICAL_NAN : std::bit_cast<std::uint64_t>(value)) {
+  }
+  constexpr VMValue(bool value) : _bits(box(BOOL_TAG, value ? 1 : 0)) {
+  }
+  constexpr VMValue(VMAddress adr) : _bits(box(ADDRESS_TAG, adr.get())) {
+    assert(fits_payload(adr.get()) && "address exceeds the 48 bit payload");
+  }
+
+  static constexpr auto string_handle(std::size_t handle) -> VMValue {
+    return from_bits(box(STRING_TAG, handle));
+  }
+  static constexpr auto struct_handle(std::size_t handle) -> VMValue {
+    return from_bits(box(STRUCT_TAG, handle));
+  }
+  static constexpr auto from_bits(std::uint64_t bits) -> VMValue {
+    VMValue v;
+    v._bits = bits;
+    return v;
+  }
+
+  constexpr auto bits() const -> std::uint64_t {
+    return _bits;
+  }
+  constexpr auto tag() const -> std::uint16_t {
+    return static_cast<std::uint16_t>(_bits >> 48);
+  }
+  constexpr auto payload() const -> std::uint64_t {
+    return _bits & PAYLOAD_MASK;
+  }
+  auto kind() const -> VMTypeKind;
+  // dense index of the type, 0 for double and 1 to 7 for the tags
+  constexpr auto kind_index() const -> std::size_t {
+    return is_double() ? 0 : tag() - (BOX_PREFIX >> 48);
+  }
+
+  constexpr auto is_double() const -> bool {
+    return (_bits & BOX_PREFIX) != BOX_PREFIX;
+  }
+  constexpr auto is_int() const -> bool {
+    return tag() == INT_TAG;
+  }
+  constexpr auto is_float() const -> bool {
+    return tag() == FLOAT_TAG;
+  }
+  constexpr auto is_size_t() const -> bool {
+    return tag() == SIZE_T_TAG;
+  }
+  constexpr auto is_bool() const -> bool {
+    return tag() == BOOL_TAG;
+  }
+  constexpr auto is_string() const -> bool {
+    return tag() == STRING_TAG;
+  }
+  constexpr auto is_struct() const -> bool {
+    return tag() == STRUCT_TAG;
+  }
+  constexpr auto is_address() const -> bool {
+    return tag() == ADDRESS_TAG;
+  }
+
+  constexpr auto as_int() const -> int {
+    return static_cast<int>(static_cast<std::uint32_t>(_bits));
+  }
+  constexpr auto as_float() const -> float {
+    return std::bit_cast<float>(static_cast<std::uint32_t>(_bits));
+  }
+  constexpr auto as_size_t() const -> std::size_t {
+    return payload();
+  }
+  constexpr auto as_double() const -> double {
+    return std::bit_cast<double>(_bits);
+  }
+  constexpr auto as_bool() const -> bool {
+    return payload() != 0;
+  }
+  constexpr auto as_address() const -> VMAddress {
+    return VMAddress{payload()};
+  }
+  constexpr auto handle() const -> std::size_t {
+    return payload();
+  }
+
+  // identity of the boxed word, strings compare by handle
+  constexpr auto operator==(const VMValue& rhs) const -> bool = default;
+
+private:
+  static constexpr auto box(std::uint16_t tag, std::uint64_t payload) -> std::uint64_t {
+    return (static_cast<std::uint64_t>(tag) << 48) | (payload & PAYLOAD_MASK);
+  }
+
+  std::uint64_t _bits;
+};
+
+static_assert(sizeof(VMValue) == 8, "VMValue has to fit into one machine word");
+
+// Struct shape
+// ------------
+// Kind and byte offset of every field of a struct, registered once in the
+// VMHeap. An instance is a packed buffer of size() bytes in the VM memory:
+//
+// [ shape index (4 Byte) | padding (4 Byte) | field 0 | field 1 | ... ]
+//
+// Fields are stored at their natural alignment: ints and floats take 4 bytes,
+// bools 1 byte and doubles 8 bytes, all other kinds are stored as the 8 bytes
+// of their VMValue. A struct VMValue holds the address of its instance, so a
+// field access is one load at the offset of the field.
+class VMStructShape {
+public:
+  struct Field {
+    VMTypeKind kind;
+    std::uint32_t offset;
+  };
+  static constexpr std::uint32_t HEADER_SIZE = 8;
+
+  VMStructShape(std::uint32_t index, std::span<const VMValue> defaults);
+
+  auto index() const -> std::uint32_t {
+    return _index;
+  }
+  auto size() const -> std::size_t {
+    return _instance.size();
+  }
+  auto fields() const -> std::span<const Field> {
+    return _fields;
+  }
+  auto defaults() const -> std::span<const VMValue> {
+    return _defaults;
+  }
+  // an instance holding the default value of every field
+  auto instance() const -> std::span<const std::byte> {
+    return _instance;
+  }
+
+  static auto data(VMValue value) -> std::byte* {
+    return reinterpret_cast<std::byte*>(value.handle());
+  }
+  static auto shape_index(const std::byte* data) -> std::uint32_t {
+    std::uint32_t index = 0;
+    std::memcpy(&index, data, sizeof(index));
+    return index;
+  }
+
+  static auto load(const std::byte* data, Field field) -> VMValue {
+    const std::byte* ptr = data + field.offset;
+    switch (field.kind) {
+    case VMTypeKind::VM_INT:
+      return VMValue(read<int>(ptr));
+    case VMTypeKind::VM_FLOAT:
+      return VMValue(read<float>(ptr));
+    case VMTypeKind::VM_BOOL:
+      return VMValue(read<bool>(ptr));
+    case VMTypeKind::VM_DOUBLE:
+      return VMValue(read<double>(ptr));
+    default:
+      return VMValue::from_bits(read<std::uint64_t>(ptr));
+    }
+  }
+  // value converted to the kind of the field, ints, floats and size_ts are
+  // widened like in VMPrimitive, nullopt for other mismatches
+  static auto convert(Field field, VMValue value) -> std::optional<VMValue>;
+  // value has to be of the kind of the field
+  static void store_converted(std::byte* data, Field field, VMValue value) {
+    std::byte* ptr = data + field.offset;
+    switch (field.kind) {
+    case VMTypeKind::VM_INT:
+      write(ptr, value.as_int());
+      break;
+    case VMTypeKind::VM_FLOAT:
+      write(ptr, value.as_float());
+      break;
+    case VMTypeKind::VM_BOOL:
+      write(ptr, value.as_bool());
+      break;
+    case VMTypeKind::VM_DOUBLE:
+      write(ptr, value.as_double());
+      break;
+    default:
+      write(ptr, value.bits());
+      break;
+    }
+  }
+  // false if the value can not be converted to the kind of the field
+  static auto store(std::byte* data, Field field, VMValue value) -> bool {
+    auto converted = convert(field, value);
+    if (converted) {
+      store_converted(data, field, *converted);
+    }
+    return converted.has_value();
+  }
+
+private:
+  template <class T> static auto read(const std::byte* ptr) -> T {
+    T value;
+    std::memcpy(&value, ptr, sizeof(T));
+    return value;
+  }
+  template <class T> static void write(std::byte* ptr, T value) {
+    std::memcpy(ptr, &value, sizeof(T));
+  }
+
+  std::uint32_t _index;
+  std::vector<Field> _fields;
+  std::vector<VMValue> _defaults;
+  std::vector<std::byte> _instance;
+};
+
+// Monomorphic inline cache of a field access site (SetField,
+// PrintRegStructField): the shape seen last and the field it resolved to.
+// SetField stores a constant, so its value is cached already converted to the
+// kind of the field.
+struct VMFieldCache {
+  static constexpr std::uint32_t NO_SHAPE = 0xFFFF'FFFF;
+
+  std::uint32_t shape = NO_SHAPE;
+  VMStructShape::Field field{};
+  VMValue value;
+};
+
+// Storage for the values which do not fit into the payload of a VMValue.
+// Strings are immutable VMStrings (VMString.h).
+//
+// String constants of the program are interned, equal literals share one
+// handle, so loading a string constant copies its handle only. Constants are
+// pinned, all other strings are collected by mark() and sweep(): the VM marks
+// every value it still holds, sweep() frees the unmarked strings and
+// make_string() reuses their handles.
+class VMHeap {
+public:
+  VMHeap() = default;
+  // the intern table points into _strings
+  VMHeap(const VMHeap&) = delete;
+  auto operator=(const VMHeap&) -> VMHeap& = delete;
+  VMHeap(VMHeap&&) = default;
+  auto operator=(VMHeap&&) -> VMHeap& = default;
+
+  auto make_string(std::string_view value) -> VMValue;
+  auto make_string(VMString value) -> VMValue;
+  auto intern(std::string_view value) -> VMValue;
+  // a string which is never collected, without interning it
+  auto make_constant(std::string_view value) -> VMValue;
+  auto string(VMValue value) const -> std::string_view {
+    return _strings[value.handle()].view();
+  }
+  auto vm_string(VMValue value) const -> const VMString& {
+    return _strings[value.handle()];
+  }
+  // lhs + rhs, appends to the buffer of lhs if possible
+  auto concat(VMValue lhs, VMValue rhs) -> VMValue;
+
+  // equal default values share one shape
+  auto add_shape(std::span<const VMValue> defaults) -> std::uint32_t;
+  auto shape(std::uint32_t index) const -> const VMStructShape& {
+    return _shapes[index];
+  }
+  // value of a field constant, nested structs default to the null struct
+  auto field_value(const VMStructTypes& type) -> VMValue;
+
+  // number of string handles, including the free ones
+  auto string_count() const -> std::size_t {
+    return _strings.size();
+  }
+  auto live_strings() const -> std::size_t {
+    return _strings.size() - _free.size();
+  }
+  // boxed VMStruct copies, instances of StructCreate live in the VM memory
+  auto struct_count() const -> std::size_t {
+    return _structs.size();
+  }
+  // true for the handles of box(VMStruct), they have no shape
+  auto is_boxed_struct(VMValue value) const -> bool {
+    return value.is_struct() && _struct_index.contains(value.handle());
+  }
+  auto shape_count() const -> std::size_t {
+    return _shapes.size();
+  }
+
+  // conversion between the front end type and the runtime representation,
+  // size_t values and addresses outside of 48 bits can not be boxed
+  auto box(const VMType& value) -> ResultOr<VMValue>;
+  auto unbox(VMValue value) const -> VMType;
+  // box for the constant operands of the lowered code, strings are interned
+  auto constant(const VMType& value) -> VMValue;
+
+  auto to_string(VMValue value) const -> ResultOr<std::string>;
+
+  // keeps a string alive in the next sweep(), the strings of a struct are
+  // marked through its fields
+  void mark(VMValue value);
+  // frees the strings which are neither pinned nor marked, returns their number
+  auto sweep() -> std::size_t;
+  // true once the live strings doubled since the last sweep()
+  auto collection_due() const -> bool {
+    return live_strings() >= _next_collection;
+  }
+
+private:
+  static constexpr std::size_t MIN_COLLECTION = 1024;
+  enum class Slot : std::uint8_t { LIVE, PINNED, FREE };
+
+  std::deque<VMString> _strings;
+  std::vector<Slot> _slots;
+  std::vector<bool> _marks;
+  std::vector<std::size_t> _free;
+  std::size_t _next_collection = MIN_COLLECTION;
+  // struct instances seen while marking
+  std::unordered_set<const std::byte*> _visited;
+  std::unordered_map<std::string_view, std::size_t> _interned;
+  std::deque<VMStructShape> _shapes;
+  std::deque<VMStruct> _structs;
+  // handle of a boxed struct -> its index in _structs
+  std::unordered_map<std::size_t, std::size_t> _struct_index;
+};
+
+#endif
@@ -1,17 +1,32 @@
 #ifndef _PALLADIUM_VM_H
 #define _PALLADIUM_VM_H
+#include "Bytecode.h"
+#include "Fusion.h"
 #include "Instruction.h"
+#include "PbcFile.h"
 #include "Util.h"
+#include "VMGuard.h"
+#include "VMJit.h"
 #include "VMMemory.h"
+#include "VMOutput.h"
 #include "VMPolicy.h"
+#include "VMStack.h"
 #include "VMType.h"
+#include "VMValue.h"
 #include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 
@@ -39,15 +54,29 @@ struct FunctionEntry {
   void address(std::size_t adr) {
     _address = adr;
   }
+  // number of calls, the JIT compiles the function once it reaches P::jit_threshold
+  auto calls() const -> std::size_t {
+    return _calls;
+  }
+  void calls(std::size_t calls) {
+    _calls = calls;
+  }
+  auto count_call() -> std::size_t {
+    return ++_calls;
+  }
 
 private:
   std::string _name;
   uint8_t _argument_count;
   std::size_t _address;
   std::string _label;
+  std::size_t _calls = 0;
 };
 
-template <class VM> using NativeFunction = std::function<ResultOr<bool>(VM* vm, const std::vector<VMType>&)>;
+// args is a view of the topmost stack values in push order, it is only valid
+// until the function pushes onto the stack. Pushed values replace the
+// arguments once the function returns.
+template <class VM> using NativeFunction = std::function<ResultOr<bool>(VM* vm, std::span<const VMValue> args)>;
 
 template <class VM> struct NativeFunctionEntry {
   NativeFunctionEntry(std::string name, const NativeFunction<VM>& func, uint8_t arg_count)
@@ -60,7 +89,7 @@ template <class VM> struct NativeFunctionEntry {
   auto argument_count() const -> uint8_t {
     return _argument_count;
   }
-  auto operator()(VM* vm, const std::vector<VMType>& args) const -> ResultOr<bool> {
+  auto operator()(VM* vm, std::span<const VMValue> args) const -> ResultOr<bool> {
     return _func(vm, args);
   }
 
@@ -70,15 +99,27 @@ private:
   uint8_t _argument_count;
 };
 
+// Every call opens a register window in one contiguous register file. base is
+// the window of the caller, result the caller register which receives the
+// return value or NO_RESULT if it is pushed onto the stack.
 struct StackFrame {
+  static constexpr std::size_t NO_RESULT = static_cast<std::size_t>(-1);
+
   std::size_t pc;
-  std::vector<VMType> registers;
+  std::size_t base;
+  std::size_t result;
 };
 
 template <class POLICY> class VirtualMachine {
 public:
   using P = POLICY;
   using InstructionTypeV = Instruction<VirtualMachine<POLICY>>;
+  static constexpr std::size_t REGISTER_COUNT = ::REGISTER_COUNT;
+  static constexpr std::size_t INITIAL_WINDOWS = 16;
+  // reserved, not committed: 8 MiB of address space
+  static constexpr std::size_t STACK_CAPACITY = 1024 * 1024;
+  static constexpr std::size_t CALL_STACK_CAPACITY = 64 * 1024;
+  using RegisterWindow = std::span<VMValue, REGISTER_COUNT>;
 
 public:
   static auto make(const std::vector<InstructionTypeV*>& program) -> VirtualMachine<P> {
@@ -92,67 +133,473 @@ public:
   }
 
   VirtualMachine(std::size_t mem_size = 1024 * 1024 * 1024)
-      : _registers(10, 0), _pc(0), _stack(10, 0), _sp(-1), _memory(mem_size) {
+      : _register_file(REGISTER_COUNT * INITIAL_WINDOWS, 0), _base(0), _pc(0), _stack(STACK_CAPACITY),
+        _call_stack(CALL_STACK_CAPACITY), _memory(mem_size), _output(nullptr, P::output_capacity) {
   }
 
   VirtualMachine(const std::vector<InstructionTypeV*>& program, std::size_t mem_size = 1024 * 1024 * 1024)
-      : _program(program), _registers(10, 0), _pc(0), _stack(10, 0), _sp(-1), _memory(mem_size) {
+      : _program(program), _register_file(REGISTER_COUNT * INITIAL_WINDOWS, 0), _base(0), _pc(0),
+        _stack(STACK_CAPACITY), _call_stack(CALL_STACK_CAPACITY), _memory(mem_size),
+        _output(nullptr, P::output_capacity) {
   }
 
   void add_function(const std::string fname, const std::vector<InstructionTypeV*>& code, uint8_t arg_count) {
 
+    _function_index.try_emplace(fname, _function_section.size());
     _function_section.push_back({fname, arg_count, _program.size()});
     std::copy(code.cbegin(), code.cend(), std::back_inserter(_program));
+    _lowered = false;
   }
-  auto function_entry(const std::string& fname) const -> const FunctionEntry {
-    for (const auto& f_item : _function_section) {
-      if (f_item.name() == fname) {
-        return f_item;
-      }
+  // resolves a function name to its index in the function section, Call
+  // links against it while the program is lowered
+  auto link_function(const std::string& fname) const -> std::size_t {
+    auto it = _function_index.find(fname);
+    if (it == _function_index.end()) {
+      panic("function " + fname + " not exist");
     }
-    panic("function " + fname + " not exist");
+    return it->second;
+  }
+  auto function_entry(std::size_t index) const -> const FunctionEntry& {
+    return _function_section[index];
+  }
+  auto function_entry(const std::string& fname) const -> const FunctionEntry& {
+    return _function_section[link_function(fname)];
+  }
+  // pc of the function in the lowered bytecode
+  auto function_address(std::size_t index) const -> std::size_t {
+    return _entry_points[index];
   }
 
   void add_program(const std::vector<InstructionTypeV*>& program) {
     _program = program;
+    _lowered = false;
   }
 
   void add_native_function(const std::string fname, const NativeFunction<VirtualMachine<POLICY>>& code,
                            uint8_t arg_count) {
 
+    _native_index.try_emplace(fname, _native_section.size());
     _native_section.emplace_back(fname, code, arg_count);
   }
-  auto native_function_entry(const std::string& fname) const -> const NativeFunctionEntry<VirtualMachine<POLICY>> {
-    for (const auto& f_item : _native_section) {
-      if (f_item.name() == fname) {
-        return f_item;
+  auto link_native_function(const std::string& fname) const -> std::size_t {
+    auto it = _native_index.find(fname);
+    if (it == _native_index.end()) {
+      panic("native function " + fname + " not exist");
+    }
+    return it->second;
+  }
+  auto native_function_entry(std::size_t index) const -> const NativeFunctionEntry<VirtualMachine<POLICY>>& {
+    return _native_section[index];
+  }
+  auto native_function_entry(const std::string& fname) const
+      -> const NativeFunctionEntry<VirtualMachine<POLICY>>& {
+    return _native_section[link_native_function(fname)];
+  }
+
+  // runs a native function on the topmost argument_count stack values
+  auto call_native(std::size_t index) -> ResultOr<bool> {
+    const auto& entry = _native_section[index];
+    int first = _stack.pointer() - entry.argument_count() + 1;
+    auto res = entry(this, std::span<const VMValue>(_stack.data() + first, entry.argument_count()));
+
+    int pushed = std::max(_stack.pointer() - (first + entry.argument_count() - 1), 0);
+    std::copy_n(_stack.data() + _stack.pointer() - pushed + 1, pushed, _stack.data() + first);
+    _stack.set_pointer(first - 1 + pushed);
+    return res;
+  }
+
+  // Lowers the instruction objects into the flat bytecode, done once before
+  // the first run and again whenever the program was changed.
+  void lower_program() {
+    _bytecode.clear();
+    _field_constants.clear();
+    _field_values.clear();
+    _field_caches.clear();
+    _bytecode.reserve(_program.size());
+    for (const auto* inst : _program) {
+      _bytecode.push_back(inst->lower(this));
+    }
+    _entry_points.clear();
+    for (auto& entry : _function_section) {
+      _entry_points.push_back(entry.address());
+      entry.calls(0);
+    }
+    _fused = 0;
+    if (_fusion) {
+      auto res = fuse_bytecode(_bytecode, _entry_points, _fusion_profile ? &*_fusion_profile : nullptr);
+      for (auto& adr : _entry_points) {
+        adr = res.pc_map[adr];
       }
+      _bytecode = std::move(res.code);
+      _fused = res.fused;
     }
-    panic("native function " + fname + " not exist");
+    _code = _bytecode;
+    reset_jit();
+    reset_feedback();
+    _lowered = true;
   }
 
-  void run() {
-    std::size_t old_pc = 0;
+  // The lowered program as it is written into a .pbc file, taken before the
+  // first run so the heap holds only the string constants. Quickened records
+  // are written as their generic record.
+  auto image() -> ResultOr<PbcImage> {
+    if (!_lowered) {
+      lower_program();
+    }
+    PbcImage image;
+    for (std::size_t i = 0; i < _function_section.size(); ++i) {
+      const auto& entry = _function_section[i];
+      image.functions.push_back(
+          {.name = entry.name(), .argument_count = entry.argument_count(), .address = _entry_points[i]});
+    }
+    for (const auto& entry : _native_section) {
+      image.functions.push_back({.name = entry.name(),
+                                 .argument_count = entry.argument_count(),
+                                 .address = 0,
+                                 .kind = PbcFunction::NATIVE});
+    }
+    for (std::size_t i = 0; i < _field_constants.size(); ++i) {
+      if (!std::holds_alternative<VMPrimitive>(_field_constants[i])) {
+        return err("nested struct field types can not be written into a pbc file");
+      }
+      image.constants.push_back(_field_values[i].bits());
+    }
+    if (_heap.struct_count() != 0) {
+      return err("struct constants can not be written into a pbc file");
+    }
+    for (std::size_t i = 0; i < _heap.string_count(); ++i) {
+      image.strings.emplace_back(_heap.string(VMValue::string_handle(i)));
+    }
+    image.code.assign(_code.begin(), _code.end());
+    for (auto& record : image.code) {
+      record.op = generic_opcode(record.op);
+    }
+    return image;
+  }
+
+  // Replaces the program by the code of a mapped .pbc file, which is executed
+  // in place. Native functions have to be registered before. The tables are
+  // built aside, the VM is only changed if the whole file could be loaded.
+  auto load(const PbcFile& file) -> ResultOr<bool> {
+    if (_heap.string_count() != 0 || _heap.struct_count() != 0 || _heap.shape_count() != 0) {
+      return err("a pbc file can only be loaded into an empty heap");
+    }
+    std::vector<FunctionEntry> function_section;
+    std::unordered_map<std::string, std::size_t> function_index;
+    std::vector<std::size_t> entry_points;
+    std::size_t native = 0;
+    for (const auto& function : file.functions()) {
+      std::string name(file.string(function.name));
+      if (function.kind == PbcFunction::NATIVE) {
+        if (native >= _native_section.size() || _native_section[native].name() != name) {
+          return err("native function " + name + " is not registered at index " + std::to_string(native));
+        }
+        native += 1;
+        continue;
+      }
+      function_index.try_emplace(name, function_section.size());
+      function_section.push_back({name, function.argument_count, function.address});
+      entry_points.push_back(function.address);
+    }
+    VMHeap heap;
+    for (const auto& str : file.strings()) {
+      heap.make_constant(file.string(str));
+    }
+    std::vector<VMStructTypes> field_constants;
+    std::vector<VMValue> field_values;
+    for (auto bits : file.constants()) {
+      auto value = VMValue::from_bits(bits);
+      if ((value.is_string() && value.handle() >= heap.string_count()) || value.is_struct()) {
+        return err("invalid field type in the constant pool");
+      }
+      auto type = heap.unbox(value);
+      if (const auto* adr = std::get_if<VMAddress>(&type)) {
+        field_constants.push_back(VMPrimitive(*adr));
+      } else {
+        field_constants.push_back(std::get<VMPrimitive>(type));
+      }
+      field_values.push_back(value);
+    }
+    // shapes are registered in the order of their first StructCreate, as while lowering
+    std::size_t field_caches = 0;
+    for (const auto& code : file.code()) {
+      if (code.op == OpCode::SET_FIELD || code.op == OpCode::PRINT_REG_STRUCT_FIELD) {
+        std::size_t slot = code.c >> 32;
+        if (slot >= file.code().size()) {
+          return err("invalid inline cache slot at pc " + std::to_string(&code - file.code().data()));
+        }
+        field_caches = std::max(field_caches, slot + 1);
+      }
+      if (code.op != OpCode::STRUCT_CREATE) {
+        continue;
+      }
+      std::size_t first = code.c & 0xFFFF'FFFF;
+      std::size_t count = code.c >> 32;
+      if (first + count > field_values.size() ||
+          heap.add_shape(std::span(field_values).subspan(first, count)) != code.b) {
+        return err("invalid struct shape at pc " + std::to_string(&code - file.code().data()));
+      }
+    }
+    for (auto& i : _program) {
+      delete i;
+    }
+    _program.clear();
+    _function_section = std::move(function_section);
+    _function_index = std::move(function_index);
+    _entry_points = std::move(entry_points);
+    _heap = std::move(heap);
+    _field_constants = std::move(field_constants);
+    _field_values = std::move(field_values);
+    _field_caches.assign(field_caches, {});
+    _image = file;
+    _code = file.code();
+    reset_jit();
+    reset_feedback();
+    _pc = 0;
+    _lowered = true;
+    return true;
+  }
+
+  // superinstruction fusion is enabled by default, with a profile only the
+  // sequences which are hot in the profile are fused
+  void enable_fusion(bool enable) {
+    _fusion = enable;
+    _lowered = false;
+  }
+  void use_fusion_profile(FusionProfile profile) {
+    _fusion_profile = std::move(profile);
+    _lowered = false;
+  }
+  auto fused_sequences() const -> std::size_t {
+    return _fused;
+  }
+
+  // the baseline JIT compiles functions called P::jit_threshold times, a
+  // threshold of 0 or a platform without PALLADIUM_JIT keeps them interpreted
+  void enable_jit(bool enable) {
+    _jit = enable;
+  }
+  auto is_compiled(std::size_t index) const -> bool {
+    return index < _jit_code.size() && _jit_code[index].has_value();
+  }
+  // number of compiled loop traces, loops are traced after P::trace_threshold
+  // backward branches to their header
+  auto trace_count() const -> std::size_t {
+    return static_cast<std::size_t>(
+        std::count_if(_traces.begin(), _traces.end(), [](const auto& trace) { return trace.has_value(); }));
+  }
+
+  // Quickening: the generic Add, CAdd, INDAdd and If records report the
+  // variant their operand types ask for. After P::quicken_threshold reports of
+  // the same variant in a row the record at _pc is rewritten into it, a
+  // variant whose guard fails rewrites it back. After QUICKEN_DEOPT_LIMIT
+  // failed guards a record stays generic.
+  void quicken(OpCode op) {
+    auto& slot = _feedback[_pc];
+    if (slot.deopts >= QUICKEN_DEOPT_LIMIT) {
+      return;
+    }
+    if (slot.op != op) {
+      slot.op = op;
+      slot.count = 0;
+    }
+    if (++slot.count == P::quicken_threshold) {
+      own_code();
+      _bytecode[_pc].op = op;
+      _quicken_rewrites += 1;
+    }
+  }
+  void dequicken(OpCode op) {
+    auto& slot = _feedback[_pc];
+    slot.count = 0;
+    slot.deopts += 1;
+    own_code();
+    _bytecode[_pc].op = op;
+    _quicken_deopts += 1;
+  }
+  // records rewritten into a variant and rewritten back since the program was lowered
+  auto quicken_rewrites() const -> std::size_t {
+    return _quicken_rewrites;
+  }
+  auto quicken_deopts() const -> std::size_t {
+    return _quicken_deopts;
+  }
+
+  // Training run for the fusion profile. Runs the unfused program once and
+  // counts how often every pc was executed. Registers, stacks and pc are reset
+  // before and afterwards, the heap and the memory keep what the run allocated.
+  auto train() -> FusionProfile {
+    bool fusion = std::exchange(_fusion, false);
+    bool jit = std::exchange(_jit, false);
+    lower_program();
+    reset_execution();
+    FusionProfile profile;
+    profile.counts.assign(_code.size(), 0);
     do {
-      old_pc = _pc;
-      InstructionResult res = _program[_pc]->execute(this);
-      res.error([](const Error& err) {
-        std::cerr << "Instruction failed: " << err.msg() << "\n";
-        std::abort();
-      });
-    } while (_pc != old_pc);
+      profile.counts[_pc] += 1;
+    } while (execute_one(_code[_pc]));
+    reset_execution();
+    _fusion = fusion;
+    _jit = jit;
+    _lowered = false;
+    return profile;
+  }
+
+  auto bytecode() const -> std::span<const Bytecode> {
+    return _code;
+  }
+
+  auto heap() -> VMHeap& {
+    return _heap;
+  }
+  auto heap() const -> const VMHeap& {
+    return _heap;
   }
 
+  // frees the heap strings which no register, stack slot or struct reachable
+  // from them refers to, runs at backward branches and calls once due
+  auto collect_garbage() -> std::size_t {
+    for (auto value : _register_file) {
+      _heap.mark(value);
+    }
+    for (auto value : _stack.entries()) {
+      _heap.mark(value);
+    }
+    return _heap.sweep();
+  }
+
+  auto add_field_constant(const VMStructTypes& value) -> std::uint32_t {
+    _field_constants.push_back(value);
+    _field_values.push_back(_heap.field_value(value));
+    return static_cast<std::uint32_t>(_field_constants.size() - 1);
+  }
+  auto field_value(std::uint32_t index) const -> VMValue {
+    return _field_values[index];
+  }
+  // Registers the shape of a StructCreate, the default values of its fields
+  // are appended to the field constants. Returns the first constant and the
+  // shape index.
+  auto add_struct_shape(const std::vector<VMStructTypes>& fields) -> std::pair<std::uint32_t, std::uint32_t> {
+    auto first = static_cast<std::uint32_t>(_field_constants.size());
+    for (const auto& field : fields) {
+      add_field_constant(field);
+    }
+    return {first, _heap.add_shape(std::span(_field_values).subspan(first))};
+  }
+  // inline cache of a field access site, the slot is part of the record
+  auto add_field_cache() -> std::uint32_t {
+    _field_caches.emplace_back();
+    return static_cast<std::uint32_t>(_field_caches.size() - 1);
+  }
+  auto field_cache(std::uint32_t slot) -> VMFieldCache& {
+    return _field_caches[slot];
+  }
+  // new instance in the VM memory, it lives until Deallocate frees it
+  auto make_struct(std::uint32_t shape) -> ResultOr<VMValue> {
+    const auto& s = _heap.shape(shape);
+    std::size_t adr = _memory.allocate(s.size());
+    if (adr == 0) {
+      return err("out of memory for a struct of shape " + std::to_string(shape));
+    }
+    std::memcpy(reinterpret_cast<void*>(adr), s.instance().data(), s.size());
+    return VMValue::struct_handle(adr);
+  }
+  // true for the instances of StructCreate, false for the null struct and
+  // boxed struct constants of the heap
+  auto is_instance(VMValue value) const -> bool {
+    return value.is_struct() && value.handle() != 0 && _memory.contains(value.handle());
+  }
+
+  void run() {
+    auto res = run_checked();
+    if (!res.ok()) {
+      fail(res.error_value());
+    }
+  }
+
+  // run() which returns the stack overflow and underflow of P::guard_stacks
+  // policies as an error, a program without them crashes on the guard page
+  auto run_checked() -> ResultOr<bool> {
+    if (!_lowered) {
+      lower_program();
+    }
+    if constexpr (P::guard_stacks) {
+      auto body = [](void* vm) { static_cast<VirtualMachine*>(vm)->execute_program(); };
+      auto is_guard = [](void* vm, const void* adr) {
+        auto* self = static_cast<VirtualMachine*>(vm);
+        self->_stack_fault = self->_stack.guard(adr);
+        if (self->_stack_fault == StackGuard::NONE) {
+          self->_stack_fault = self->_call_stack.guard(adr);
+        }
+        return self->_stack_fault != StackGuard::NONE;
+      };
+      if (!guarded(body, is_guard, this)) {
+        return err(std::string(_stack_fault == StackGuard::LOWER ? "Stack underflow" : "Stack overflow") + " in " +
+                   function_at(_pc));
+      }
+    } else {
+      execute_program();
+    }
+    return true;
+  }
+
+  // name of the function containing pc, main outside of all functions
+  auto function_at(std::size_t pc) const -> std::string {
+    std::string name = "main";
+    std::size_t entry = 0;
+    for (std::size_t i = 0; i < _entry_points.size(); ++i) {
+      if (_entry_points[i] <= pc && _entry_points[i] >= entry) {
+        entry = _entry_points[i];
+        name = _function_section[i].name();
+      }
+    }
+    return name;
+  }
+
+private:
+  void execute_program() {
+#if PALLADIUM_COMPUTED_GOTO
+    const Bytecode* code = _code.data();
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    std::array<void*, OPCODE_TABLE_SIZE> dispatch_table;
+    dispatch_table.fill(&&op_invalid);
+#define PALLADIUM_LABEL(NAME, OP, BYTE) dispatch_table[static_cast<std::size_t>(OpCode::OP)] = &&op_##OP;
+    PALLADIUM_OPCODES(PALLADIUM_LABEL)
+#undef PALLADIUM_LABEL
+
+#define PALLADIUM_DISPATCH() goto* dispatch_table[static_cast<std::size_t>(code[_pc].op)]
+#define PALLADIUM_HANDLER(NAME, OP, BYTE)                                                                              \
+  op_##OP : if (!dispatch<NAME<VirtualMachine>>(code[_pc])) {                                                          \
+    return;                                                                                                            \
+  }                                                                                                                    \
+  if constexpr (has_feedback<NAME<VirtualMachine>>) {                                                                  \
+    code = _code.data();                                                                                               \
+  }                                                                                                                    \
+  PALLADIUM_DISPATCH();
+
+    PALLADIUM_DISPATCH();
+    PALLADIUM_OPCODES(PALLADIUM_HANDLER)
+  op_invalid:
+    panic("Invalid opcode " + std::to_string(static_cast<std::size_t>(code[_pc].op)));
+#undef PALLADIUM_HANDLER
+#undef PALLADIUM_DISPATCH
+#pragma GCC diagnostic pop
+#else
+    while (execute_one(_code[_pc])) {
+    }
+#endif
+  }
+
+public:
   void step() {
-    std::size_t old_pc = 0;
+    if (!_lowered) {
+      lower_program();
+    }
+    bool running = true;
     do {
       std::string cmd;
-      old_pc = _pc;
-      InstructionResult res = _program[_pc]->execute(this);
-      res.error([](const Error& err) {
-        std::cerr << "Instruction failed: " << err.msg() << "\n";
-        std::abort();
-      });
+      running = execute_one(_code[_pc]);
       std::cin >> cmd;
       if (cmd == "r") {
         print_registers();
@@ -161,18 +608,19 @@ public:
         print_registers();
         print_stack();
       }
-    } while (_pc != old_pc);
+    } while (running);
   }
 
   template <class... ARG> auto init_registers(ARG&&... args) {
-    std::vector<int> tmp = {std::forward<ARG>(args)...};
-    std::copy_n(tmp.begin(), std::min(tmp.size(), _registers.size()), _registers.begin());
+    std::vector<VMValue> tmp = {VMValue(std::forward<ARG>(args))...};
+    std::copy_n(tmp.begin(), std::min(tmp.size(), REGISTER_COUNT), registers().begin());
   }
-  auto reg_0() const -> VMType {
-    return _registers[0];
+  auto reg_0() const -> VMValue {
+    return _register_file[_base];
   }
-  auto registers() -> std::vector<VMType>& {
-    return _registers;
+  // register window of the running function, invalidated by the next call
+  auto registers() -> RegisterWindow {
+    return RegisterWindow(_register_file.data() + _base, REGISTER_COUNT);
   }
   void inc_pc(std::size_t inc = 1) {
     _pc += inc;
@@ -181,57 +629,93 @@ public:
     return _pc;
   }
   void inc_sp(int inc = 1) {
-    _sp += inc;
+    _stack.set_pointer(_stack.pointer() + inc);
   }
   void set_sp(int sp) {
-    _sp = sp;
+    _stack.set_pointer(sp);
   }
   void set_pc(std::size_t pc) {
     _pc = pc;
   }
   auto stack_pointer() const -> int {
-    return _sp;
+    return _stack.pointer();
   }
-  auto stack_top() -> VMType& {
-    P::check_stack_bounds(_sp, _stack.max_size());
-    return _stack[_sp];
+  auto stack_top() -> VMValue& {
+    return _stack.top();
   }
-  void stack_pop() {
-    _sp -= 1;
-    P::check_stack_bounds(_sp, _stack.max_size());
+  // removes the top of the stack and returns it
+  auto stack_pop() -> VMValue {
+    return _stack.pop();
   }
-  void make_stack_frame() {
-    StackFrame frame = {.pc = _pc, .registers = _registers};
-    _call_stack.push_back(frame);
+  // Slides the register window offset registers up. With an offset smaller
+  // than REGISTER_COUNT the windows overlap and the upper registers of the
+  // caller become the first registers of the callee.
+  void make_stack_frame(std::size_t offset = REGISTER_COUNT, std::size_t result = StackFrame::NO_RESULT) {
+    _call_stack.push({.pc = _pc, .base = _base, .result = result});
+    _base += offset;
+    if (_register_file.size() < _base + REGISTER_COUNT) {
+      _register_file.resize(std::max(_register_file.size() * 2, _base + REGISTER_COUNT));
+    }
   }
-  void restore_from_call_stack() {
-    StackFrame frame = _call_stack[_call_stack.size() - 1];
+  // opens the register window of a function and jumps to its entry
+  void enter_function(std::size_t index, std::size_t offset = REGISTER_COUNT,
+                      std::size_t result = StackFrame::NO_RESULT) {
+    make_stack_frame(offset, result);
+    if (_heap.collection_due()) [[unlikely]] {
+      collect_garbage();
+    }
+    _profiler.enter(index, _function_section[index].name());
+    _pc = _entry_points[index];
+    if constexpr (P::jit_threshold != 0) {
+      if (_function_section[index].count_call() == P::jit_threshold && _jit) {
+        compile_function(index);
+      }
+    }
+  }
+  auto restore_from_call_stack() -> StackFrame {
+    _profiler.leave();
+    StackFrame frame = _call_stack.pop();
     _pc = frame.pc + 1;
-    _registers = frame.registers;
-    _call_stack.pop_back();
+    _base = frame.base;
+    return frame;
   }
-
-  void stack_push(const VMType& value) {
-    _sp += 1;
-    P::check_stack_bounds(_sp, _stack.max_size());
-    if (std::cmp_less(_sp, _stack.size())) {
-      _stack[_sp] = value;
+  void return_from_call(VMValue value) {
+    StackFrame frame = restore_from_call_stack();
+    if (frame.result == StackFrame::NO_RESULT) {
+      stack_push(value);
     } else {
-      _stack.push_back(value);
+      registers()[frame.result] = value;
     }
+    run_compiled();
+  }
+  void return_void() {
+    restore_from_call_stack();
+    run_compiled();
   }
 
-  void store_on_stack(std::size_t adr, const VMType& value) {
+  void stack_push(VMValue value) {
+    _stack.push(value);
+  }
+
+  void store_on_stack(std::size_t adr, VMValue value) {
     _stack[adr] = value;
   }
 
-  auto allocate(std::size_t size) -> VMAddress {
+  auto allocate(std::size_t size) -> VMValue {
     return VMAddress{_memory.allocate(size)};
   }
 
   void deallocate(const VMAddress& adr) {
     _memory.deallocate(adr.get());
   }
+  // the bytes an address register points to, nullptr if it holds no address
+  // the n bytes at address, nullptr if they leave the committed VM memory
+  auto memory_range(VMValue address, std::size_t n) -> std::byte* {
+    return address.is_address() ? memory_range(address.as_address().get(), n) : nullptr;
+  }
+  auto memory_range(std::size_t adr, std::size_t n) -> std::byte* {
+    return _memory.contains(adr, n) ? reinterpret_cast<std::byte*>(adr) : nullptr;
+  }
 
   void print_memory() const {
     std::cout << _memory;
@@ -239,22 +723,31 @@ public:
 
   void print_registers() {
     std::cout << "Registers:\n";
-    for (std::size_t i = 0; i < _registers.size(); ++i) {
+    auto window = registers();
+    for (std::size_t i = 0; i < window.size(); ++i) {
       std::cout << "  R[" << i << "]: ";
-      std::cout << ::to_string(_registers[i]).result_or("");
+      std::cout << _heap.to_string(window[i]).result_or("");
       std::cout << "\n";
     }
   }
   void print_stack() {
     std::cout << "Stack:" << std::endl;
     std::cout << "----------------------" << std::endl;
-    for (const auto& x : _stack) {
-      std::cout << "\t" << ::to_string(x).result_or("---");
+    for (const auto& x : _stack.entries()) {
+      std::cout << "\t" << _heap.to_string(x).result_or("---");
       std::cout << std::endl;
       ;
     }
   }
 
+  auto profiler() -> typename P::Profiler& {
+    return _profiler;
+  }
+  // output of Print and PrintRegStructField, written on Flush, Halt or when full
+  auto output() -> VMOutput& {
+    return _output;
+  }
+
   auto to_string() const -> std::string {
     std::string ss;
     for (auto& inst : _program) {
@@ -263,16 +756,270 @@ public:
     return ss;
   }
 
+private:
+  static constexpr std::uint32_t NOT_COMPILED = static_cast<std::uint32_t>(-1);
+
+  // a function ends at the next entry point or the end of the code
+  void compile_function(std::size_t index) {
+    std::size_t first = _entry_points[index];
+    std::size_t last = _code.size();
+    for (auto adr : _entry_points) {
+      if (adr > first) {
+        last = std::min(last, adr);
+      }
+    }
+    auto jit = jit_compile(_code, first, last, REGISTER_COUNT, &jit_step, &jit_safepoint);
+    if (!jit) {
+      return;
+    }
+    _jit_code[index] = std::move(*jit);
+    std::fill(_jit_entries.begin() + static_cast<std::ptrdiff_t>(first),
+              _jit_entries.begin() + static_cast<std::ptrdiff_t>(last), static_cast<std::uint32_t>(index));
+  }
+
+public:
+  // continues a compiled function at _pc until it returns to the interpreter,
+  // calls run it once the arguments are in place
+  void run_compiled() {
+    if constexpr (P::jit_threshold != 0) {
+      if (!_jit || _pc >= _jit_entries.size() || _jit_entries[_pc] == NOT_COMPILED) {
+        return;
+      }
+      std::uint32_t index = _jit_entries[_pc];
+      auto& jit = *_jit_code[index];
+      std::size_t pc = jit.run(registers().data(), this, _pc);
+      if ((pc & JIT_DEOPT) != 0) {
+        pc &= ~JIT_DEOPT;
+        if (jit.deopt() >= JIT_DEOPT_LIMIT) {
+          std::replace(_jit_entries.begin(), _jit_entries.end(), index, NOT_COMPILED);
+          _jit_code[index].reset();
+        }
+      }
+      _pc = pc;
+    }
+  }
+
+private:
+  // runs the record at pc for the compiled code, which continues with the
+  // next record as long as the register window stays the same
+  static auto jit_step(void* context, std::size_t pc) -> std::size_t {
+    auto* vm = static_cast<VirtualMachine*>(context);
+    const VMValue* window = vm->registers().data();
+    vm->_pc = pc;
+    vm->execute_one(vm->_code[pc]);
+    if (vm->_pc == pc + 1 && vm->registers().data() == window) {
+      return JIT_CONTINUE;
+    }
+    return vm->_pc;
+  }
+  // the loops of compiled code collect where the interpreter would
+  static void jit_safepoint(void* context) {
+    auto* vm = static_cast<VirtualMachine*>(context);
+    if (vm->_heap.collection_due()) [[unlikely]] {
+      vm->collect_garbage();
+    }
+  }
+
+  void reset_execution() {
+    _pc = 0;
+    _base = 0;
+    std::fill(_register_file.begin(), _register_file.end(), VMValue(0));
+    _stack.set_pointer(-1);
+    _call_stack.set_pointer(-1);
+  }
+
+  void reset_jit() {
+    _jit_code.clear();
+    _jit_code.resize(_function_section.size());
+    _jit_entries.assign(_code.size(), NOT_COMPILED);
+    _traces.clear();
+    _trace_entries.assign(_code.size(), NOT_COMPILED);
+    _loop_counts.assign(_code.size(), 0);
+  }
+
+  struct QuickenSlot {
+    OpCode op{};
+    std::uint16_t count = 0;
+    std::uint16_t deopts = 0;
+  };
+  static constexpr std::uint16_t QUICKEN_DEOPT_LIMIT = 4;
+
+  void reset_feedback() {
+    _feedback.assign(_code.size(), {});
+    _quicken_rewrites = 0;
+    _quicken_deopts = 0;
+  }
+
+  // the code of a loaded image is mapped read only, the first rewrite of
+  // quicken() copies it and execute_program() continues on the copy
+  void own_code() {
+    if (_code.data() != _bytecode.data()) {
+      _bytecode.assign(_code.begin(), _code.end());
+      _code = _bytecode;
+    }
+  }
+
+  static constexpr std::uint32_t TRACE_BLACKLISTED = static_cast<std::uint32_t>(-1);
+
+  // a branch jumped back to _pc, runs the trace of the loop or counts the edge
+  void loop_edge() {
+    if (!_jit || _recording || _pc >= _trace_entries.size()) {
+      return;
+    }
+    if (_trace_entries[_pc] != NOT_COMPILED) {
+      run_trace();
+    } else if (_loop_counts[_pc] != TRACE_BLACKLISTED && ++_loop_counts[_pc] == P::trace_threshold) {
+      record_trace();
+    }
+  }
+
+  // Executes the next iteration of the loop at _pc in the interpreter and
+  // records it. The loop is blacklisted if the iteration runs into a record
+  // which can't be traced before it returns to the header.
+  void record_trace() {
+    std::size_t header = _pc;
+    std::vector<TraceRecord> trace;
+    _recording = true;
+    while (trace.size() < JIT_TRACE_LIMIT && jit_traceable(_code[_pc], registers())) {
+      std::size_t pc = _pc;
+      execute_one(_code[pc]);
+      trace.push_back({pc, _code[pc], _pc != pc + 1});
+      if (_pc == header) {
+        break;
+      }
+    }
+    _recording = false;
+    std::optional<JitCode> jit;
+    if (_pc == header && !trace.empty()) {
+      jit = jit_compile_trace(trace, REGISTER_COUNT);
+    }
+    if (!jit) {
+      _loop_counts[header] = TRACE_BLACKLISTED;
+      return;
+    }
+    _trace_entries[header] = static_cast<std::uint32_t>(_traces.size());
+    _traces.push_back(std::move(*jit));
+    run_trace();
+  }
+
+  // runs the trace of the loop at _pc until a side exit, a trace which keeps
+  // failing its entry checks is dropped and the loop stays interpreted
+  void run_trace() {
+    std::size_t header = _pc;
+    std::uint32_t index = _trace_entries[header];
+    auto& trace = *_traces[index];
+    std::size_t pc = trace.run(registers().data(), this, header);
+    if ((pc & JIT_DEOPT) != 0) {
+      pc &= ~JIT_DEOPT;
+      if (trace.deopt() >= JIT_DEOPT_LIMIT) {
+        _traces[index].reset();
+        _trace_entries[header] = NOT_COMPILED;
+        _loop_counts[header] = TRACE_BLACKLISTED;
+      }
+    }
+    _pc = pc;
+  }
+
+  [[noreturn]] void fail(const Error& error) {
+    _output.flush();
+    std::cerr << "Instruction failed: " << error.msg() << "\n";
+    std::abort();
+  }
+
+  // instructions which can rewrite their record in quicken()
+  template <class I>
+  static constexpr bool has_feedback =
+      P::quicken_threshold != 0 &&
+      (std::is_same_v<I, Add<VirtualMachine>> || std::is_same_v<I, CAdd<VirtualMachine>> ||
+       std::is_same_v<I, INDAdd<VirtualMachine>> || std::is_same_v<I, If<VirtualMachine>>);
+
+  // branches which can close a loop
+  template <class I>
+  static constexpr bool is_loop_branch =
+      std::is_same_v<I, Goto<VirtualMachine>> || std::is_same_v<I, If<VirtualMachine>> ||
+      std::is_same_v<I, CmpBr<VirtualMachine>> || std::is_same_v<I, CmpBrI<VirtualMachine>> ||
+      std::is_same_v<I, CmpImmBranch<VirtualMachine>> || std::is_same_v<I, IfIntImm<VirtualMachine>>;
+
+  // executes one bytecode record, returns false once the program halted
+  template <class I> auto dispatch(const Bytecode& code) -> bool {
+    [[maybe_unused]] std::size_t pc = _pc;
+    auto token = _profiler.begin(_pc, code.op);
+    InstructionResult res = I::execute(this, code);
+    _profiler.end(token);
+    if (!res.ok()) [[unlikely]] {
+      fail(res.error_value());
+    }
+    if constexpr (is_loop_branch<I>) {
+      if (_pc <= pc) {
+        if (_heap.collection_due()) [[unlikely]] {
+          collect_garbage();
+        }
+        if constexpr (P::trace_threshold != 0) {
+          loop_edge();
+        }
+      }
+    }
+    if constexpr (std::is_same_v<I, Halt<VirtualMachine>>) {
+      _profiler.halt();
+    }
+    return !std::is_same_v<I, Halt<VirtualMachine>>;
+  }
+
+  auto execute_one(const Bytecode& code) -> bool {
+    switch (code.op) {
+#define PALLADIUM_CASE(NAME, OP, BYTE)                                                                                 \
+  case OpCode::OP:                                                                                                     \
+    return dispatch<NAME<VirtualMachine>>(code);
+      PALLADIUM_OPCODES(PALLADIUM_CASE)
+#undef PALLADIUM_CASE
+    }
+    panic("Invalid opcode " + std::to_string(static_cast<std::size_t>(code.op)));
+  }
+
 private:
   std::vector<InstructionTypeV*> _program;
-  std::vector<VMType> _registers;
+  std::vector<Bytecode> _bytecode;
+  // the executed code, either _bytecode or the code section of _image
+  std::span<const Bytecode> _code;
+  std::optional<PbcFile> _image;
+  std::vector<VMStructTypes> _field_constants;
+  // the boxed _field_constants
+  std::vector<VMValue> _field_values;
+  std::vector<VMFieldCache> _field_caches;
+  bool _lowered = false;
+  bool _fusion = true;
+  std::optional<FusionProfile> _fusion_profile;
+  std::size_t _fused = 0;
+  std::vector<std::size_t> _entry_points;
+  std::vector<VMValue> _register_file;
+  std::size_t _base;
   std::size_t _pc;
-  std::vector<VMType> _stack;
-  int _sp;
+  VMStack<VMValue> _stack;
   std::vector<FunctionEntry> _function_section;
   std::vector<NativeFunctionEntry<VirtualMachine<POLICY>>> _native_section;
-  std::vector<StackFrame> _call_stack;
+  std::unordered_map<std::string, std::size_t> _function_index;
+  std::unordered_map<std::string, std::size_t> _native_index;
+  VMStack<StackFrame> _call_stack;
+  // guard page of the last fault in run_checked()
+  StackGuard _stack_fault = StackGuard::NONE;
   VMMemory<VirtualMachine<POLICY>> _memory;
+  VMHeap _heap;
+  VMOutput _output;
+  bool _jit = true;
+  std::vector<std::optional<JitCode>> _jit_code;
+  // index of the compiled function of every pc, NOT_COMPILED if there is none
+  std::vector<std::uint32_t> _jit_entries;
+  // backward branches to every pc, TRACE_BLACKLISTED once its loop can't be traced
+  std::vector<std::uint32_t> _loop_counts;
+  std::vector<std::optional<JitCode>> _traces;
+  // index of the trace of every loop header, NOT_COMPILED if there is none
+  std::vector<std::uint32_t> _trace_entries;
+  bool _recording = false;
+  // type feedback of every pc for quicken()
+  std::vector<QuickenSlot> _feedback;
+  std::size_t _quicken_rewrites = 0;
+  std::size_t _quicken_deopts = 0;
+  [[no_unique_address]] typename P::Profiler _profiler;
 };
 
 #endif
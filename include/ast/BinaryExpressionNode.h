@@ -13,6 +13,12 @@ public:
   auto identfier() const -> const std::string& {
     return _identifier;
   }
+  auto op() const -> AstPtr {
+    return _op;
+  }
+  auto expression() const -> AstPtr {
+    return _expression;
+  }
 
 private:
   std::string _identifier;
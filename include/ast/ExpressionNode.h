@@ -23,6 +23,10 @@ public:
     return _constante;
   }
 
+  auto expression() const -> AstPtr {
+    return _exp;
+  }
+
 private:
   std::string _constante;
   AstPtr _exp;
@@ -12,6 +12,9 @@ public:
   ~OperatorNode() = default;
   OperatorNode(OperatorKind kind);
   void accept(const std::shared_ptr<Visitor>& v) override;
+  auto kind() const -> OperatorKind {
+    return _kind;
+  }
 
 private:
   OperatorKind _kind;
@@ -0,0 +1,597 @@
+#include "Assembler.h"
+#include "Bytecode.h"
+#include "Fusion.h"
+#include "Instruction.h"
+#include "PbcFile.h"
+#include "Util.h"
+#include "VMType.h"
+#include "VMValue.h"
+#include "VirtualMachine.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+// Stands in for the VM while the instructions lower themselves. Functions are
+// linked against the function section, native functions are numbered in the
+// order of their first call.
+class AssemblerContext {
+public:
+  auto heap() -> VMHeap& {
+    return _heap;
+  }
+  auto add_field_constant(const VMStructTypes& value) -> std::uint32_t {
+    _field_constants.push_back(value);
+    _field_values.push_back(_heap.field_value(value));
+    return static_cast<std::uint32_t>(_field_constants.size() - 1);
+  }
+  auto add_struct_shape(const std::vector<VMStructTypes>& fields) -> std::pair<std::uint32_t, std::uint32_t> {
+    auto first = static_cast<std::uint32_t>(_field_constants.size());
+    for (const auto& field : fields) {
+      add_field_constant(field);
+    }
+    return {first, _heap.add_shape(std::span(_field_values).subspan(first))};
+  }
+  auto add_field_cache() -> std::uint32_t {
+    return _field_caches++;
+  }
+  auto link_function(const std::string& fname) -> std::size_t {
+    auto it = _function_index.find(fname);
+    if (it == _function_index.end()) {
+      _unknown_function = fname;
+      return 0;
+    }
+    return it->second;
+  }
+  auto link_native_function(const std::string& fname) -> std::size_t {
+    auto [it, inserted] = _native_index.try_emplace(fname, _natives.size());
+    if (inserted) {
+      _natives.push_back(fname);
+    }
+    return it->second;
+  }
+
+  auto add_function(const std::string& fname) -> bool {
+    return _function_index.try_emplace(fname, _function_index.size()).second;
+  }
+  // name of a function called by the last lowered instruction which is not in the function section
+  auto take_unknown_function() -> std::string {
+    return std::exchange(_unknown_function, {});
+  }
+  auto natives() const -> const std::vector<std::string>& {
+    return _natives;
+  }
+  auto field_values() const -> const std::vector<VMValue>& {
+    return _field_values;
+  }
+
+private:
+  VMHeap _heap;
+  std::vector<VMStructTypes> _field_constants;
+  std::vector<VMValue> _field_values;
+  std::uint32_t _field_caches = 0;
+  std::unordered_map<std::string, std::size_t> _function_index;
+  std::unordered_map<std::string, std::size_t> _native_index;
+  std::vector<std::string> _natives;
+  std::string _unknown_function;
+};
+
+// FIELDS takes the rest of the line as a list of field values, ADDRESS a
+// memory operand [base + index*scale + offset]
+enum class Operand { REG, NUM, TARGET, VALUE, FIELD, FIELDS, NAME, ADDRESS };
+using OperandValue = std::variant<std::size_t, VMPrimitive, std::vector<VMStructTypes>, MemoryOperand>;
+
+template <Operand K> auto argument(const OperandValue& op) {
+  if constexpr (K == Operand::VALUE || K == Operand::NAME) {
+    return VMType(std::get<VMPrimitive>(op));
+  } else if constexpr (K == Operand::FIELD) {
+    return VMStructTypes(std::get<VMPrimitive>(op));
+  } else if constexpr (K == Operand::FIELDS) {
+    return std::get<std::vector<VMStructTypes>>(op);
+  } else if constexpr (K == Operand::ADDRESS) {
+    return std::get<MemoryOperand>(op);
+  } else {
+    return std::get<std::size_t>(op);
+  }
+}
+
+struct Mnemonic {
+  std::array<Operand, 4> operands;
+  std::size_t count;
+  auto (*emit)(AssemblerContext& ctx, const OperandValue* ops) -> Bytecode;
+};
+
+template <template <class> class I, Operand... K, std::size_t... N>
+auto emit(AssemblerContext& ctx, [[maybe_unused]] const OperandValue* ops, std::index_sequence<N...>) -> Bytecode {
+  return I<AssemblerContext>(argument<K>(ops[N])...).lower(&ctx);
+}
+
+template <template <class> class I, Operand... K> auto mnemonic() -> Mnemonic {
+  return {.operands = {K...}, .count = sizeof...(K), .emit = [](AssemblerContext& ctx, const OperandValue* ops) {
+            return emit<I, K...>(ctx, ops, std::make_index_sequence<sizeof...(K)>());
+          }};
+}
+
+using enum Operand;
+
+const std::unordered_map<std::string_view, Mnemonic> MNEMONICS = {
+    {"Load", mnemonic<Load, REG>()},
+    {"CLoad", mnemonic<CLoad, VALUE>()},
+    {"INDLoad", mnemonic<INDLoad, REG>()},
+    {"SLoad", mnemonic<SLoad, NUM>()},
+    {"Store", mnemonic<Store, REG>()},
+    {"INDStore", mnemonic<INDStore, REG>()},
+    {"Add", mnemonic<Add, NUM>()},
+    {"CAdd", mnemonic<CAdd, VALUE>()},
+    {"INDAdd", mnemonic<INDAdd, REG>()},
+    {"If", mnemonic<If, NUM, VALUE, TARGET>()},
+    {"Goto", mnemonic<Goto, TARGET>()},
+    {"Halt", mnemonic<Halt>()},
+    {"Push", mnemonic<Push, VALUE>()},
+    {"Pop", mnemonic<Pop>()},
+    {"Print", mnemonic<Print>()},
+    {"PrintRegStructField", mnemonic<PrintRegStructField, REG, NUM>()},
+    {"Flush", mnemonic<Flush>()},
+    {"Call", mnemonic<Call, NAME>()},
+    {"CallNative", mnemonic<CallNative, NAME>()},
+    {"CallR", mnemonic<CallR, NAME, REG>()},
+    {"RetVoid", mnemonic<RetVoid>()},
+    {"Return", mnemonic<Return, REG>()},
+    {"StructCreate", mnemonic<StructCreate, REG, FIELDS>()},
+    {"GetField", mnemonic<GetField, REG, REG, NUM>()},
+    {"SetField", mnemonic<SetField, REG, NUM, FIELD>()},
+    {"Allocate", mnemonic<Allocate, NUM, REG>()},
+    {"Deallocate", mnemonic<Deallocate, REG>()},
+    {"WriteMem", mnemonic<WriteMem, REG>()},
+    {"ReadMem", mnemonic<ReadMem, REG>()},
+    {"MemCopy", mnemonic<MemCopy, REG, REG, REG>()},
+    {"MemSet", mnemonic<MemSet, REG, REG, REG>()},
+    {"MemCmp", mnemonic<MemCmp, REG, REG, REG, REG>()},
+    {"LoadMem", mnemonic<LoadMem, REG, ADDRESS, NUM>()},
+    {"StoreMem", mnemonic<StoreMem, REG, ADDRESS, NUM>()},
+    {"Mov", mnemonic<Mov, NUM, REG>()},
+    {"AddRRR", mnemonic<AddRRR, REG, REG, REG>()},
+    {"AddRRI", mnemonic<AddRRI, REG, REG, VALUE>()},
+    {"SubRRR", mnemonic<SubRRR, REG, REG, REG>()},
+    {"SubRRI", mnemonic<SubRRI, REG, REG, VALUE>()},
+    {"MulRRR", mnemonic<MulRRR, REG, REG, REG>()},
+    {"MulRRI", mnemonic<MulRRI, REG, REG, VALUE>()},
+    {"DivRRR", mnemonic<DivRRR, REG, REG, REG>()},
+    {"DivRRI", mnemonic<DivRRI, REG, REG, VALUE>()},
+    {"ModRRR", mnemonic<ModRRR, REG, REG, REG>()},
+    {"ModRRI", mnemonic<ModRRI, REG, REG, VALUE>()},
+    {"MovRR", mnemonic<MovRR, REG, REG>()},
+    {"MovRI", mnemonic<MovRI, REG, VALUE>()},
+    {"CmpBr", mnemonic<CmpBr, NUM, REG, REG, TARGET>()},
+    {"CmpBrI", mnemonic<CmpBrI, NUM, REG, VALUE, TARGET>()},
+    {"IncReg", mnemonic<IncReg, REG, VALUE>()},
+    {"CLoadRet", mnemonic<CLoadRet, VALUE>()},
+    {"CmpImmBranch", mnemonic<CmpImmBranch, REG, NUM, VALUE, TARGET>()},
+};
+
+template <class T> auto parse_number(std::string_view token) -> std::optional<T> {
+  T value{};
+  auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+  if (ec != std::errc() || ptr != token.data() + token.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+auto parse_string(std::string_view token) -> std::optional<std::string> {
+  if (token.size() < 2 || token.back() != '"') {
+    return std::nullopt;
+  }
+  std::string value;
+  for (std::size_t i = 1; i + 1 < token.size(); ++i) {
+    if (token[i] != '\\') {
+      value += token[i];
+      continue;
+    }
+    switch (i + 2 < token.size() ? token[++i] : '\0') {
+    case 'n':
+      value += '\n';
+      break;
+    case 't':
+      value += '\t';
+      break;
+    case '"':
+    case '\\':
+      value += token[i];
+      break;
+    default:
+      return std::nullopt;
+    }
+  }
+  return value;
+}
+
+auto parse_value(std::string_view token) -> std::optional<VMPrimitive> {
+  if (token.empty()) {
+    return std::nullopt;
+  }
+  if (token.front() == '"') {
+    return parse_string(token);
+  }
+  if (token == "true" || token == "false") {
+    return VMPrimitive(token == "true");
+  }
+  if (token.back() == 'f' && token.find('.') != std::string_view::npos) {
+    return parse_number<float>(token.substr(0, token.size() - 1));
+  }
+  if (token.back() == 'u') {
+    return parse_number<std::size_t>(token.substr(0, token.size() - 1));
+  }
+  if (token.find_first_of(".eE") != std::string_view::npos) {
+    return parse_number<double>(token);
+  }
+  return parse_number<int>(token);
+}
+
+auto is_identifier(std::string_view token) -> bool {
+  if (token.empty() || !(std::isalpha(static_cast<unsigned char>(token.front())) || token.front() == '_')) {
+    return false;
+  }
+  for (char c : token) {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+auto trim(std::string_view str) -> std::string_view {
+  auto first = str.find_first_not_of(" \t\r");
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  return str.substr(first, str.find_last_not_of(" \t\r") - first + 1);
+}
+
+struct Fixup {
+  std::size_t pc;
+  std::string_view label;
+  std::size_t line;
+};
+
+class Assembler {
+public:
+  explicit Assembler(std::string_view source) : _tokens(source) {
+  }
+
+  auto run() -> ResultOr<PbcImage> {
+    do {
+      auto header = _tokens.next();
+      if (header.empty()) {
+        continue;
+      }
+      ResultOr<bool> res = true;
+      if (header == "$function_section") {
+        res = function_section();
+      } else if (header == "$code_section") {
+        res = code_section();
+      } else {
+        res = err("unexpected " + std::string(header) + " in line " + std::to_string(_tokens.line()));
+      }
+      if (!res) {
+        return res.error_value();
+      }
+    } while (_tokens.next_line());
+    return finish();
+  }
+
+private:
+  auto line_error(const std::string& section, const std::string& msg) const -> Error {
+    return err("parsing error in " + section + " section in line " + std::to_string(_tokens.line()) + "! " + msg);
+  }
+
+  auto function_section() -> ResultOr<bool> {
+    if (_function_section) {
+      return err("fatal: multiple function_section found in line " + std::to_string(_tokens.line()) + "!");
+    }
+    _function_section = true;
+    while (_tokens.next_line()) {
+      auto fname = _tokens.next();
+      if (fname.empty()) {
+        continue;
+      }
+      if (fname == "$end") {
+        return true;
+      }
+      auto arg_count = _tokens.next();
+      auto label = _tokens.next();
+      if (arg_count.empty() || label.empty()) {
+        return err("Missing function entry item in line " + std::to_string(_tokens.line()) + "! Content is " +
+                   std::string(trim(_tokens.current_line())));
+      }
+      if (!_tokens.next().empty()) {
+        return err("parsing error in function section line " + std::to_string(_tokens.line()) +
+                   "! valid format is: [function name] [argument] [count label] not " +
+                   std::string(_tokens.current_line()));
+      }
+      auto count = parse_number<std::uint8_t>(arg_count);
+      if (!count) {
+        return line_error("function", "argument count is not a number: " + std::string(arg_count));
+      }
+      if (!_ctx.add_function(std::string(fname))) {
+        return line_error("function", "function " + std::string(fname) + " defined twice");
+      }
+      _functions.emplace_back(std::string(fname), *count, std::string(label));
+    }
+    return err("parsing error in function section! function section not closed with $end");
+  }
+
+  auto code_section() -> ResultOr<bool> {
+    while (_tokens.next_line()) {
+      auto token = _tokens.next();
+      if (token == "$end") {
+        return true;
+      }
+      if (!token.empty() && token.back() == ':') {
+        auto label = token.substr(0, token.size() - 1);
+        if (!is_identifier(label) || !_labels.try_emplace(label, _code.size()).second) {
+          return line_error("code", "invalid or duplicate label " + std::string(label));
+        }
+        token = _tokens.next();
+      }
+      if (token.empty()) {
+        continue;
+      }
+      auto res = instruction(token);
+      if (!res) {
+        return res;
+      }
+    }
+    return err("parsing error in code section! code section not closed with $end");
+  }
+
+  auto instruction(std::string_view name) -> ResultOr<bool> {
+    auto it = MNEMONICS.find(name);
+    if (it == MNEMONICS.end()) {
+      return line_error("code", "unknown instruction " + std::string(name));
+    }
+    const auto& mnemonic = it->second;
+    std::array<OperandValue, 4> ops;
+    std::string_view label;
+    for (std::size_t i = 0; i < mnemonic.count; ++i) {
+      if (mnemonic.operands[i] == Operand::FIELDS || mnemonic.operands[i] == Operand::ADDRESS) {
+        auto res = mnemonic.operands[i] == Operand::FIELDS ? fields(ops[i]) : address(ops[i]);
+        if (!res) {
+          return res;
+        }
+        continue;
+      }
+      auto token = _tokens.next();
+      if (token.empty()) {
+        return line_error("code", std::string(name) + " expects " + std::to_string(mnemonic.count) + " operands");
+      }
+      auto res = operand(mnemonic.operands[i], token, ops[i], label);
+      if (!res) {
+        return res;
+      }
+    }
+    if (!_tokens.next().empty()) {
+      return line_error("code", std::string(name) + " expects " + std::to_string(mnemonic.count) + " operands");
+    }
+    if (!label.empty()) {
+      _fixups.push_back({.pc = _code.size(), .label = label, .line = _tokens.line()});
+    }
+    _code.push_back(mnemonic.emit(_ctx, ops.data()));
+    if (auto fname = _ctx.take_unknown_function(); !fname.empty()) {
+      return line_error("code", "unknown function " + fname);
+    }
+    return true;
+  }
+
+  auto fields(OperandValue& op) -> ResultOr<bool> {
+    std::vector<VMStructTypes> types;
+    for (auto token = _tokens.next(); !token.empty(); token = _tokens.next()) {
+      auto value = parse_value(token);
+      if (!value) {
+        return line_error("code", "invalid value " + std::string(token));
+      }
+      types.emplace_back(*value);
+    }
+    op = std::move(types);
+    return true;
+  }
+
+  // [base], [base + imm], [base + index*scale] or [base + index*scale + imm], the
+  // operand may span several tokens
+  auto address(OperandValue& op) -> ResultOr<bool> {
+    std::string text;
+    for (auto token = _tokens.next(); !token.empty(); token = _tokens.next()) {
+      text += token;
+      if (token.back() == ']') {
+        break;
+      }
+    }
+    auto error = [&] { return line_error("code", "invalid memory operand " + text); };
+    if (text.size() < 3 || text.front() != '[' || text.back() != ']') {
+      return error();
+    }
+    std::string_view rest(text.data() + 1, text.size() - 2);
+    MemoryOperand adr{.base = MemoryOperand::NO_INDEX};
+    bool negative = false;
+    while (!rest.empty()) {
+      auto end = std::min(rest.find_first_of("+-", 1), rest.size());
+      auto term = rest.substr(0, end);
+      rest.remove_prefix(end);
+      if (adr.base == MemoryOperand::NO_INDEX) {
+        auto base = parse_number<std::size_t>(term);
+        if (!base || *base >= MemoryOperand::NO_INDEX) {
+          return error();
+        }
+        adr.base = *base;
+      } else if (auto star = term.find('*'); star != std::string_view::npos) {
+        auto index = parse_number<std::size_t>(term.substr(0, star));
+        auto scale = parse_number<std::size_t>(term.substr(star + 1));
+        if (negative || adr.index != MemoryOperand::NO_INDEX || !index || *index >= MemoryOperand::NO_INDEX ||
+            !scale || !is_memory_scale(*scale)) {
+          return error();
+        }
+        adr.index = *index;
+        adr.scale = *scale;
+      } else {
+        auto offset = parse_number<std::int64_t>(term);
+        if (!offset) {
+          return error();
+        }
+        adr.offset += negative ? -*offset : *offset;
+      }
+      if (!rest.empty()) {
+        negative = rest.front() == '-';
+        rest.remove_prefix(1);
+        if (rest.empty()) {
+          return error();
+        }
+      }
+    }
+    op = adr;
+    return true;
+  }
+
+  auto operand(Operand kind, std::string_view token, OperandValue& op, std::string_view& label) -> ResultOr<bool> {
+    switch (kind) {
+    case Operand::REG:
+    case Operand::NUM:
+    case Operand::TARGET: {
+      if (auto value = parse_number<std::size_t>(token)) {
+        // the register window also bounds the 8 bit registers of the compare instructions
+        if (kind == Operand::REG && *value >= REGISTER_COUNT) {
+          return line_error("code", "invalid register " + std::string(token));
+        }
+        op = *value;
+        return true;
+      }
+      if (kind == Operand::TARGET && is_identifier(token)) {
+        op = std::size_t{0};
+        label = token;
+        return true;
+      }
+      return line_error("code", "expected a number, not " + std::string(token));
+    }
+    case Operand::NAME:
+      if (is_identifier(token)) {
+        op = VMPrimitive(std::string(token));
+        return true;
+      }
+      break;
+    case Operand::VALUE:
+    case Operand::FIELD:
+    case Operand::FIELDS:
+    case Operand::ADDRESS:
+      break;
+    }
+    auto value = parse_value(token);
+    if (!value || (kind == Operand::NAME && !std::holds_alternative<std::string>(*value))) {
+      return line_error("code", "invalid value " + std::string(token));
+    }
+    op = *value;
+    return true;
+  }
+
+  auto finish() -> ResultOr<PbcImage> {
+    for (const auto& fixup : _fixups) {
+      auto it = _labels.find(fixup.label);
+      if (it == _labels.end()) {
+        return err("unknown label " + std::string(fixup.label) + " in line " + std::to_string(fixup.line));
+      }
+      set_jump_target(_code[fixup.pc], it->second);
+    }
+    PbcImage image;
+    for (const auto& entry : _functions) {
+      auto it = _labels.find(entry.label());
+      std::optional<std::size_t> address = it != _labels.end() ? std::optional(it->second)
+                                                                : parse_number<std::size_t>(entry.label());
+      if (!address || *address > _code.size()) {
+        return err("unknown label " + entry.label() + " of function " + entry.name());
+      }
+      image.functions.push_back({.name = entry.name(), .argument_count = entry.argument_count(), .address = *address});
+    }
+    // the source does not declare natives, their argument count is the one
+    // they are registered with when the file is loaded
+    for (const auto& native : _ctx.natives()) {
+      image.functions.push_back(
+          {.name = native, .argument_count = 0, .address = 0, .kind = PbcFunction::NATIVE});
+    }
+    for (auto value : _ctx.field_values()) {
+      image.constants.push_back(value.bits());
+    }
+    for (std::size_t i = 0; i < _ctx.heap().string_count(); ++i) {
+      image.strings.emplace_back(_ctx.heap().string(VMValue::string_handle(i)));
+    }
+    image.code = std::move(_code);
+    return image;
+  }
+
+  Tokenizer _tokens;
+  AssemblerContext _ctx;
+  bool _function_section = false;
+  std::vector<FunctionEntry> _functions;
+  std::unordered_map<std::string_view, std::size_t> _labels;
+  std::vector<Fixup> _fixups;
+  std::vector<Bytecode> _code;
+};
+
+} // namespace
+
+void Tokenizer::find_line_end() {
+  _line_end = _source.find('\n', _line_start);
+  if (_line_end == std::string_view::npos) {
+    _line_end = _source.size();
+  }
+}
+
+auto Tokenizer::next() -> std::string_view {
+  while (_pos < _line_end && (_source[_pos] == ' ' || _source[_pos] == '\t' || _source[_pos] == '\r')) {
+    ++_pos;
+  }
+  if (_pos >= _line_end || _source[_pos] == '#') {
+    _pos = _line_end;
+    return {};
+  }
+  std::size_t start = _pos;
+  if (_source[_pos] == '"') {
+    for (++_pos; _pos < _line_end && _source[_pos] != '"'; ++_pos) {
+      if (_source[_pos] == '\\') {
+        ++_pos;
+      }
+    }
+    _pos = std::min(_pos + 1, _line_end);
+  } else {
+    while (_pos < _line_end && _source[_pos] != ' ' && _source[_pos] != '\t' && _source[_pos] != '\r') {
+      ++_pos;
+    }
+  }
+  return _source.substr(start, _pos - start);
+}
+
+auto Tokenizer::next_line() -> bool {
+  if (_line_end >= _source.size()) {
+    return false;
+  }
+  _line_start = _line_end + 1;
+  _pos = _line_start;
+  _line += 1;
+  find_line_end();
+  return true;
+}
+
+auto assemble(std::string_view source) -> ResultOr<PbcImage> {
+  return Assembler(source).run();
+}
@@ -1,6 +1,8 @@
 #include "Codegeneration.h"
 #include <memory>
+#include "BinaryExpressionNode.h"
 #include "ExpressionNode.h"
+#include "OperatorNode.h"
 #include "ReturnStatementNode.h"
 #include "StatementNode.h"
 #include "StatementsNode.h"
@@ -25,7 +27,7 @@ auto TranslationUnitVisitor::visit(const std::shared_ptr<TranslationUnitNode>& n
 }
 auto TranslationUnitVisitor::end(const std::shared_ptr<TranslationUnitNode>& node) -> VisitResult {
   UNUSED(node);
-  return true;
+  return record(_func_visitor->result());
 }
 
 //-----------------------------------------------------
@@ -39,8 +41,15 @@ auto FunctionVisitor::visit(const std::shared_ptr<FunctionNode>& node) -> std::s
   return _statements_visitor;
 }
 auto FunctionVisitor::end(const std::shared_ptr<FunctionNode>& node) -> VisitResult {
-  auto fname = node->function_name();
-  _vm->add_function(fname, _statements_visitor->block(), 0);
+  auto res = record(_statements_visitor->result());
+  if (!res.ok()) {
+    // the VM owns the instructions only once the function is added
+    for (auto* instruction : _statements_visitor->block()) {
+      delete instruction;
+    }
+    return res;
+  }
+  _vm->add_function(node->function_name(), _statements_visitor->block(), 0);
   return true;
 }
 
@@ -57,17 +66,8 @@ auto StatementsVisitor::visit(const std::shared_ptr<StatementsNode>& node) -> st
 }
 auto StatementsVisitor::end(const std::shared_ptr<StatementsNode>& node) -> VisitResult {
   UNUSED(node);
-  auto local_count = _local_variables->size();
-  for (std::size_t i = 0; i < local_count; ++i) {
-    auto expression_visitor = std::make_shared<ExpressionVisitor>(_local_variables);
-    _block.push_back(new Push<VM>(_local_variables->at(i).type));
-    _local_variables->at(i).expression->accept(expression_visitor);
-    _block.insert(_block.end(), expression_visitor->code().begin(), expression_visitor->code().end());
-    _block.push_back(new Mov<VM>(i, 0));
-  }
-
   _block.insert(_block.end(), _statement_visitor->code().begin(), _statement_visitor->code().end());
-  return true;
+  return record(_statement_visitor->result());
 }
 
 //-----------------------------------------------------
@@ -83,25 +83,49 @@ auto StatementVisitor::visit(const std::shared_ptr<StatementNode>& node) -> std:
   case StatementType::VAR_DEC:
     _var_dec_visitor = std::make_shared<VariableDeclarationVisitor>(_local_variables);
     return _var_dec_visitor;
+  case StatementType::EXPRESSION:
+    _expression_visitor = std::make_shared<ExpressionVisitor>(_local_variables, ExpressionVisitor::DISCARD);
+    return _expression_visitor;
   default:
     return shared_from_this();
   }
 }
 auto StatementVisitor::end(const std::shared_ptr<StatementNode>& node) -> VisitResult {
-  if (node->statement_type() == StatementType::RETURN_STATEMENT) {
+  switch (node->statement_type()) {
+  case StatementType::RETURN_STATEMENT:
     _code.insert(_code.end(), _return_statement_visitor->code().begin(), _return_statement_visitor->code().end());
+    return record(_return_statement_visitor->result());
+  case StatementType::VAR_DEC:
+    _code.insert(_code.end(), _var_dec_visitor->code().begin(), _var_dec_visitor->code().end());
+    return record(_var_dec_visitor->result());
+  case StatementType::EXPRESSION:
+    _code.insert(_code.end(), _expression_visitor->code().begin(), _expression_visitor->code().end());
+    return record(_expression_visitor->result());
+  default:
+    break;
   }
   return true;
 }
 
 //-----------------------------------------------------
 auto VariableDeclarationVisitor::begin(const std::shared_ptr<VariableDeclarationNode>& node) -> VisitResult {
-  _local_variables->push_back({
+  LocalVariableContainer local = {
       .name = node->var_name(),
       .type = VMPrimitive(int(0)),
       .index = _local_variables->size(),
       .expression = node->expression(),
-  });
+  };
+  if (local.register_index() >= VM::REGISTER_COUNT) {
+    return record(err("Too many local variables, " + local.name + " does not fit into a register"));
+  }
+
+  auto expression_visitor = std::make_shared<ExpressionVisitor>(_local_variables, local.register_index());
+  local.expression->accept(expression_visitor);
+  _code.insert(_code.end(), expression_visitor->code().begin(), expression_visitor->code().end());
+  if (auto res = record(expression_visitor->result()); !res.ok()) {
+    return res;
+  }
+  _local_variables->push_back(local);
   return true;
 }
 auto VariableDeclarationVisitor::visit(const std::shared_ptr<VariableDeclarationNode>& node)
@@ -128,29 +152,111 @@ auto ReturnStatementVisitor::end(const std::shared_ptr<ReturnStatementNode>& nod
   UNUSED(node);
   _code.insert(_code.end(), _expression_visitor->code().begin(), _expression_visitor->code().end());
   _code.push_back(new Return<VM>(0));
-  return true;
+  return record(_expression_visitor->result());
 }
 
 //-----------------------------------------------------
 auto ExpressionVisitor::begin(const std::shared_ptr<ExpressionNode>& node) -> VisitResult {
+  return record(generate(node, _dst));
+}
+auto ExpressionVisitor::visit(const std::shared_ptr<ExpressionNode>& node) -> std::shared_ptr<Visitor> {
+  UNUSED(node);
+  // sub expressions are already emitted by generate()
+  return std::make_shared<Visitor>();
+}
+auto ExpressionVisitor::end(const std::shared_ptr<ExpressionNode>& node) -> VisitResult {
+  UNUSED(node);
+  return true;
+}
+
+auto ExpressionVisitor::generate(const std::shared_ptr<ExpressionNode>& node, std::size_t dst) -> VisitResult {
+  std::size_t target = dst == DISCARD ? 0 : dst;
   switch (node->kind()) {
   case ExpressionKind::CONST_INT:
-    _code.push_back(new CLoad<VM>(std::atoi(node->constante().c_str())));
-    break;
+    _code.push_back(new MovRI<VM>(target, std::atoi(node->constante().c_str())));
+    return true;
   case ExpressionKind::CONST_DOUBLE:
+    _code.push_back(new MovRI<VM>(target, std::atof(node->constante().c_str())));
+    return true;
   case ExpressionKind::CONST_TEXT:
-  case ExpressionKind::ARRAY_INIT:
+    _code.push_back(new MovRI<VM>(target, node->constante()));
+    return true;
   case ExpressionKind::BIN_OP:
+    return generate_binary(std::static_pointer_cast<BinaryExpressionNode>(node->expression()), dst);
+  case ExpressionKind::ARRAY_INIT:
+    break;
+  }
+  return err("Expression kind is not supported by the code generation");
+}
+
+// The grammar is right recursive (identifier op expression), so the right
+// hand side is evaluated first and combined with the identifier in one
+// three address instruction.
+auto ExpressionVisitor::generate_binary(const std::shared_ptr<BinaryExpressionNode>& node, std::size_t dst)
+    -> VisitResult {
+  auto lhs_res = local_register(node->identfier());
+  if (!lhs_res.ok()) {
+    return lhs_res.error_value();
+  }
+  std::size_t lhs = lhs_res.result();
+  if (!node->op()) {
+    if (dst != DISCARD && dst != lhs) {
+      _code.push_back(new MovRR<VM>(dst, lhs));
+    }
+    return true;
+  }
+
+  auto rhs = std::static_pointer_cast<ExpressionNode>(node->expression());
+  switch (std::static_pointer_cast<OperatorNode>(node->op())->kind()) {
+  case OperatorKind::OP_SET: {
+    auto res = generate(rhs, lhs);
+    if (!res.ok()) {
+      return res;
+    }
+    if (dst != DISCARD && dst != lhs) {
+      _code.push_back(new MovRR<VM>(dst, lhs));
+    }
+    return true;
+  }
+  case OperatorKind::OP_ADD:
     break;
+  case OperatorKind::OP_LS:
+  case OperatorKind::OP_EQ:
+    return err("Comparison is only supported in conditions");
   }
 
+  std::size_t target = dst == DISCARD ? 0 : dst;
+  if (rhs->kind() == ExpressionKind::CONST_INT) {
+    _code.push_back(new AddRRI<VM>(target, lhs, std::atoi(rhs->constante().c_str())));
+    return true;
+  }
+  if (rhs->kind() == ExpressionKind::BIN_OP) {
+    auto rhs_bin = std::static_pointer_cast<BinaryExpressionNode>(rhs->expression());
+    if (!rhs_bin->op()) {
+      auto rhs_reg = local_register(rhs_bin->identfier());
+      if (!rhs_reg.ok()) {
+        return rhs_reg.error_value();
+      }
+      _code.push_back(new AddRRR<VM>(target, lhs, rhs_reg.result()));
+      return true;
+    }
+  }
+
+  // the target can hold the intermediate value unless lhs still has to be read from it
+  std::size_t tmp = target == lhs ? 0 : target;
+  auto res = generate(rhs, tmp);
+  if (!res.ok()) {
+    return res;
+  }
+  _code.push_back(new AddRRR<VM>(target, lhs, tmp));
   return true;
 }
-auto ExpressionVisitor::visit(const std::shared_ptr<ExpressionNode>& node) -> std::shared_ptr<Visitor> {
-  UNUSED(node);
-  return shared_from_this();
-}
-auto ExpressionVisitor::end(const std::shared_ptr<ExpressionNode>& node) -> VisitResult {
-  UNUSED(node);
-  return true;
+
+auto ExpressionVisitor::local_register(const std::string& name) const -> ResultOr<std::size_t> {
+  for (const auto& local : *_local_variables) {
+    if (local.name == name) {
+      return local.register_index();
+    }
+  }
+  return err("Unknown variable " + name);
 }
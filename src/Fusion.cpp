@@ -0,0 +1,157 @@
+#include "Fusion.h"
+#include "Bytecode.h"
+#include "Instruction.h"
+#include "Util.h"
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Load i; CAdd k; Store i -> IncReg i k
+auto match_inc_reg(const Bytecode* code) -> bool {
+  return code[0].op == OpCode::LOAD && code[1].op == OpCode::CADD && code[2].op == OpCode::STORE &&
+         code[0].a == code[2].a;
+}
+auto fuse_inc_reg(const Bytecode* code) -> Bytecode {
+  return {.op = OpCode::INC_REG, .a = code[0].a, .c = code[1].c};
+}
+
+// Load i; If cond k target -> CmpImmBranch i cond k target
+auto match_cmp_imm_branch(const Bytecode* code) -> bool {
+  return code[0].op == OpCode::LOAD && code[1].op == OpCode::IF && code[0].a <= 0xFF && code[1].a <= 0xFF;
+}
+auto fuse_cmp_imm_branch(const Bytecode* code) -> Bytecode {
+  return {.op = OpCode::CMP_IMM_BRANCH, .a = compare_operand(code[1].a, code[0].a), .b = code[1].b, .c = code[1].c};
+}
+
+// CLoad k; Return 0 -> CLoadRet k
+auto match_cload_ret(const Bytecode* code) -> bool {
+  return code[0].op == OpCode::CLOAD && code[1].op == OpCode::RETURN && code[1].a == 0;
+}
+// MovRI 0 k; Return 0 -> CLoadRet k
+auto match_mov_ri_ret(const Bytecode* code) -> bool {
+  return code[0].op == OpCode::MOV_RI && code[0].a == 0 && code[1].op == OpCode::RETURN && code[1].a == 0;
+}
+auto fuse_cload_ret(const Bytecode* code) -> Bytecode {
+  return {.op = OpCode::CLOAD_RET, .c = code[0].c};
+}
+
+} // namespace
+
+// longer rules first, the first matching rule wins
+const std::vector<FusionRule> FUSION_RULES = {
+    {.name = "IncReg", .length = 3, .match = match_inc_reg, .fuse = fuse_inc_reg},
+    {.name = "CmpImmBranch", .length = 2, .match = match_cmp_imm_branch, .fuse = fuse_cmp_imm_branch},
+    {.name = "CLoadRet", .length = 2, .match = match_cload_ret, .fuse = fuse_cload_ret},
+    {.name = "CLoadRet", .length = 2, .match = match_mov_ri_ret, .fuse = fuse_cload_ret},
+};
+
+auto jump_target(const Bytecode& code) -> std::optional<std::size_t> {
+  switch (code.op) {
+  case OpCode::GOTO:
+    return code.c;
+  case OpCode::IF:
+  case OpCode::IF_INT_IMM:
+  case OpCode::CMP_BR:
+  case OpCode::CMP_BR_I:
+  case OpCode::CMP_IMM_BRANCH:
+    return code.b;
+  default:
+    return std::nullopt;
+  }
+}
+
+void set_jump_target(Bytecode& code, std::size_t target) {
+  if (code.op == OpCode::GOTO) {
+    code.c = target;
+  } else {
+    code.b = static_cast<std::uint32_t>(target);
+  }
+}
+
+void FusionProfile::save(std::ostream& out) const {
+  for (std::size_t pc = 0; pc < counts.size(); ++pc) {
+    if (counts[pc] != 0) {
+      out << pc << " " << counts[pc] << "\n";
+    }
+  }
+}
+
+auto FusionProfile::load(std::istream& in) -> ResultOr<FusionProfile> {
+  FusionProfile profile;
+  std::size_t pc = 0;
+  std::uint64_t count = 0;
+  while (in >> pc >> count) {
+    if (profile.counts.size() <= pc) {
+      profile.counts.resize(pc + 1, 0);
+    }
+    profile.counts[pc] = count;
+  }
+  if (!in.eof()) {
+    return err("malformed profile after pc " + std::to_string(pc));
+  }
+  return profile;
+}
+
+auto fuse_bytecode(const std::vector<Bytecode>& code, std::span<const std::size_t> entry_points,
+                   const FusionProfile* profile) -> FusionResult {
+  std::vector<bool> is_target(code.size() + 1, false);
+  for (const auto& record : code) {
+    if (auto target = jump_target(record); target && *target < is_target.size()) {
+      is_target[*target] = true;
+    }
+  }
+  for (auto entry : entry_points) {
+    if (entry < is_target.size()) {
+      is_target[entry] = true;
+    }
+  }
+
+  FusionResult result;
+  result.code.reserve(code.size());
+  result.pc_map.resize(code.size() + 1);
+  auto fusable = [&](std::size_t pc, const FusionRule& rule) {
+    if (pc + rule.length > code.size() || (profile && !profile->hot(pc))) {
+      return false;
+    }
+    for (std::size_t i = pc + 1; i < pc + rule.length; ++i) {
+      if (is_target[i]) {
+        return false;
+      }
+    }
+    return rule.match(&code[pc]);
+  };
+
+  std::size_t pc = 0;
+  while (pc < code.size()) {
+    std::size_t length = 1;
+    Bytecode record = code[pc];
+    for (const auto& rule : FUSION_RULES) {
+      if (fusable(pc, rule)) {
+        record = rule.fuse(&code[pc]);
+        length = rule.length;
+        result.fused += 1;
+        break;
+      }
+    }
+    for (std::size_t i = pc; i < pc + length; ++i) {
+      result.pc_map[i] = result.code.size();
+    }
+    result.code.push_back(record);
+    pc += length;
+  }
+  result.pc_map[code.size()] = result.code.size();
+
+  for (auto& record : result.code) {
+    if (auto target = jump_target(record); target && *target < result.pc_map.size()) {
+      set_jump_target(record, result.pc_map[*target]);
+    }
+  }
+  return result;
+}
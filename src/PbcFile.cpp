@@ -0,0 +1,268 @@
+#include "PbcFile.h"
+#include "Bytecode.h"
+#include "Fusion.h"
+#include "Instruction.h"
+#include "Util.h"
+#include "VMValue.h"
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr std::uint64_t CODE_ALIGNMENT = sizeof(Bytecode);
+
+auto align(std::uint64_t offset, std::uint64_t alignment) -> std::uint64_t {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <class T> void write_raw(std::ostream& out, const T* data, std::size_t count) {
+  out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(sizeof(T) * count));
+}
+
+// quickened records only exist while the VM runs
+auto is_valid_opcode(OpCode op) -> bool {
+  return static_cast<std::size_t>(op) < FIRST_QUICKENED_OPCODE && std::string_view(opcode_name(op)) != "Invalid";
+}
+
+// c of the records which hold a boxed constant
+auto has_constant(OpCode op) -> bool {
+  switch (op) {
+  case OpCode::CLOAD:
+  case OpCode::CADD:
+  case OpCode::IF:
+  case OpCode::PUSH:
+  case OpCode::ADD_RRI:
+  case OpCode::SUB_RRI:
+  case OpCode::MUL_RRI:
+  case OpCode::DIV_RRI:
+  case OpCode::MOD_RRI:
+  case OpCode::MOV_RI:
+  case OpCode::CMP_BR_I:
+  case OpCode::INC_REG:
+  case OpCode::CMP_IMM_BRANCH:
+  case OpCode::CLOAD_RET:
+  case OpCode::CADD_INT_IMM:
+  case OpCode::CADD_DOUBLE_IMM:
+  case OpCode::IF_INT_IMM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// the register operands of a record, see the lower() of its instruction
+auto register_operands(const Bytecode& code) -> std::vector<std::uint64_t> {
+  switch (code.op) {
+  case OpCode::LOAD:
+  case OpCode::INDLOAD:
+  case OpCode::SLOAD:
+  case OpCode::STORE:
+  case OpCode::INDSTORE:
+  case OpCode::ADD:
+  case OpCode::INDADD:
+  case OpCode::PRINT_REG_STRUCT_FIELD:
+  case OpCode::CALL_R:
+  case OpCode::RETURN:
+  case OpCode::STRUCT_CREATE:
+  case OpCode::SET_FIELD:
+  case OpCode::ALLOCATE:
+  case OpCode::DEALLOCATE:
+  case OpCode::WRITE_MEM:
+  case OpCode::READ_MEM:
+  case OpCode::MOV:
+  case OpCode::MOV_RI:
+  case OpCode::INC_REG:
+  case OpCode::ADD_INT_INT:
+  case OpCode::ADD_DOUBLE_DOUBLE:
+  case OpCode::INDADD_INT_INT:
+    return {code.a};
+  case OpCode::GET_FIELD:
+  case OpCode::MOV_RR:
+  case OpCode::ADD_RRI:
+  case OpCode::SUB_RRI:
+  case OpCode::MUL_RRI:
+  case OpCode::DIV_RRI:
+  case OpCode::MOD_RRI:
+    return {code.a, code.b};
+  case OpCode::MEM_COPY:
+  case OpCode::MEM_SET:
+  case OpCode::ADD_RRR:
+  case OpCode::SUB_RRR:
+  case OpCode::MUL_RRR:
+  case OpCode::DIV_RRR:
+  case OpCode::MOD_RRR:
+    return {code.a, code.b, code.c};
+  case OpCode::MEM_CMP:
+    return {code.a, code.b & 0xFFFF, code.b >> 16, code.c};
+  case OpCode::CMP_BR:
+    return {code.a & 0xFFU, code.c};
+  case OpCode::CMP_BR_I:
+  case OpCode::CMP_IMM_BRANCH:
+    return {code.a & 0xFFU};
+  case OpCode::LOAD_MEM:
+  case OpCode::STORE_MEM:
+    if (memory_index(code) == MemoryOperand::NO_INDEX) {
+      return {code.a, memory_base(code)};
+    }
+    return {code.a, memory_base(code), memory_index(code)};
+  default:
+    return {};
+  }
+}
+
+} // namespace
+
+auto write_pbc(std::ostream& out, const PbcImage& image) -> ResultOr<bool> {
+  PbcHeader header;
+  header.function_count = static_cast<std::uint32_t>(image.functions.size());
+  header.constant_count = static_cast<std::uint32_t>(image.constants.size());
+  header.string_count = static_cast<std::uint32_t>(image.strings.size());
+  header.code_count = static_cast<std::uint32_t>(image.code.size());
+  header.function_offset = sizeof(PbcHeader);
+  header.constant_offset = header.function_offset + (sizeof(PbcFunction) * image.functions.size());
+  header.string_offset = header.constant_offset + (sizeof(std::uint64_t) * image.constants.size());
+
+  // the string bytes hold the heap strings followed by the function names
+  std::uint64_t bytes_offset = header.string_offset + (sizeof(PbcString) * image.strings.size());
+  std::string bytes;
+  std::vector<PbcString> strings;
+  for (const auto& str : image.strings) {
+    strings.push_back({.offset = bytes_offset + bytes.size(), .length = str.size()});
+    bytes += str;
+  }
+  std::vector<PbcFunction> functions;
+  for (const auto& function : image.functions) {
+    if (function.address > image.code.size()) {
+      return err("function " + function.name + " starts behind the code section");
+    }
+    functions.push_back({.name = {.offset = bytes_offset + bytes.size(), .length = function.name.size()},
+                         .address = static_cast<std::uint32_t>(function.address),
+                         .argument_count = function.argument_count,
+                         .kind = function.kind});
+    bytes += function.name;
+  }
+  header.code_offset = align(bytes_offset + bytes.size(), CODE_ALIGNMENT);
+  bytes.resize(header.code_offset - bytes_offset, '\0');
+  header.file_size = header.code_offset + (sizeof(Bytecode) * image.code.size());
+
+  write_raw(out, &header, 1);
+  write_raw(out, functions.data(), functions.size());
+  write_raw(out, image.constants.data(), image.constants.size());
+  write_raw(out, strings.data(), strings.size());
+  write_raw(out, bytes.data(), bytes.size());
+  write_raw(out, image.code.data(), image.code.size());
+  if (!out) {
+    return err("unable to write pbc file");
+  }
+  return true;
+}
+
+auto PbcFile::open(const std::string& path) -> ResultOr<PbcFile> {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return err("unable to open " + path);
+  }
+  struct stat info {};
+  if (fstat(fd, &info) != 0 || std::cmp_less(info.st_size, sizeof(PbcHeader))) {
+    ::close(fd);
+    return err(path + " is not a pbc file");
+  }
+  auto size = static_cast<std::size_t>(info.st_size);
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return err("unable to map " + path);
+  }
+  PbcFile file(std::shared_ptr<const std::byte>(static_cast<const std::byte*>(data),
+                                                [size](const std::byte* ptr) {
+                                                  munmap(const_cast<std::byte*>(ptr), size);
+                                                }),
+               size);
+  auto res = file.validate();
+  if (!res) {
+    return err(path + ": " + res.error_value().msg());
+  }
+  return file;
+}
+
+auto PbcFile::validate() const -> ResultOr<bool> {
+  const auto& h = header();
+  if (h.magic != PbcHeader::MAGIC) {
+    return err("not a pbc file");
+  }
+  if (h.byte_order != PbcHeader::BYTE_ORDER_MARK) {
+    return err("written with a different byte order");
+  }
+  if (h.version != PbcHeader::VERSION) {
+    return err("unsupported pbc version " + std::to_string(h.version));
+  }
+  auto fits = [&](std::uint64_t offset, std::uint64_t count, std::uint64_t size) {
+    return offset <= _size && count <= (_size - offset) / size;
+  };
+  if (h.file_size != _size || !fits(h.function_offset, h.function_count, sizeof(PbcFunction)) ||
+      !fits(h.constant_offset, h.constant_count, sizeof(std::uint64_t)) ||
+      !fits(h.string_offset, h.string_count, sizeof(PbcString)) ||
+      !fits(h.code_offset, h.code_count, sizeof(Bytecode)) || h.function_offset % alignof(PbcFunction) != 0 ||
+      h.constant_offset % alignof(std::uint64_t) != 0 || h.string_offset % alignof(PbcString) != 0 ||
+      h.code_offset % alignof(Bytecode) != 0) {
+    return err("truncated or corrupt sections");
+  }
+  for (const auto& str : strings()) {
+    if (!fits(str.offset, str.length, 1)) {
+      return err("string out of bounds");
+    }
+  }
+  // the functions precede the natives
+  std::size_t function_count = 0;
+  std::size_t native_count = 0;
+  bool natives = false;
+  for (const auto& function : functions()) {
+    natives = natives || function.kind == PbcFunction::NATIVE;
+    if (!fits(function.name.offset, function.name.length, 1) || function.address > h.code_count ||
+        function.kind > PbcFunction::NATIVE || (natives && function.kind == PbcFunction::FUNCTION)) {
+      return err("corrupt function table");
+    }
+    function_count += natives ? 0 : 1;
+    native_count += natives ? 1 : 0;
+  }
+  for (const auto& record : code()) {
+    if (!is_valid_opcode(record.op)) {
+      return err("invalid opcode " + std::to_string(static_cast<std::size_t>(record.op)));
+    }
+    if ((record.op == OpCode::CALL || record.op == OpCode::CALL_R) && record.c >= function_count) {
+      return err("call of unknown function " + std::to_string(record.c));
+    }
+    if (record.op == OpCode::CALL_NATIVE && record.c >= native_count) {
+      return err("call of unknown native function " + std::to_string(record.c));
+    }
+    for (auto reg : register_operands(record)) {
+      if (reg >= REGISTER_COUNT) {
+        return err(std::string(opcode_name(record.op)) + " of unknown register " + std::to_string(reg));
+      }
+    }
+    if ((record.op == OpCode::LOAD_MEM || record.op == OpCode::STORE_MEM) &&
+        (memory_shift(record) > 3 || memory_size(memory_kind(record)) == 0)) {
+      return err(std::string(opcode_name(record.op)) + " with an invalid memory operand");
+    }
+    if (has_constant(record.op)) {
+      auto value = VMValue::from_bits(record.c);
+      if ((value.is_string() && value.handle() >= h.string_count) || value.is_struct()) {
+        return err(std::string(opcode_name(record.op)) + " with an invalid constant");
+      }
+    }
+    if (auto target = jump_target(record); target && *target >= h.code_count) {
+      return err("jump target " + std::to_string(*target) + " out of bounds");
+    }
+  }
+  return true;
+}
@@ -0,0 +1,55 @@
+#include "VMArithmetic.h"
+#include "Util.h"
+#include "VMType.h"
+#include "VMValue.h"
+#include <cstddef>
+#include <variant>
+
+auto arithmetic_slow(ArithmeticOp op, VMValue lhs, VMValue rhs, VMHeap& heap) -> ResultOr<VMValue> {
+  VMType l = heap.unbox(lhs);
+  VMType r = heap.unbox(rhs);
+  auto res = [&]() -> ResultOr<VMType> {
+    switch (op) {
+    case ArithmeticOp::ADD:
+      return ::add(l, r);
+    case ArithmeticOp::SUB:
+      return ::sub(l, r);
+    case ArithmeticOp::MULT:
+      return ::mult(l, r);
+    case ArithmeticOp::DIV:
+      return ::div(l, r);
+    case ArithmeticOp::MOD:
+      return ::mod(l, r);
+    }
+    return err("Unknown arithmetic operation");
+  }();
+  if (!res.ok()) {
+    return res.error_value();
+  }
+  return heap.box(res.result());
+}
+
+auto compare_slow(VMValue lhs, VMValue rhs, std::size_t cond, const VMHeap& heap) -> bool {
+  VMType l = heap.unbox(lhs);
+  VMType r = heap.unbox(rhs);
+  if (!std::holds_alternative<VMPrimitive>(l) || !std::holds_alternative<VMPrimitive>(r)) {
+    return false;
+  }
+  const auto& lv = std::get<VMPrimitive>(l);
+  const auto& rv = std::get<VMPrimitive>(r);
+  switch (cond) {
+  case 0:
+    return lv < rv;
+  case 1:
+    return lv > rv;
+  case 2:
+    return lv == rv;
+  case 3:
+    return lv != rv;
+  case 4:
+    return lv <= rv;
+  case 5:
+    return lv >= rv;
+  }
+  return false;
+}
@@ -0,0 +1,52 @@
+#include "VMGuard.h"
+#include <csetjmp>
+#include <csignal>
+
+namespace {
+
+struct GuardScope {
+  sigjmp_buf jump;
+  bool (*is_guard)(void* context, const void* adr);
+  void* context;
+};
+
+thread_local GuardScope* active_scope = nullptr;
+struct sigaction previous_action {};
+bool installed = false;
+
+void on_segv([[maybe_unused]] int signal, siginfo_t* info, [[maybe_unused]] void* ucontext) {
+  if (active_scope != nullptr && active_scope->is_guard(active_scope->context, info->si_addr)) {
+    siglongjmp(active_scope->jump, 1);
+  }
+  // not ours, the faulting instruction runs again under the previous handler
+  sigaction(SIGSEGV, &previous_action, nullptr);
+  installed = false;
+}
+
+void install() {
+  if (installed) {
+    return;
+  }
+  struct sigaction action {};
+  action.sa_sigaction = on_segv;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previous_action);
+  installed = true;
+}
+
+} // namespace
+
+auto guarded(void (*body)(void* context), bool (*is_guard)(void* context, const void* adr), void* context) -> bool {
+  install();
+  GuardScope scope{.jump = {}, .is_guard = is_guard, .context = context};
+  GuardScope* outer = active_scope;
+  if (sigsetjmp(scope.jump, 1) != 0) {
+    active_scope = outer;
+    return false;
+  }
+  active_scope = &scope;
+  body(context);
+  active_scope = outer;
+  return true;
+}
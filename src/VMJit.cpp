@@ -0,0 +1,808 @@
+#include "VMJit.h"
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <utility>
+
+#if PALLADIUM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+JitCode::JitCode(std::span<const std::uint8_t> code, std::size_t first, std::vector<std::uint32_t> offsets)
+    : _first(first), _offsets(std::move(offsets)) {
+#if PALLADIUM_JIT
+  auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::size_t size = (code.size() + page - 1) / page * page;
+  void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (region == MAP_FAILED) {
+    return;
+  }
+  std::memcpy(region, code.data(), code.size());
+  // never writable and executable at the same time
+  if (mprotect(region, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(region, size);
+    return;
+  }
+  _code = static_cast<std::uint8_t*>(region);
+  _size = size;
+#else
+  static_cast<void>(code);
+#endif
+}
+
+JitCode::JitCode(JitCode&& other) noexcept
+    : _code(std::exchange(other._code, nullptr)), _size(std::exchange(other._size, 0)), _first(other._first),
+      _offsets(std::move(other._offsets)), _deopts(other._deopts) {
+}
+
+auto JitCode::operator=(JitCode&& other) noexcept -> JitCode& {
+  std::swap(_code, other._code);
+  std::swap(_size, other._size);
+  std::swap(_first, other._first);
+  std::swap(_offsets, other._offsets);
+  std::swap(_deopts, other._deopts);
+  return *this;
+}
+
+JitCode::~JitCode() {
+#if PALLADIUM_JIT
+  if (_code != nullptr) {
+    munmap(_code, _size);
+  }
+#endif
+}
+
+namespace {
+
+enum class IntOp { ADD, SUB, MUL };
+
+constexpr std::size_t NO_REGISTER = static_cast<std::size_t>(-1);
+// number of compare conditions, 0 is <, 1 is >, 2 is ==, 3 is !=, 4 is <=, 5 is >=
+constexpr std::size_t CONDITION_COUNT = 6;
+
+// Register form of the records both compilers handle. A constant operand
+// replaces lhs of a MOVE and rhs of an ARITHMETIC or BRANCH.
+struct Operation {
+  enum Kind { MOVE, ARITHMETIC, BRANCH, JUMP };
+
+  Kind kind;
+  IntOp op = IntOp::ADD;
+  // ARITHMETIC writes dst and dst2, a BRANCH copies lhs into dst first unless it is NO_REGISTER
+  std::size_t dst = NO_REGISTER;
+  std::size_t dst2 = NO_REGISTER;
+  std::size_t lhs = NO_REGISTER;
+  std::size_t rhs = NO_REGISTER;
+  std::uint64_t constant = 0;
+  std::size_t cond = 0;
+  std::size_t target = 0;
+
+  auto value() const -> std::int32_t {
+    return VMValue::from_bits(constant).as_int();
+  }
+};
+
+auto is_int(std::uint64_t bits) -> bool {
+  return VMValue::from_bits(bits).is_int();
+}
+
+auto move(std::size_t dst, std::size_t src) -> Operation {
+  return {.kind = Operation::MOVE, .dst = dst, .lhs = src};
+}
+auto move_constant(std::size_t dst, std::uint64_t bits) -> Operation {
+  return {.kind = Operation::MOVE, .dst = dst, .constant = bits};
+}
+auto arithmetic(IntOp op, std::size_t dst, std::size_t lhs, std::size_t rhs) -> Operation {
+  return {.kind = Operation::ARITHMETIC, .op = op, .dst = dst, .dst2 = dst, .lhs = lhs, .rhs = rhs};
+}
+auto arithmetic_constant(IntOp op, std::size_t dst, std::size_t lhs, std::uint64_t bits) -> Operation {
+  return {.kind = Operation::ARITHMETIC, .op = op, .dst = dst, .dst2 = dst, .lhs = lhs, .constant = bits};
+}
+auto branch(std::size_t cond, std::size_t lhs, std::size_t rhs, std::size_t target) -> Operation {
+  return {.kind = Operation::BRANCH, .lhs = lhs, .rhs = rhs, .cond = cond, .target = target};
+}
+auto branch_constant(std::size_t cond, std::size_t lhs, std::uint64_t bits, std::size_t target) -> Operation {
+  return {.kind = Operation::BRANCH, .lhs = lhs, .constant = bits, .cond = cond, .target = target};
+}
+
+auto decode_record(const Bytecode& code) -> std::optional<Operation> {
+  std::size_t lhs = code.a & 0xFF;
+  std::size_t cond = code.a >> 8;
+  switch (code.op) {
+  case OpCode::LOAD:
+    return move(0, code.a);
+  case OpCode::STORE:
+    return move(code.a, 0);
+  case OpCode::MOV_RR:
+    return move(code.a, code.b);
+  case OpCode::CLOAD:
+    return move_constant(0, code.c);
+  case OpCode::MOV_RI:
+    return move_constant(code.a, code.c);
+  case OpCode::ADD:
+  case OpCode::ADD_INT_INT:
+    return arithmetic(IntOp::ADD, 0, 0, code.a);
+  case OpCode::CADD:
+  case OpCode::CADD_INT_IMM:
+    return arithmetic_constant(IntOp::ADD, 0, 0, code.c);
+  case OpCode::ADD_RRR:
+    return arithmetic(IntOp::ADD, code.a, code.b, code.c);
+  case OpCode::SUB_RRR:
+    return arithmetic(IntOp::SUB, code.a, code.b, code.c);
+  case OpCode::MUL_RRR:
+    return arithmetic(IntOp::MUL, code.a, code.b, code.c);
+  case OpCode::ADD_RRI:
+    return arithmetic_constant(IntOp::ADD, code.a, code.b, code.c);
+  case OpCode::SUB_RRI:
+    return arithmetic_constant(IntOp::SUB, code.a, code.b, code.c);
+  case OpCode::MUL_RRI:
+    return arithmetic_constant(IntOp::MUL, code.a, code.b, code.c);
+  case OpCode::INC_REG: {
+    auto op = arithmetic_constant(IntOp::ADD, code.a, code.a, code.c);
+    op.dst2 = 0;
+    return op;
+  }
+  case OpCode::IF:
+  case OpCode::IF_INT_IMM:
+    return branch_constant(code.a, 0, code.c, code.b);
+  case OpCode::CMP_BR:
+    return branch(cond, lhs, code.c, code.b);
+  case OpCode::CMP_BR_I:
+    return branch_constant(cond, lhs, code.c, code.b);
+  case OpCode::CMP_IMM_BRANCH: {
+    auto op = branch_constant(cond, lhs, code.c, code.b);
+    op.dst = 0;
+    return op;
+  }
+  case OpCode::GOTO:
+    return Operation{.kind = Operation::JUMP, .target = code.c};
+  default:
+    return std::nullopt;
+  }
+}
+
+// the record as an Operation if all registers are below register_count and
+// arithmetic and compares have int constants
+auto decode(const Bytecode& code, std::size_t register_count) -> std::optional<Operation> {
+  auto op = decode_record(code);
+  if (!op) {
+    return std::nullopt;
+  }
+  for (auto r : {op->dst, op->dst2, op->lhs, op->rhs}) {
+    if (r != NO_REGISTER && r >= register_count) {
+      return std::nullopt;
+    }
+  }
+  if (op->kind == Operation::BRANCH && op->cond >= CONDITION_COUNT) {
+    return std::nullopt;
+  }
+  if ((op->kind == Operation::ARITHMETIC || op->kind == Operation::BRANCH) && op->rhs == NO_REGISTER &&
+      !is_int(op->constant)) {
+    return std::nullopt;
+  }
+  return op;
+}
+
+#if PALLADIUM_JIT
+
+// records which leave the compiled function, the interpreter enters it again
+auto is_exit(OpCode op) -> bool {
+  switch (op) {
+  case OpCode::HALT:
+  case OpCode::CALL:
+  case OpCode::CALL_R:
+  case OpCode::RETURN:
+  case OpCode::RET_VOID:
+  case OpCode::CLOAD_RET:
+    return true;
+  default:
+    return false;
+  }
+}
+
+enum Reg : std::uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R10 = 10,
+  R11 = 11,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14
+};
+
+constexpr std::uint64_t INT_PREFIX = std::uint64_t{VMValue::INT_TAG} << 48;
+// jcc condition codes of the compare conditions, flipping bit 0 negates one
+constexpr std::array<std::uint8_t, CONDITION_COUNT> CONDITION_CODES = {0xC, 0xF, 0x4, 0x5, 0xE, 0xD};
+
+// x86-64 encoder of the few instructions the templates need. Values are
+// 32 bit ints unless the name says otherwise, memory operands are [base + disp32].
+class MachineCode {
+protected:
+  void emit(std::initializer_list<std::uint8_t> bytes) {
+    _bytes.insert(_bytes.end(), bytes);
+  }
+  void imm32(std::uint32_t value) {
+    for (std::size_t i = 0; i < 4; ++i) {
+      _bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+  }
+  void imm64(std::uint64_t value) {
+    imm32(static_cast<std::uint32_t>(value));
+    imm32(static_cast<std::uint32_t>(value >> 32));
+  }
+  auto position() const -> std::size_t {
+    return _bytes.size();
+  }
+
+  void rex(bool wide, unsigned reg, unsigned rm) {
+    auto prefix = static_cast<std::uint8_t>(0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+    if (prefix != 0x40) {
+      emit({prefix});
+    }
+  }
+  void modrm(unsigned mod, unsigned reg, unsigned rm) {
+    emit({static_cast<std::uint8_t>((mod << 6) | ((reg & 7) << 3) | (rm & 7))});
+  }
+  // opcode r/m, reg
+  void op_rr(std::uint8_t opcode, bool wide, unsigned reg, unsigned rm) {
+    rex(wide, reg, rm);
+    emit({opcode});
+    modrm(3, reg, rm);
+  }
+  // 64 bit r = [base + disp], base is neither rsp nor r12
+  void load64(unsigned r, unsigned base, std::size_t disp) {
+    rex(true, r, base);
+    emit({0x8B});
+    modrm(2, r, base);
+    imm32(static_cast<std::uint32_t>(disp));
+  }
+  void store64(unsigned base, std::size_t disp, unsigned r) {
+    rex(true, r, base);
+    emit({0x89});
+    modrm(2, r, base);
+    imm32(static_cast<std::uint32_t>(disp));
+  }
+  void mov(unsigned dst, unsigned src) {
+    op_rr(0x89, false, src, dst);
+  }
+  void mov64(unsigned dst, unsigned src) {
+    op_rr(0x89, true, src, dst);
+  }
+  void mov_imm(unsigned r, std::int32_t value) {
+    rex(false, 0, r);
+    emit({static_cast<std::uint8_t>(0xB8 + (r & 7))});
+    imm32(static_cast<std::uint32_t>(value));
+  }
+  void mov_imm64(unsigned r, std::uint64_t value) {
+    rex(true, 0, r);
+    emit({static_cast<std::uint8_t>(0xB8 + (r & 7))});
+    imm64(value);
+  }
+  // dst = dst op src
+  void alu(IntOp op, unsigned dst, unsigned src) {
+    switch (op) {
+    case IntOp::ADD:
+      op_rr(0x01, false, src, dst);
+      break;
+    case IntOp::SUB:
+      op_rr(0x29, false, src, dst);
+      break;
+    case IntOp::MUL:
+      rex(false, dst, src);
+      emit({0x0F, 0xAF});
+      modrm(3, dst, src);
+      break;
+    }
+  }
+  void alu_imm(IntOp op, unsigned dst, std::int32_t value) {
+    switch (op) {
+    case IntOp::ADD:
+      imm_group(0, dst, value);
+      break;
+    case IntOp::SUB:
+      imm_group(5, dst, value);
+      break;
+    case IntOp::MUL:
+      rex(false, dst, dst);
+      emit({0x69});
+      modrm(3, dst, dst);
+      imm32(static_cast<std::uint32_t>(value));
+      break;
+    }
+  }
+  // flags of lhs - rhs
+  void cmp(unsigned lhs, unsigned rhs) {
+    op_rr(0x39, false, rhs, lhs);
+  }
+  void cmp_imm(unsigned lhs, std::int32_t value) {
+    imm_group(7, lhs, value);
+  }
+  // jumps with a rel32 which is patched later, returns its position
+  auto jcc(std::uint8_t condition) -> std::size_t {
+    emit({0x0F, static_cast<std::uint8_t>(0x80 | condition)});
+    imm32(0);
+    return position() - 4;
+  }
+  auto jmp() -> std::size_t {
+    emit({0xE9});
+    imm32(0);
+    return position() - 4;
+  }
+  // the displacement at `at` is relative to the end of the instruction
+  void patch(std::size_t at, std::size_t target) {
+    auto rel = static_cast<std::uint32_t>(static_cast<std::int64_t>(target) - static_cast<std::int64_t>(at + 4));
+    std::memcpy(_bytes.data() + at, &rel, sizeof(rel));
+  }
+
+  // zero if value holds an int: rax = value >> 48, cmp eax, INT_TAG
+  void check_int_tag(unsigned value) {
+    if (value != RAX) {
+      mov64(RAX, value);
+    }
+    emit({0x48, 0xC1, 0xE8, 0x30}); // shr rax, 48
+    emit({0x3D});                   // cmp eax, imm32
+    imm32(VMValue::INT_TAG);
+  }
+
+  auto finish(std::size_t first, std::vector<std::uint32_t> offsets) -> std::optional<JitCode> {
+    JitCode jit(_bytes, first, std::move(offsets));
+    if (!jit.valid()) {
+      return std::nullopt;
+    }
+    return jit;
+  }
+
+  std::vector<std::uint8_t> _bytes;
+
+private:
+  void imm_group(unsigned ext, unsigned r, std::int32_t value) {
+    rex(false, 0, r);
+    emit({0x81});
+    modrm(3, ext, r);
+    imm32(static_cast<std::uint32_t>(value));
+  }
+};
+
+// Baseline compiler, rbx holds the register window and r12 the VM while the
+// function runs, rax, rcx and rdx are scratch registers
+class FunctionCompiler : MachineCode {
+public:
+  FunctionCompiler(std::span<const Bytecode> code, std::size_t first, std::size_t last, std::size_t register_count,
+                   JitStep step, JitSafepoint safepoint)
+      : _code(code), _first(first), _last(last), _register_count(register_count), _step(step), _safepoint(safepoint) {
+  }
+
+  auto compile() -> std::optional<JitCode> {
+    // push rbx; push r12; push rbp keeps the stack 16 byte aligned for the step calls
+    emit({0x53, 0x41, 0x54, 0x55});
+    mov64(RBX, RDI);
+    mov64(R12, RSI);
+    emit({0xFF, 0xE2}); // jmp rdx
+    _epilogue = position();
+    emit({0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop rbp; pop r12; pop rbx; ret
+
+    std::vector<std::uint32_t> offsets;
+    std::size_t inlined = 0;
+    for (std::size_t pc = _first; pc < _last; ++pc) {
+      offsets.push_back(static_cast<std::uint32_t>(position()));
+      const Bytecode& code = _code[pc];
+      if (is_exit(code.op)) {
+        exit_to(jmp(), pc);
+      } else if (auto op = decode(code, _register_count)) {
+        compile_operation(*op, pc);
+        inlined += 1;
+      } else {
+        call_step(pc);
+        _last_step = pc;
+      }
+    }
+    exit_to(jmp(), _last);
+    // only exits and interpreter steps, entering the code would just add to the call
+    if (inlined == 0) {
+      return std::nullopt;
+    }
+
+    for (auto [at, pc] : _label_fixups) {
+      patch(at, offsets[pc - _first]);
+    }
+    std::map<std::uint64_t, std::size_t> blocks;
+    for (auto [at, value] : _exit_fixups) {
+      auto [it, added] = blocks.try_emplace(value, position());
+      if (added) {
+        mov_imm64(RAX, value);
+        patch(jmp(), _epilogue);
+      }
+      patch(at, it->second);
+    }
+    return finish(_first, std::move(offsets));
+  }
+
+private:
+  void compile_operation(const Operation& op, std::size_t pc) {
+    switch (op.kind) {
+    case Operation::MOVE:
+      if (op.lhs == NO_REGISTER) {
+        mov_imm64(RAX, op.constant);
+      } else {
+        load(RAX, op.lhs);
+      }
+      store(op.dst, RAX);
+      break;
+    case Operation::ARITHMETIC:
+      load_int(RAX, op.lhs, pc);
+      if (op.rhs == NO_REGISTER) {
+        alu_imm(op.op, RAX, op.value());
+      } else {
+        load_int(RCX, op.rhs, pc);
+        alu(op.op, RAX, RCX);
+      }
+      // box eax as int
+      mov(RAX, RAX);
+      mov_imm64(RDX, INT_PREFIX);
+      op_rr(0x09, true, RDX, RAX); // or rax, rdx
+      store(op.dst, RAX);
+      if (op.dst2 != op.dst) {
+        store(op.dst2, RAX);
+      }
+      break;
+    case Operation::BRANCH:
+      load_int(RAX, op.lhs, pc);
+      if (op.dst != NO_REGISTER) {
+        store(op.dst, RAX);
+      }
+      if (op.rhs == NO_REGISTER) {
+        cmp_imm(RAX, op.value());
+      } else {
+        load_int(RCX, op.rhs, pc);
+        cmp(RAX, RCX);
+      }
+      if (needs_safepoint(pc, op.target)) {
+        std::size_t skip = jcc(CONDITION_CODES[op.cond] ^ 1);
+        call_safepoint();
+        jump_to(jmp(), op.target);
+        patch(skip, position());
+      } else {
+        jump_to(jcc(CONDITION_CODES[op.cond]), op.target);
+      }
+      break;
+    case Operation::JUMP:
+      if (needs_safepoint(pc, op.target)) {
+        call_safepoint();
+      }
+      jump_to(jmp(), op.target);
+      break;
+    }
+  }
+
+  // only steps allocate, a loop of inline records never reaches a collection
+  auto needs_safepoint(std::size_t pc, std::size_t target) const -> bool {
+    return target <= pc && target >= _first && _last_step != NO_STEP && _last_step >= target;
+  }
+  void call_safepoint() {
+    mov64(RDI, R12);
+    mov_imm64(RAX, reinterpret_cast<std::uint64_t>(_safepoint));
+    emit({0xFF, 0xD0}); // call rax
+  }
+
+  // r = c(i), any other tag than int leaves the function and the interpreter executes pc
+  void load_int(Reg r, std::size_t i, std::size_t pc) {
+    load(r, i);
+    mov64(RDX, r);
+    emit({0x48, 0xC1, 0xEA, 0x30}); // shr rdx, 48
+    emit({0x81, 0xFA});             // cmp edx, imm32
+    imm32(VMValue::INT_TAG);
+    exit_to(jcc(0x5), pc | JIT_DEOPT);
+  }
+  void load(Reg r, std::size_t i) {
+    load64(r, RBX, i * sizeof(VMValue));
+  }
+  void store(std::size_t i, Reg r) {
+    store64(RBX, i * sizeof(VMValue), r);
+  }
+
+  void call_step(std::size_t pc) {
+    mov64(RDI, R12);
+    mov_imm64(RSI, pc);
+    mov_imm64(RAX, reinterpret_cast<std::uint64_t>(_step));
+    emit({0xFF, 0xD0});             // call rax
+    emit({0x48, 0x83, 0xF8, 0xFF}); // cmp rax, JIT_CONTINUE
+    patch(jcc(0x5), _epilogue);
+  }
+
+  // jumps inside the function go to the code of the target, all others leave it
+  void jump_to(std::size_t at, std::size_t target) {
+    if (target >= _first && target < _last) {
+      _label_fixups.emplace_back(at, target);
+    } else {
+      exit_to(at, target);
+    }
+  }
+  void exit_to(std::size_t at, std::uint64_t value) {
+    _exit_fixups.emplace_back(at, value);
+  }
+
+  std::span<const Bytecode> _code;
+  std::size_t _first;
+  std::size_t _last;
+  std::size_t _register_count;
+  JitStep _step;
+  JitSafepoint _safepoint;
+  static constexpr std::size_t NO_STEP = static_cast<std::size_t>(-1);
+  // pc of the last record compiled into a step call
+  std::size_t _last_step = NO_STEP;
+  std::size_t _epilogue = 0;
+  std::vector<std::pair<std::size_t, std::size_t>> _label_fixups;
+  std::vector<std::pair<std::size_t, std::uint64_t>> _exit_fixups;
+};
+
+// Trace compiler, rdi holds the register window, r14 the int box prefix and
+// every VM register of the trace one of HOST_REGISTERS. rax is the scratch
+// register.
+class TraceCompiler : MachineCode {
+public:
+  static constexpr std::array<Reg, 10> HOST_REGISTERS = {RCX, RDX, RSI, R8, R9, R10, R11, RBX, R12, R13};
+
+  TraceCompiler(std::span<const TraceRecord> trace, std::size_t register_count)
+      : _trace(trace), _host(register_count, NO_HOST), _known(register_count), _written(register_count, false) {
+  }
+
+  auto compile() -> std::optional<JitCode> {
+    std::vector<Operation> ops;
+    for (const auto& record : _trace) {
+      auto op = decode(record.code, _host.size());
+      if (!op || (op->kind == Operation::MOVE && op->lhs == NO_REGISTER && !is_int(op->constant))) {
+        return std::nullopt;
+      }
+      ops.push_back(*op);
+      if (!allocate(*op)) {
+        return std::nullopt;
+      }
+    }
+    std::size_t header = _trace.front().pc;
+
+    emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx; push r12; push r13; push r14
+    mov_imm64(R14, INT_PREFIX);
+    // the guards of all iterations, hoisted in front of the loop
+    std::vector<std::size_t> entry_checks;
+    for (std::size_t r = 0; r < _host.size(); ++r) {
+      if (_host[r] != NO_HOST) {
+        load64(RAX, RDI, r * sizeof(VMValue));
+        mov64(_host[r], RAX);
+        check_int_tag(RAX);
+        entry_checks.push_back(jcc(0x5));
+      }
+    }
+
+    std::size_t loop = position();
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+      compile_operation(ops[i], _trace[i]);
+    }
+    patch(jmp(), loop);
+
+    std::size_t epilogue = position();
+    emit({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r14; pop r13; pop r12; pop rbx; ret
+    std::size_t entry_failed = position();
+    mov_imm64(RAX, header | JIT_DEOPT);
+    patch(jmp(), epilogue);
+    for (auto at : entry_checks) {
+      patch(at, entry_failed);
+    }
+    // side exits box the registers the trace writes back into the window
+    std::map<std::size_t, std::size_t> blocks;
+    for (auto [at, pc] : _side_exits) {
+      auto [it, added] = blocks.try_emplace(pc, position());
+      if (added) {
+        for (std::size_t r = 0; r < _host.size(); ++r) {
+          if (_written[r]) {
+            mov(RAX, _host[r]);
+            op_rr(0x09, true, R14, RAX); // or rax, r14
+            store64(RDI, r * sizeof(VMValue), RAX);
+          }
+        }
+        mov_imm64(RAX, pc);
+        patch(jmp(), epilogue);
+      }
+      patch(at, it->second);
+    }
+    return finish(header, {0});
+  }
+
+private:
+  static constexpr Reg NO_HOST = RAX;
+
+  auto allocate(const Operation& op) -> bool {
+    for (auto r : {op.dst, op.dst2, op.lhs, op.rhs}) {
+      if (r == NO_REGISTER || _host[r] != NO_HOST) {
+        continue;
+      }
+      if (_allocated == HOST_REGISTERS.size()) {
+        return false;
+      }
+      _host[r] = HOST_REGISTERS[_allocated++];
+    }
+    for (auto r : {op.dst, op.dst2}) {
+      if (r != NO_REGISTER) {
+        _written[r] = true;
+      }
+    }
+    return true;
+  }
+
+  void compile_operation(const Operation& op, const TraceRecord& record) {
+    switch (op.kind) {
+    case Operation::MOVE:
+      if (op.lhs == NO_REGISTER) {
+        set_constant(op.dst, op.value());
+      } else {
+        copy(op.dst, op.lhs);
+      }
+      break;
+    case Operation::ARITHMETIC: {
+      auto lhs = _known[op.lhs];
+      auto rhs = op.rhs == NO_REGISTER ? std::optional(op.value()) : _known[op.rhs];
+      if (lhs && rhs) {
+        set_constant(op.dst, fold(op.op, *lhs, *rhs));
+        set_constant(op.dst2, fold(op.op, *lhs, *rhs));
+        break;
+      }
+      if (lhs) {
+        mov_imm(RAX, *lhs);
+      } else {
+        mov(RAX, _host[op.lhs]);
+      }
+      if (rhs) {
+        alu_imm(op.op, RAX, *rhs);
+      } else {
+        alu(op.op, RAX, _host[op.rhs]);
+      }
+      for (auto dst : {op.dst, op.dst2}) {
+        mov(_host[dst], RAX);
+        _known[dst].reset();
+      }
+      break;
+    }
+    case Operation::BRANCH: {
+      if (op.dst != NO_REGISTER) {
+        copy(op.dst, op.lhs);
+      }
+      // both directions continue at the same pc
+      if (op.target == record.pc + 1) {
+        break;
+      }
+      std::size_t exit = record.taken ? record.pc + 1 : op.target;
+      // the condition which leaves the recorded path
+      std::uint8_t leave = CONDITION_CODES[op.cond] ^ (record.taken ? 1 : 0);
+      auto lhs = _known[op.lhs];
+      auto rhs = op.rhs == NO_REGISTER ? std::optional(op.value()) : _known[op.rhs];
+      if (lhs && rhs) {
+        if (evaluate(op.cond, *lhs, *rhs) != record.taken) {
+          _side_exits.emplace_back(jmp(), exit);
+        }
+        break;
+      }
+      if (lhs) {
+        mov_imm(RAX, *lhs);
+      } else {
+        mov(RAX, _host[op.lhs]);
+      }
+      if (rhs) {
+        cmp_imm(RAX, *rhs);
+      } else {
+        cmp(RAX, _host[op.rhs]);
+      }
+      _side_exits.emplace_back(jcc(leave), exit);
+      break;
+    }
+    case Operation::JUMP:
+      break;
+    }
+  }
+
+  void set_constant(std::size_t dst, std::int32_t value) {
+    mov_imm(_host[dst], value);
+    _known[dst] = value;
+  }
+  void copy(std::size_t dst, std::size_t src) {
+    if (dst != src) {
+      mov(_host[dst], _host[src]);
+      _known[dst] = _known[src];
+    }
+  }
+
+  // int arithmetic of the VM, which wraps around
+  static auto fold(IntOp op, std::int32_t lhs, std::int32_t rhs) -> std::int32_t {
+    auto l = static_cast<std::uint32_t>(lhs);
+    auto r = static_cast<std::uint32_t>(rhs);
+    switch (op) {
+    case IntOp::ADD:
+      return static_cast<std::int32_t>(l + r);
+    case IntOp::SUB:
+      return static_cast<std::int32_t>(l - r);
+    case IntOp::MUL:
+      return static_cast<std::int32_t>(l * r);
+    }
+    return 0;
+  }
+  static auto evaluate(std::size_t cond, std::int32_t lhs, std::int32_t rhs) -> bool {
+    switch (cond) {
+    case 0:
+      return lhs < rhs;
+    case 1:
+      return lhs > rhs;
+    case 2:
+      return lhs == rhs;
+    case 3:
+      return lhs != rhs;
+    case 4:
+      return lhs <= rhs;
+    default:
+      return lhs >= rhs;
+    }
+  }
+
+  std::span<const TraceRecord> _trace;
+  std::vector<Reg> _host;
+  // value of the register if it is known while the current iteration runs
+  std::vector<std::optional<std::int32_t>> _known;
+  std::vector<bool> _written;
+  std::size_t _allocated = 0;
+  std::vector<std::pair<std::size_t, std::size_t>> _side_exits;
+};
+
+#endif
+
+} // namespace
+
+auto jit_compile(std::span<const Bytecode> code, std::size_t first, std::size_t last, std::size_t register_count,
+                 JitStep step, JitSafepoint safepoint) -> std::optional<JitCode> {
+#if PALLADIUM_JIT
+  if (first >= last || last > code.size()) {
+    return std::nullopt;
+  }
+  return FunctionCompiler(code, first, last, register_count, step, safepoint).compile();
+#else
+  static_cast<void>(code);
+  static_cast<void>(first);
+  static_cast<void>(last);
+  static_cast<void>(register_count);
+  static_cast<void>(step);
+  static_cast<void>(safepoint);
+  return std::nullopt;
+#endif
+}
+
+auto jit_traceable(const Bytecode& code, std::span<const VMValue> registers) -> bool {
+  auto op = decode(code, registers.size());
+  if (!op) {
+    return false;
+  }
+  if (op->kind == Operation::MOVE && op->lhs == NO_REGISTER) {
+    return is_int(op->constant);
+  }
+  for (auto r : {op->lhs, op->rhs}) {
+    if (r != NO_REGISTER && !registers[r].is_int()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+auto jit_compile_trace(std::span<const TraceRecord> trace, std::size_t register_count) -> std::optional<JitCode> {
+#if PALLADIUM_JIT
+  if (trace.empty()) {
+    return std::nullopt;
+  }
+  return TraceCompiler(trace, register_count).compile();
+#else
+  static_cast<void>(trace);
+  static_cast<void>(register_count);
+  return std::nullopt;
+#endif
+}
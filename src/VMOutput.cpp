@@ -0,0 +1,117 @@
+#include "VMOutput.h"
+#include "VMValue.h"
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <type_traits>
+
+namespace {
+
+// longest number to_chars can produce, a fixed double of 1e308 with sign
+constexpr std::size_t NUMBER_SIZE = 330;
+
+} // namespace
+
+VMOutput::VMOutput(std::ostream* out, std::size_t capacity)
+    : _out(out == nullptr ? &std::cout : out), _capacity(capacity), _buffer(std::max(capacity, NUMBER_SIZE)) {
+}
+
+VMOutput::~VMOutput() {
+  flush();
+}
+
+void VMOutput::set_stream(std::ostream* out) {
+  flush();
+  _out = out == nullptr ? &std::cout : out;
+}
+
+void VMOutput::set_capacity(std::size_t capacity) {
+  flush();
+  _capacity = capacity;
+  _buffer.assign(std::max(capacity, NUMBER_SIZE), 0);
+}
+
+void VMOutput::write(std::string_view text) {
+  if (_size + text.size() > _capacity) {
+    flush();
+  }
+  // longer than the whole buffer, no need to copy it
+  if (text.size() > _capacity) {
+    _out->write(text.data(), static_cast<std::streamsize>(text.size()));
+    if (_capacity == 0) {
+      _out->flush();
+    }
+    return;
+  }
+  std::memcpy(_buffer.data() + _size, text.data(), text.size());
+  _size += text.size();
+  commit();
+}
+
+auto VMOutput::write(VMValue value, const VMHeap& heap) -> ResultOr<bool> {
+  switch (value.kind()) {
+  case VMTypeKind::VM_STRING:
+    write(heap.string(value));
+    return true;
+  case VMTypeKind::VM_INT:
+    write_number(value.as_int());
+    return true;
+  case VMTypeKind::VM_SIZE_T:
+    write_number(value.as_size_t());
+    return true;
+  case VMTypeKind::VM_FLOAT:
+    write_number(value.as_float());
+    return true;
+  case VMTypeKind::VM_DOUBLE:
+    write_number(value.as_double());
+    return true;
+  case VMTypeKind::VM_BOOL:
+    write(value.as_bool() ? "1" : "0");
+    return true;
+  default:
+    break;
+  }
+  auto res = heap.to_string(value);
+  if (!res.ok()) {
+    return res.error_value();
+  }
+  write(res.result());
+  return true;
+}
+
+void VMOutput::flush() {
+  if (_size != 0) {
+    _out->write(_buffer.data(), static_cast<std::streamsize>(_size));
+    _size = 0;
+  }
+  _out->flush();
+}
+
+auto VMOutput::reserve(std::size_t n) -> char* {
+  if (_size + n > _buffer.size()) {
+    flush();
+  }
+  return _buffer.data() + _size;
+}
+
+template <class T> void VMOutput::write_number(T value) {
+  char* begin = reserve(NUMBER_SIZE);
+  std::to_chars_result res;
+  if constexpr (std::is_floating_point_v<T>) {
+    // std::to_string prints floating point values with %f
+    res = std::to_chars(begin, begin + NUMBER_SIZE, value, std::chars_format::fixed, 6);
+  } else {
+    res = std::to_chars(begin, begin + NUMBER_SIZE, value);
+  }
+  _size += static_cast<std::size_t>(res.ptr - begin);
+  commit();
+}
+
+void VMOutput::commit() {
+  if (_size >= _capacity) {
+    flush();
+  }
+}
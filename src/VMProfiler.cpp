@@ -0,0 +1,138 @@
+#include "VMProfiler.h"
+#include "Bytecode.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+auto json_string(const std::string& value) -> std::string {
+  std::string res = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+    }
+    res += c;
+  }
+  return res + "\"";
+}
+
+} // namespace
+
+VMProfiler::VMProfiler() : _paths{{.parent = 0, .function = 0}}, _children(1) {
+}
+
+void VMProfiler::enter(std::size_t function, const std::string& name) {
+  if (function >= _functions.size()) {
+    _functions.resize(function + 1);
+  }
+  auto& stats = _functions[function];
+  if (stats.name.empty()) {
+    stats.name = name;
+  }
+  stats.calls += 1;
+  stats.active += 1;
+
+  auto& children = _children[_path];
+  auto it = std::find_if(children.begin(), children.end(), [&](const auto& child) { return child.first == function; });
+  std::size_t path = 0;
+  if (it != children.end()) {
+    path = it->second;
+  } else {
+    path = _paths.size();
+    children.emplace_back(function, path);
+    _paths.push_back({.parent = _path, .function = function});
+    _children.emplace_back();
+  }
+  _frames.push_back({.function = function, .path = _path, .start = now()});
+  _path = path;
+}
+
+void VMProfiler::leave() {
+  if (_frames.empty()) {
+    return;
+  }
+  Frame frame = _frames.back();
+  _frames.pop_back();
+  auto& stats = _functions[frame.function];
+  // recursive calls are part of the outermost call
+  stats.active -= 1;
+  if (stats.active == 0) {
+    stats.inclusive_ticks += now() - frame.start;
+  }
+  _path = frame.path;
+}
+
+void VMProfiler::halt() {
+  if (_out == nullptr) {
+    return;
+  }
+  if (_format == Format::JSON) {
+    write_json(*_out);
+  } else {
+    write_folded(*_out);
+  }
+  _out->flush();
+}
+
+void VMProfiler::write_json(std::ostream& out, std::size_t hot_pcs) const {
+  out << "{\n  \"opcodes\": [";
+  const char* sep = "\n";
+  for (std::size_t op = 0; op < _opcodes.size(); ++op) {
+    if (_opcodes[op].count == 0) {
+      continue;
+    }
+    const auto& stats = _opcodes[op];
+    out << sep << "    {\"name\": " << json_string(opcode_name(static_cast<OpCode>(op))) << ", \"opcode\": " << op
+        << ", \"count\": " << stats.count << ", \"ticks\": " << stats.ticks;
+    if (stats.cache_hits + stats.cache_misses != 0) {
+      out << ", \"cache_hits\": " << stats.cache_hits << ", \"cache_misses\": " << stats.cache_misses;
+    }
+    out << "}";
+    sep = ",\n";
+  }
+  out << "\n  ],\n  \"functions\": [";
+  sep = "\n";
+  for (const auto& function : _functions) {
+    if (function.calls == 0) {
+      continue;
+    }
+    out << sep << "    {\"name\": " << json_string(function.name) << ", \"calls\": " << function.calls
+        << ", \"inclusive_ticks\": " << function.inclusive_ticks << "}";
+    sep = ",\n";
+  }
+  out << "\n  ],\n  \"hot_pcs\": [";
+
+  std::vector<std::size_t> pcs(_pc_histogram.size());
+  std::iota(pcs.begin(), pcs.end(), 0);
+  std::size_t n = std::min(hot_pcs, pcs.size());
+  std::partial_sort(pcs.begin(), pcs.begin() + n, pcs.end(),
+                    [&](std::size_t l, std::size_t r) { return _pc_histogram[l] > _pc_histogram[r]; });
+  sep = "\n";
+  for (std::size_t i = 0; i < n && _pc_histogram[pcs[i]] != 0; ++i) {
+    out << sep << "    {\"pc\": " << pcs[i] << ", \"count\": " << _pc_histogram[pcs[i]] << "}";
+    sep = ",\n";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void VMProfiler::write_folded(std::ostream& out) const {
+  for (std::size_t path = 0; path < _paths.size(); ++path) {
+    if (_paths[path].self_ticks == 0) {
+      continue;
+    }
+    std::vector<std::size_t> stack;
+    for (std::size_t node = path; node != 0; node = _paths[node].parent) {
+      stack.push_back(_paths[node].function);
+    }
+    out << "main";
+    for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+      out << ";" << _functions[*it].name;
+    }
+    out << " " << _paths[path].self_ticks << "\n";
+  }
+}
@@ -0,0 +1,92 @@
+#include "VMString.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <utility>
+
+VMString::VMString(std::string_view value) : _size(value.size()), _hash(hash(value)) {
+  if (is_inline()) {
+    std::memcpy(_inline, value.data(), value.size());
+  } else {
+    _buffer = allocate(value.size());
+    std::memcpy(_buffer->bytes(), value.data(), value.size());
+    _buffer->used = value.size();
+  }
+}
+
+VMString::VMString(const VMString& other) : _size(other._size), _hash(other._hash) {
+  if (is_inline()) {
+    std::memcpy(_inline, other._inline, sizeof(_inline));
+  } else {
+    _buffer = other._buffer;
+    _buffer->refs += 1;
+  }
+}
+
+VMString::VMString(VMString&& other) noexcept : _size(other._size), _hash(other._hash) {
+  std::memcpy(_inline, other._inline, sizeof(_inline));
+  other._size = 0;
+  other._hash = HASH_SEED;
+}
+
+auto VMString::operator=(const VMString& other) -> VMString& {
+  if (this != &other) {
+    VMString copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+auto VMString::operator=(VMString&& other) noexcept -> VMString& {
+  if (this != &other) {
+    release();
+    std::memcpy(_inline, other._inline, sizeof(_inline));
+    _size = std::exchange(other._size, 0);
+    _hash = std::exchange(other._hash, HASH_SEED);
+  }
+  return *this;
+}
+
+VMString::~VMString() {
+  release();
+}
+
+auto VMString::concat(const VMString& lhs, std::string_view rhs) -> VMString {
+  std::size_t size = lhs._size + rhs.size();
+  VMString result;
+  result._size = size;
+  result._hash = hash(rhs, lhs._hash);
+  if (result.is_inline()) {
+    std::memcpy(result._inline, lhs._inline, lhs._size);
+    std::memcpy(result._inline + lhs._size, rhs.data(), rhs.size());
+    return result;
+  }
+  // the bytes behind lhs are not used by any string yet, append in place
+  if (!lhs.is_inline() && lhs._buffer->used == lhs._size && lhs._buffer->capacity >= size) {
+    std::memcpy(lhs._buffer->bytes() + lhs._size, rhs.data(), rhs.size());
+    lhs._buffer->used = size;
+    result._buffer = lhs._buffer;
+    result._buffer->refs += 1;
+    return result;
+  }
+  result._buffer = allocate(std::max(size + (size / 2), std::size_t{32}));
+  std::memcpy(result._buffer->bytes(), lhs.data(), lhs._size);
+  std::memcpy(result._buffer->bytes() + lhs._size, rhs.data(), rhs.size());
+  result._buffer->used = size;
+  return result;
+}
+
+auto VMString::allocate(std::size_t capacity) -> Buffer* {
+  void* memory = ::operator new(sizeof(Buffer) + capacity);
+  return new (memory) Buffer{.refs = 1, .capacity = capacity, .used = 0};
+}
+
+void VMString::release() {
+  if (!is_inline() && --_buffer->refs == 0) {
+    _buffer->~Buffer();
+    ::operator delete(_buffer);
+  }
+  _size = 0;
+}
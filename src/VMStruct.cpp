@@ -1,50 +1,82 @@
 #include "VMType.h"
+#include "VMValue.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
 
-VMStruct::VMStruct(VMPrimitive size) : _fields(std::get<std::size_t>(size)), _currentIndex(0) {
+namespace {
+
+auto field_size(VMTypeKind kind) -> std::uint32_t {
+  switch (kind) {
+  case VMTypeKind::VM_BOOL:
+    return 1;
+  case VMTypeKind::VM_INT:
+  case VMTypeKind::VM_FLOAT:
+    return 4;
+  default:
+    return 8;
+  }
 }
 
-auto VMStruct::max_index() const -> std::size_t {
-  return _fields.size();
+auto is_numeric(VMTypeKind kind) -> bool {
+  return kind == VMTypeKind::VM_INT || kind == VMTypeKind::VM_FLOAT || kind == VMTypeKind::VM_SIZE_T ||
+         kind == VMTypeKind::VM_DOUBLE;
 }
-void VMStruct::add_field(const VMStructTypes& type) {
-  _fields[_currentIndex] = type;
-  _currentIndex += 1;
+
+template <class T> auto numeric_as(VMValue value) -> T {
+  switch (value.kind()) {
+  case VMTypeKind::VM_INT:
+    return static_cast<T>(value.as_int());
+  case VMTypeKind::VM_FLOAT:
+    return static_cast<T>(value.as_float());
+  case VMTypeKind::VM_SIZE_T:
+    return static_cast<T>(value.as_size_t());
+  default:
+    return static_cast<T>(value.as_double());
+  }
 }
-void VMStruct::set_field(std::size_t index, const VMStructTypes& value) {
-  auto pp = [&](const VMPrimitive& v, const VMPrimitive& field) {
-    if (field.index() == v.index()) {
-      _fields[index] = v;
-    } else if (field.index() < get_index<bool, VMPrimitive>::value && v.index() <= field.index()) {
-      _fields[index] = v;
 
-    } else {
-      // TODO: Error handling
-    }
-  };
-  auto psp = [](const VMPrimitive& v, const VMStructPtr& field) {
-    UNUSED(v);
-    UNUSED(field);
-  };
-  auto spsp = [](const VMStructPtr& v, const VMStructPtr& field) {
-    UNUSED(v);
-    UNUSED(field);
-  };
-  auto spp = [](const VMStructPtr& v, const VMPrimitive& field) {
-    UNUSED(v);
-    UNUSED(field);
-  };
+} // namespace
 
-  std::visit(overloaded{pp, psp, spsp, spp}, value, _fields[index]);
-}
-auto VMStruct::get_field(std::size_t index) -> VMStructTypes& {
-  return _fields[index];
+VMStructShape::VMStructShape(std::uint32_t index, std::span<const VMValue> defaults)
+    : _index(index), _defaults(defaults.begin(), defaults.end()) {
+  std::uint32_t offset = HEADER_SIZE;
+  for (auto value : defaults) {
+    auto kind = value.kind();
+    auto size = field_size(kind);
+    offset = (offset + size - 1) / size * size;
+    _fields.push_back({.kind = kind, .offset = offset});
+    offset += size;
+  }
+  _instance.resize(offset);
+  std::memcpy(_instance.data(), &_index, sizeof(_index));
+  for (std::size_t i = 0; i < _fields.size(); ++i) {
+    store(_instance.data(), _fields[i], _defaults[i]);
+  }
 }
 
-auto VMStruct::size() const -> int {
-  int res = 0;
-  for (const auto& x : _fields) {
-    auto ptr_size = get_data_ptr_and_size(x);
-    res += static_cast<int>(ptr_size.second);
+auto VMStructShape::convert(Field field, VMValue value) -> std::optional<VMValue> {
+  auto kind = value.kind();
+  if (kind == field.kind) {
+    return value;
+  }
+  // the same widening as VMPrimitive: int -> float -> size_t -> double
+  if (!is_numeric(kind) || !is_numeric(field.kind) || kind > field.kind) {
+    return std::nullopt;
+  }
+  switch (field.kind) {
+  case VMTypeKind::VM_FLOAT:
+    return VMValue(numeric_as<float>(value));
+  case VMTypeKind::VM_SIZE_T: {
+    auto size = numeric_as<std::size_t>(value);
+    if (!VMValue::fits_payload(size)) {
+      return std::nullopt;
+    }
+    return VMValue(size);
+  }
+  default:
+    return VMValue(numeric_as<double>(value));
   }
-  return res;
 }
@@ -1,5 +1,6 @@
 #include "VMType.h"
 #include "Util.h"
+#include <cmath>
 #include <cstddef>
 #include <functional>
 #include <type_traits>
@@ -15,7 +16,7 @@ template <class L, class R> auto create_operator_error(const std::string& str) -
   return err(e);
 }
 
-auto add(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
+auto add(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType> {
   if (std::holds_alternative<VMPrimitive>(lhs) && std::holds_alternative<VMPrimitive>(rhs)) {
 
     return std::visit(
@@ -42,7 +43,7 @@ auto add(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
       },
       lhs, rhs);
 }
-auto sub(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
+auto sub(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType> {
   if (std::holds_alternative<VMPrimitive>(lhs) && std::holds_alternative<VMPrimitive>(rhs)) {
 
     return std::visit(
@@ -52,8 +53,7 @@ auto sub(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
 
           if constexpr (std::is_arithmetic_v<L> && std::is_arithmetic_v<R>) {
             using CommonType = std::common_type_t<L, R>;
-            return VMType{
-                VMPrimitive{static_cast<CommonType>(lhv) + static_cast<CommonType>(rhv)}}; // Numerische Addition
+            return VMType{VMPrimitive{static_cast<CommonType>(lhv) - static_cast<CommonType>(rhv)}};
           }
           return create_operator_error<L, R>("sub");
         },
@@ -68,7 +68,7 @@ auto sub(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
       lhs, rhs);
 }
 
-auto mult(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
+auto mult(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType> {
   if (std::holds_alternative<VMPrimitive>(lhs) && std::holds_alternative<VMPrimitive>(rhs)) {
 
     return std::visit(
@@ -94,7 +94,7 @@ auto mult(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
       lhs, rhs);
 }
 
-auto div(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
+auto div(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType> {
   if (std::holds_alternative<VMPrimitive>(lhs) && std::holds_alternative<VMPrimitive>(rhs)) {
 
     return std::visit(
@@ -126,6 +126,38 @@ auto div(VMType& lhs, VMType& rhs) -> ResultOr<VMType> {
       lhs, rhs);
 }
 
+auto mod(const VMType& lhs, const VMType& rhs) -> ResultOr<VMType> {
+  if (std::holds_alternative<VMPrimitive>(lhs) && std::holds_alternative<VMPrimitive>(rhs)) {
+
+    return std::visit(
+        [](const auto& lhv, const auto& rhv) -> ResultOr<VMType> {
+          using L = std::remove_cvref_t<decltype(lhv)>;
+          using R = std::remove_cvref_t<decltype(rhv)>;
+
+          if constexpr (std::is_arithmetic_v<L> && std::is_arithmetic_v<R>) {
+            using CommonType = std::common_type_t<L, R>;
+            if (static_cast<CommonType>(rhv) == 0) {
+              return err("Division by zero");
+            }
+            if constexpr (std::is_floating_point_v<CommonType>) {
+              return VMType{VMPrimitive{std::fmod(static_cast<CommonType>(lhv), static_cast<CommonType>(rhv))}};
+            } else {
+              return VMType{VMPrimitive{static_cast<CommonType>(lhv) % static_cast<CommonType>(rhv)}};
+            }
+          }
+          return create_operator_error<L, R>("mod");
+        },
+        std::get<VMPrimitive>(lhs), std::get<VMPrimitive>(rhs));
+  }
+  return std::visit(
+      [](const auto& lhv, const auto& rhv) -> ResultOr<VMType> {
+        using L = std::remove_cvref_t<decltype(lhv)>;
+        using R = std::remove_cvref_t<decltype(rhv)>;
+        return create_operator_error<L, R>("mod");
+      },
+      lhs, rhs);
+}
+
 auto to_string(const VMType& value) -> ResultOr<std::string> {
   if (std::holds_alternative<VMPrimitive>(value)) {
     return std::visit(
@@ -232,7 +264,7 @@ auto get_data_ptr_and_size(const VMType& type) -> std::pair<const void*, std::si
   } else if (auto adr = std::get_if<VMAddress>(&type)) {
     return {adr, sizeof(VMAddress)};
   } else if (auto vmStruct = std::get_if<VMStruct>(&type)) {
-    return {vmStruct, vmStruct->size()};
+    return {vmStruct->bytes.data(), vmStruct->bytes.size()};
   }
   return {nullptr, 0};
 }
@@ -0,0 +1,212 @@
+#include "VMValue.h"
+#include "Util.h"
+#include "VMType.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+auto VMValue::kind() const -> VMTypeKind {
+  switch (tag()) {
+  case INT_TAG:
+    return VMTypeKind::VM_INT;
+  case FLOAT_TAG:
+    return VMTypeKind::VM_FLOAT;
+  case SIZE_T_TAG:
+    return VMTypeKind::VM_SIZE_T;
+  case BOOL_TAG:
+    return VMTypeKind::VM_BOOL;
+  case STRING_TAG:
+    return VMTypeKind::VM_STRING;
+  case STRUCT_TAG:
+    return VMTypeKind::VM_STRUCT;
+  case ADDRESS_TAG:
+    return VMTypeKind::VM_ADDRESS;
+  default:
+    return VMTypeKind::VM_DOUBLE;
+  }
+}
+
+auto VMHeap::make_string(std::string_view value) -> VMValue {
+  return make_string(VMString(value));
+}
+
+auto VMHeap::make_string(VMString value) -> VMValue {
+  if (!_free.empty()) {
+    auto handle = _free.back();
+    _free.pop_back();
+    _strings[handle] = std::move(value);
+    _slots[handle] = Slot::LIVE;
+    return VMValue::string_handle(handle);
+  }
+  _strings.push_back(std::move(value));
+  _slots.push_back(Slot::LIVE);
+  return VMValue::string_handle(_strings.size() - 1);
+}
+
+auto VMHeap::make_constant(std::string_view value) -> VMValue {
+  auto handle = make_string(value);
+  _slots[handle.handle()] = Slot::PINNED;
+  return handle;
+}
+
+auto VMHeap::concat(VMValue lhs, VMValue rhs) -> VMValue {
+  return make_string(VMString::concat(_strings[lhs.handle()], _strings[rhs.handle()].view()));
+}
+
+auto VMHeap::intern(std::string_view value) -> VMValue {
+  if (auto it = _interned.find(value); it != _interned.end()) {
+    return VMValue::string_handle(it->second);
+  }
+  auto handle = make_constant(value);
+  _interned.emplace(string(handle), handle.handle());
+  return handle;
+}
+
+void VMHeap::mark(VMValue value) {
+  if (value.is_string()) {
+    if (value.handle() < _strings.size()) {
+      _marks.resize(_strings.size());
+      _marks[value.handle()] = true;
+    }
+    return;
+  }
+  if (!value.is_struct() || value.handle() == 0 || is_boxed_struct(value)) {
+    return;
+  }
+  // structs can refer to each other in cycles, every instance is visited once
+  std::vector<const std::byte*> pending{VMStructShape::data(value)};
+  while (!pending.empty()) {
+    const auto* data = pending.back();
+    pending.pop_back();
+    auto index = VMStructShape::shape_index(data);
+    if (!_visited.insert(data).second || index >= _shapes.size()) {
+      continue;
+    }
+    for (const auto& field : _shapes[index].fields()) {
+      auto field_value = VMStructShape::load(data, field);
+      if (field_value.is_struct() && field_value.handle() != 0 && !is_boxed_struct(field_value)) {
+        pending.push_back(VMStructShape::data(field_value));
+      } else {
+        mark(field_value);
+      }
+    }
+  }
+}
+
+auto VMHeap::sweep() -> std::size_t {
+  _marks.resize(_strings.size());
+  std::size_t freed = 0;
+  for (std::size_t i = 0; i < _strings.size(); ++i) {
+    if (_slots[i] == Slot::LIVE && !_marks[i]) {
+      _strings[i] = VMString();
+      _slots[i] = Slot::FREE;
+      _free.push_back(i);
+      freed += 1;
+    }
+  }
+  std::fill(_marks.begin(), _marks.end(), false);
+  _visited.clear();
+  _next_collection = std::max(MIN_COLLECTION, 2 * live_strings());
+  return freed;
+}
+
+auto VMHeap::add_shape(std::span<const VMValue> defaults) -> std::uint32_t {
+  for (const auto& shape : _shapes) {
+    if (std::ranges::equal(shape.defaults(), defaults)) {
+      return shape.index();
+    }
+  }
+  _shapes.emplace_back(static_cast<std::uint32_t>(_shapes.size()), defaults);
+  return _shapes.back().index();
+}
+
+auto VMHeap::field_value(const VMStructTypes& type) -> VMValue {
+  if (const auto* primitive = std::get_if<VMPrimitive>(&type)) {
+    return constant(*primitive);
+  }
+  return VMValue::struct_handle(0);
+}
+
+auto VMHeap::box(const VMType& value) -> ResultOr<VMValue> {
+  if (auto adr = std::get_if<VMAddress>(&value)) {
+    if (!VMValue::fits_payload(adr->get())) {
+      return err("address " + std::to_string(adr->get()) + " exceeds the 48 bit range of VMValue");
+    }
+    return VMValue(*adr);
+  }
+  if (auto vm_struct = std::get_if<VMStruct>(&value)) {
+    if (vm_struct->bytes.empty()) {
+      return VMValue::struct_handle(0);
+    }
+    _structs.push_back(*vm_struct);
+    auto handle = reinterpret_cast<std::size_t>(_structs.back().bytes.data());
+    _struct_index.emplace(handle, _structs.size() - 1);
+    return VMValue::struct_handle(handle);
+  }
+  if (const auto* size = std::get_if<std::size_t>(&std::get<VMPrimitive>(value));
+      size != nullptr && !VMValue::fits_payload(*size)) {
+    return err("size_t " + std::to_string(*size) + " exceeds the 48 bit range of VMValue");
+  }
+  return std::visit(overloaded{[&](const std::string& str) -> VMValue { return make_string(str); },
+                               [](const auto& v) -> VMValue { return VMValue(v); }},
+                    std::get<VMPrimitive>(value));
+}
+
+auto VMHeap::constant(const VMType& value) -> VMValue {
+  if (const auto* primitive = std::get_if<VMPrimitive>(&value)) {
+    if (const auto* str = std::get_if<std::string>(primitive)) {
+      return intern(*str);
+    }
+  }
+  auto boxed = box(value);
+  if (!boxed.ok()) {
+    panic("constant " + boxed.error_value().msg());
+  }
+  return boxed.result();
+}
+
+auto VMHeap::unbox(VMValue value) const -> VMType {
+  switch (value.kind()) {
+  case VMTypeKind::VM_INT:
+    return VMPrimitive(value.as_int());
+  case VMTypeKind::VM_FLOAT:
+    return VMPrimitive(value.as_float());
+  case VMTypeKind::VM_SIZE_T:
+    return VMPrimitive(value.as_size_t());
+  case VMTypeKind::VM_DOUBLE:
+    return VMPrimitive(value.as_double());
+  case VMTypeKind::VM_BOOL:
+    return VMPrimitive(value.as_bool());
+  case VMTypeKind::VM_STRING:
+    return VMPrimitive(std::string(string(value)));
+  case VMTypeKind::VM_STRUCT: {
+    if (value.handle() == 0) {
+      return VMStruct{};
+    }
+    if (auto boxed = _struct_index.find(value.handle()); boxed != _struct_index.end()) {
+      return _structs[boxed->second];
+    }
+    const auto* data = VMStructShape::data(value);
+    return VMStruct{{data, data + shape(VMStructShape::shape_index(data)).size()}};
+  }
+  case VMTypeKind::VM_STRUCT_PTR:
+  case VMTypeKind::VM_ADDRESS:
+    break;
+  }
+  return value.as_address();
+}
+
+auto VMHeap::to_string(VMValue value) const -> ResultOr<std::string> {
+  if (value.is_string()) {
+    return std::string(string(value));
+  }
+  if (value.is_struct()) {
+    return err("ToString only allowed on primitive");
+  }
+  return ::to_string(unbox(value));
+}
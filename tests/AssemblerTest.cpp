@@ -0,0 +1,147 @@
+#include "Assembler.h"
+#include "PbcFile.h"
+#include "VMPolicy.h"
+#include "VirtualMachine.h"
+#include "purge.hpp"
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using VM = VirtualMachine<AggresivPolicy>;
+PURGE_MAIN
+
+auto load_image(VM& vm, const PbcImage& image) -> bool {
+  auto path = (std::filesystem::temp_directory_path() / "palladium_assembler_test.pbc").string();
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!write_pbc(out, image).ok()) {
+      return false;
+    }
+  }
+  auto file = PbcFile::open(path);
+  std::filesystem::remove(path);
+  return file.ok() && vm.load(file.result()).ok();
+}
+
+auto assemble_error(const std::string& source) -> std::string {
+  auto res = assemble(source);
+  return res.ok() ? "" : res.error_value().msg();
+}
+
+SIMPLE_TEST_CASE(AssemblerFibTest) {
+  auto image = assemble(R"(
+# c(1) = fib(15)
+$function_section
+  fib 1 fib_label
+$end
+$code_section
+  MovRI 1 15
+  CallR fib 1
+  CLoad "fib done"
+  Halt
+fib_label:
+  CmpBrI 4 0 1 done   # forward label
+  SubRRI 2 0 1
+  CallR fib 2
+  SubRRI 3 0 2
+  CallR fib 3
+  AddRRR 0 2 3
+done:
+  Return 0
+$end
+)");
+  REQUIRE(image.ok());
+  REQUIRE(image.result().code.size() == 11);
+  REQUIRE(image.result().functions[0].address == 4);
+  REQUIRE(image.result().code[4].b == 10);
+
+  VM vm(128);
+  REQUIRE(load_image(vm, image.result()));
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(610));
+  REQUIRE(vm.heap().string(vm.registers()[0]) == "fib done");
+}
+
+SIMPLE_TEST_CASE(AssemblerValueTest) {
+  auto image = assemble(R"($code_section
+  MovRI 1 -3
+  MovRI 2 1.5
+  MovRI 3 2.5f
+  MovRI 4 7u
+  MovRI 5 true
+  MovRI 6 "a \"b\""
+  Halt
+$end)");
+  REQUIRE(image.ok());
+  VM vm(128);
+  REQUIRE(load_image(vm, image.result()));
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(-3));
+  REQUIRE(vm.registers()[2] == VMValue(1.5));
+  REQUIRE(vm.registers()[3] == VMValue(2.5f));
+  REQUIRE(vm.registers()[4] == VMValue(std::size_t{7}));
+  REQUIRE(vm.registers()[5] == VMValue(true));
+  REQUIRE(vm.heap().string(vm.registers()[6]) == "a \"b\"");
+}
+
+SIMPLE_TEST_CASE(AssemblerStructTest) {
+  auto image = assemble(R"($code_section
+  StructCreate 1 0 "x" 1.5
+  StructCreate 2 0 "x" 1.5
+  SetField 1 0 4
+  GetField 3 1 0
+  GetField 4 2 1
+  GetField 5 1 2
+  Halt
+$end)");
+  REQUIRE(image.ok());
+  REQUIRE(image.result().constants.size() == 7);
+  REQUIRE(image.result().code[0].b == image.result().code[1].b);
+  VM vm(128);
+  REQUIRE(load_image(vm, image.result()));
+  vm.run();
+  REQUIRE(vm.registers()[3] == VMValue(4));
+  REQUIRE(vm.heap().string(vm.registers()[4]) == "x");
+  REQUIRE(vm.registers()[5] == VMValue(1.5));
+}
+
+SIMPLE_TEST_CASE(AssemblerMemoryOperandTest) {
+  auto image = assemble(R"($code_section
+  Allocate 16 1
+  MovRI 2 3
+  MovRI 3 42
+  StoreMem 3 [1 + 2*4] 0
+  LoadMem 4 [1+8 - 4 + 2*2 + 2] 0
+  LoadMem 5 [1 + 12] 0
+  Deallocate 1
+  Halt
+$end)");
+  REQUIRE(image.ok());
+  REQUIRE(image.result().code[4].c == 6);
+  VM vm(4096);
+  REQUIRE(load_image(vm, image.result()));
+  vm.run();
+  REQUIRE(vm.registers()[4] == VMValue(42));
+  REQUIRE(vm.registers()[5] == VMValue(42));
+  REQUIRE(assemble_error("$code_section\n  LoadMem 1 [2 + 3*3] 0\n$end\n") ==
+          "parsing error in code section in line 2! invalid memory operand [2+3*3]");
+}
+
+SIMPLE_TEST_CASE(AssemblerErrorTest) {
+  REQUIRE(assemble_error("$function_section\n  2 foo_label\n$end\n") ==
+          "Missing function entry item in line 2! Content is 2 foo_label");
+  REQUIRE(assemble_error("$function_section\n foo  2 foo_label\n") ==
+          "parsing error in function section! function section not closed with $end");
+  REQUIRE(assemble_error("$function_section\n foo a foo_label\n$end\n") ==
+          "parsing error in function section in line 2! argument count is not a number: a");
+  REQUIRE(assemble_error("$code_section\n  Jump 3\n$end\n") ==
+          "parsing error in code section in line 2! unknown instruction Jump");
+  REQUIRE(assemble_error("$code_section\n  AddRRI 1 2\n$end\n") ==
+          "parsing error in code section in line 2! AddRRI expects 3 operands");
+  REQUIRE(assemble_error("$code_section\n  Goto nowhere\n$end\n") == "unknown label nowhere in line 2");
+  REQUIRE(assemble_error("$code_section\n  Call foo\n$end\n") ==
+          "parsing error in code section in line 2! unknown function foo");
+  REQUIRE(assemble_error("$code_section\n  MovRR 10 1\n$end\n") ==
+          "parsing error in code section in line 2! invalid register 10");
+  REQUIRE(assemble_error("$code_section\n  MovRR 9 1\n  Halt\n$end\n").empty());
+}
@@ -136,3 +136,65 @@ SIMPLE_TEST_CASE(VMMemoryLargeAllocaInTwoAndHalfSegmentTest) {
     REQUIRE(x.sub_blocks_free_list.none());
   }
 }
+
+SIMPLE_TEST_CASE(VMMemorySkipFullSegmentsTest) {
+  VMMemory<VirtualMachine<AggresivPolicy>> memory(128 * 100);
+  for (std::size_t i = 0; i < 32 * 100; ++i) {
+    std::size_t adr = memory.allocate(1);
+    REQUIRE(adr == memory.base() + (i / 32) * 128 + (i % 32));
+  }
+  REQUIRE(memory.allocate(1) == 0);
+  std::size_t freed = memory.base() + 70 * 128 + 5;
+  memory.deallocate(freed);
+  REQUIRE(memory.allocate(1) == freed);
+  REQUIRE(memory.allocate(1) == 0);
+
+  REQUIRE(memory.allocate(4) == memory.base() + 32);
+}
+
+SIMPLE_TEST_CASE(VMMemoryLargeAllocaSkipsUsedSegmentTest) {
+  VMMemory<VirtualMachine<AggresivPolicy>> memory(128 * 10);
+  std::size_t small = memory.allocate(1);
+  std::size_t large = memory.allocate(300);
+  REQUIRE(small == memory.base());
+  REQUIRE(large == memory.base() + 128);
+  memory.deallocate(large);
+  REQUIRE(memory.allocate(300) == large);
+  REQUIRE(memory.allocate(40) == memory.base() + 1);
+}
+
+SIMPLE_TEST_CASE(VMMemoryLazySegmentsTest) {
+  using Memory = VMMemory<VirtualMachine<AggresivPolicy>>;
+  Memory memory(1024 * 1024 * 1024);
+  REQUIRE(memory.segments().empty());
+  std::size_t adr = memory.allocate(1);
+  REQUIRE(adr == memory.base());
+  REQUIRE(memory.segments().size() == Memory::SEGMENT_CHUNK);
+  std::size_t large = memory.allocate(Memory::SEGMENT_CHUNK * Memory::SEGMENT_SIZE);
+  REQUIRE(large == memory.base() + Memory::SEGMENT_SIZE);
+  REQUIRE(memory.segments().size() == 2 * Memory::SEGMENT_CHUNK);
+  *reinterpret_cast<char*>(large + Memory::SEGMENT_CHUNK * Memory::SEGMENT_SIZE - 1) = 'x';
+  memory.deallocate(large);
+}
+
+SIMPLE_TEST_CASE(VMMemoryAllocateRunTest) {
+  // one 100 byte block per segment, the remaining 16 bytes take no second one
+  VMMemory<VirtualMachine<AggresivPolicy>> memory(128 * 64);
+  for (std::size_t i = 0; i < 64; ++i) {
+    REQUIRE(memory.allocate(100) == memory.base() + (128 * i));
+  }
+  REQUIRE(memory.allocate(100) == 0);
+  REQUIRE(memory.allocate(16) == memory.base() + 112);
+
+  // 127 free bytes are below the class of 120, the full memory still uses them
+  VMMemory<VirtualMachine<AggresivPolicy>> single(128);
+  REQUIRE(single.allocate(1) == single.base());
+  REQUIRE(single.allocate(120) == single.base() + 1);
+}
+
+SIMPLE_TEST_CASE(VMMemoryReserveFailureTest) {
+  // more address space than a process has, allocations fail instead of aborting
+  VMMemory<VirtualMachine<AggresivPolicy>> memory(std::size_t{1} << 62);
+  REQUIRE(memory.allocate(8) == 0);
+  REQUIRE(memory.allocate(1000) == 0);
+}
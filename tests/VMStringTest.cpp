@@ -0,0 +1,74 @@
+#include "purge.hpp"
+#include "VMArithmetic.h"
+#include "VMString.h"
+#include "VMValue.h"
+#include <string>
+
+PURGE_MAIN
+
+SIMPLE_TEST_CASE(VMStringInlineTest) {
+  VMString empty;
+  REQUIRE(empty.size() == 0);
+  REQUIRE(empty.hash() == VMString::hash(""));
+
+  VMString small("palladium");
+  REQUIRE(small.is_inline());
+  REQUIRE(small == "palladium");
+  REQUIRE(small.hash() == VMString::hash("palladium"));
+
+  VMString copy = small;
+  REQUIRE(copy == small);
+  REQUIRE(VMString("a") < VMString("b"));
+}
+
+SIMPLE_TEST_CASE(VMStringConcatTest) {
+  VMString base("a string which is too long for the inline storage");
+  REQUIRE(!base.is_inline());
+
+  auto first = VMString::concat(base, " first");
+  auto second = VMString::concat(first, " second");
+  // appending to an older prefix must not change the younger strings
+  auto other = VMString::concat(first, " other");
+  REQUIRE(base == "a string which is too long for the inline storage");
+  REQUIRE(first == "a string which is too long for the inline storage first");
+  REQUIRE(second == "a string which is too long for the inline storage first second");
+  REQUIRE(other == "a string which is too long for the inline storage first other");
+  REQUIRE(second.hash() == VMString(second.view()).hash());
+
+  VMStringBuilder builder;
+  std::string expected;
+  for (int i = 0; i < 100; ++i) {
+    builder.append("x=").append(std::to_string(i));
+    expected += "x=" + std::to_string(i);
+  }
+  REQUIRE(builder.size() == expected.size());
+  REQUIRE(builder.build() == expected);
+}
+
+SIMPLE_TEST_CASE(VMStringHeapTest) {
+  VMHeap heap;
+  auto lhs = heap.make_string("log:");
+  auto rhs = heap.make_string(" level=info");
+  auto line = add(lhs, rhs, heap);
+  REQUIRE(line.ok());
+  REQUIRE(heap.string(line.result()) == "log: level=info");
+  REQUIRE(compare(line.result(), heap.make_string("log: level=info"), 2, heap));
+  REQUIRE(compare(lhs, rhs, 1, heap));
+  REQUIRE(!compare(lhs, rhs, 0, heap));
+  REQUIRE(!sub(lhs, rhs, heap).ok());
+}
+
+SIMPLE_TEST_CASE(VMStringCollectionTest) {
+  VMHeap heap;
+  auto constant = heap.intern("const");
+  auto kept = heap.make_string("kept");
+  auto dropped = heap.make_string("dropped");
+  heap.mark(kept);
+  REQUIRE(heap.sweep() == 1);
+  REQUIRE(heap.live_strings() == 2);
+  REQUIRE(heap.string(constant) == "const");
+  REQUIRE(heap.string(kept) == "kept");
+  // the free handle is reused
+  REQUIRE(heap.make_string("new").handle() == dropped.handle());
+  REQUIRE(heap.string_count() == 3);
+}
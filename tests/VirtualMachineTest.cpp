@@ -0,0 +1,641 @@
+#include "purge.hpp"
+#include "VirtualMachine.h"
+#include "VMPolicy.h"
+#include "VMType.h"
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+using VM = VirtualMachine<AggresivPolicy>;
+PURGE_MAIN
+
+SIMPLE_TEST_CASE(VirtualMachineLowerProgramTest) {
+  VM vm({new CLoad<VM>(VMPrimitive(1)), new Store<VM>(1), new Halt<VM>()}, 128);
+  vm.lower_program();
+  REQUIRE(vm.bytecode().size() == 3);
+  REQUIRE(vm.bytecode()[0].op == OpCode::CLOAD);
+  REQUIRE(vm.bytecode()[1].op == OpCode::STORE);
+  REQUIRE(vm.bytecode()[1].a == 1);
+  REQUIRE(vm.bytecode()[2].op == OpCode::HALT);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineLoopTest) {
+  // c(1) = 0; while (c(1) < 100) { c(1) = c(1) + 3; }
+  VM vm({new CLoad<VM>(VMPrimitive(0)), new Store<VM>(1), new Load<VM>(1), new If<VM>(5, VMPrimitive(100), 7),
+         new CAdd<VM>(VMPrimitive(3)), new Store<VM>(1), new Goto<VM>(2), new Halt<VM>()},
+        128);
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(102));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineCallTest) {
+  VM vm(128);
+  vm.add_program({new Push<VM>(VMPrimitive(40)), new Call<VM>(VMPrimitive(std::string("inc"))), new Halt<VM>()});
+  vm.add_function("inc", {new Load<VM>(0), new CAdd<VM>(VMPrimitive(2)), new Return<VM>(0)}, 1);
+  vm.run();
+  REQUIRE(vm.stack_top() == VMValue(42));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineValueBoxingTest) {
+  REQUIRE(sizeof(VMValue) == 8);
+  REQUIRE(VMValue(-7).is_int());
+  REQUIRE(VMValue(-7).as_int() == -7);
+  REQUIRE(VMValue(2.5).is_double());
+  REQUIRE(VMValue(2.5).as_double() == 2.5);
+  REQUIRE(VMValue(1.5f).as_float() == 1.5f);
+  REQUIRE(VMValue(true).as_bool());
+  REQUIRE(VMValue(std::size_t{42}).as_size_t() == 42);
+  REQUIRE(VMValue(0.0 / 0.0).is_double());
+
+  VMHeap heap;
+  auto str = heap.box(VMPrimitive(std::string("pall"))).result();
+  REQUIRE(str.is_string());
+  auto res = add(str, heap.box(VMPrimitive(std::string("adium"))).result(), heap);
+  REQUIRE(heap.string(res.result()) == "palladium");
+  REQUIRE(add(VMValue(1), VMValue(2.5), heap).result() == VMValue(3.5));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineConstantPoolTest) {
+  VM vm({new CLoad<VM>(VMPrimitive(std::string("pall"))), new Push<VM>(VMPrimitive(std::string("pall"))),
+         new CAdd<VM>(VMPrimitive(std::string("adium"))), new MovRI<VM>(1, VMPrimitive(std::string("pall"))),
+         new Halt<VM>()},
+        128);
+  vm.lower_program();
+  vm.lower_program();
+  REQUIRE(vm.heap().string_count() == 2);
+  REQUIRE(vm.bytecode()[0].c == vm.bytecode()[1].c);
+  REQUIRE(vm.bytecode()[0].c == vm.bytecode()[3].c);
+  vm.run();
+  REQUIRE(vm.heap().string(vm.registers()[0]) == "palladium");
+  REQUIRE(vm.heap().intern("palladium") != vm.registers()[0]);
+  REQUIRE(vm.heap().intern("pall") == vm.registers()[1]);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineThreeAddressTest) {
+  // c(1) = 1; c(2) = 5; while (c(2) > 0) { c(1) = c(1) * c(2); c(2) = c(2) - 1; } c(3) = c(1) + c(1)
+  VM vm({new MovRI<VM>(1, VMPrimitive(1)), new MovRI<VM>(2, VMPrimitive(5)),
+         new CmpBrI<VM>(4, 2, VMPrimitive(0), 6), new MulRRR<VM>(1, 1, 2), new SubRRI<VM>(2, 2, VMPrimitive(1)),
+         new Goto<VM>(2), new AddRRR<VM>(3, 1, 1), new Halt<VM>()},
+        128);
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(120));
+  REQUIRE(vm.registers()[2] == VMValue(0));
+  REQUIRE(vm.registers()[3] == VMValue(240));
+  REQUIRE(vm.bytecode()[2].op == OpCode::CMP_BR_I);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineFusionTest) {
+  // c(1) = 0; while (c(1) < 100) { c(1) = c(1) + 3; }
+  auto program = [] {
+    return std::vector<VM::InstructionTypeV*>{new CLoad<VM>(VMPrimitive(0)), new Store<VM>(1), new Load<VM>(1),
+                                              new If<VM>(5, VMPrimitive(100), 8), new Load<VM>(1),
+                                              new CAdd<VM>(VMPrimitive(3)), new Store<VM>(1), new Goto<VM>(2),
+                                              new Halt<VM>()};
+  };
+  VM vm(program(), 128);
+  vm.run();
+  REQUIRE(vm.fused_sequences() == 2);
+  REQUIRE(vm.bytecode().size() == 6);
+  REQUIRE(vm.bytecode()[2].op == OpCode::CMP_IMM_BRANCH);
+  REQUIRE(vm.bytecode()[2].b == 5);
+  REQUIRE(vm.bytecode()[3].op == OpCode::INC_REG);
+  REQUIRE(vm.bytecode()[4].c == 2);
+  REQUIRE(vm.registers()[0] == VMValue(102));
+  REQUIRE(vm.registers()[1] == VMValue(102));
+
+  VM training(program(), 128);
+  auto profile = training.train();
+  REQUIRE(profile.counts[2] == 35);
+  REQUIRE(profile.counts[4] == 34);
+  std::stringstream dump;
+  profile.save(dump);
+  auto loaded = FusionProfile::load(dump);
+  REQUIRE(loaded.ok());
+  REQUIRE(loaded.result().counts == profile.counts);
+
+  // only the loop condition is hot enough
+  VM profiled(program(), 128);
+  auto hot = loaded.result();
+  hot.threshold = 35;
+  profiled.use_fusion_profile(hot);
+  profiled.run();
+  REQUIRE(profiled.fused_sequences() == 1);
+  REQUIRE(profiled.bytecode().size() == 8);
+  REQUIRE(profiled.registers()[1] == VMValue(102));
+
+  // the training VM runs its program again with the profile
+  training.use_fusion_profile(hot);
+  training.run();
+  REQUIRE(training.fused_sequences() == 1);
+  REQUIRE(training.registers()[1] == VMValue(102));
+  REQUIRE(training.stack_pointer() == -1);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineArithmeticKernelTest) {
+  VMHeap heap;
+  REQUIRE(sub(VMValue(5), VMValue(7), heap).result() == VMValue(-2));
+  REQUIRE(sub(VMValue(5.0), VMValue(1), heap).result() == VMValue(4.0));
+  REQUIRE(mult(VMValue(1.5f), VMValue(2), heap).result() == VMValue(3.0f));
+  REQUIRE(div(VMValue(7), VMValue(2), heap).result() == VMValue(3));
+  REQUIRE(!div(VMValue(7), VMValue(0), heap).ok());
+  REQUIRE(mod(VMValue(7), VMValue(3), heap).result() == VMValue(1));
+  REQUIRE(mod(VMValue(7.5), VMValue(2.0), heap).result() == VMValue(1.5));
+  REQUIRE(compare(VMValue(1), VMValue(1.0), 2, heap));
+  REQUIRE(compare(VMValue(std::size_t{3}), VMValue(4), 0, heap));
+
+  // int arithmetic wraps around, INT_MIN / -1 does not trap
+  constexpr int MIN = std::numeric_limits<int>::min();
+  constexpr int MAX = std::numeric_limits<int>::max();
+  REQUIRE(add(VMValue(MAX), VMValue(1), heap).result() == VMValue(MIN));
+  REQUIRE(sub(VMValue(MIN), VMValue(1), heap).result() == VMValue(MAX));
+  REQUIRE(mult(VMValue(MAX), VMValue(2), heap).result() == VMValue(-2));
+  REQUIRE(div(VMValue(MIN), VMValue(-1), heap).result() == VMValue(MIN));
+  REQUIRE(mod(VMValue(MIN), VMValue(-1), heap).result() == VMValue(0));
+  REQUIRE(div(VMValue(7), VMValue(-1), heap).result() == VMValue(-7));
+  VM vm({new MovRI<VM>(1, VMPrimitive(MIN)), new MovRI<VM>(2, VMPrimitive(-1)), new DivRRR<VM>(3, 1, 2),
+         new ModRRR<VM>(4, 1, 2), new DivRRI<VM>(5, 1, VMPrimitive(-1)), new ModRRI<VM>(6, 1, VMPrimitive(-1)),
+         new Halt<VM>()},
+        128);
+  vm.run();
+  REQUIRE(vm.registers()[3] == VMValue(MIN));
+  REQUIRE(vm.registers()[4] == VMValue(0));
+  REQUIRE(vm.registers()[5] == VMValue(MIN));
+  REQUIRE(vm.registers()[6] == VMValue(0));
+
+  // size_t results must fit the 48 bit payload
+  REQUIRE(!sub(VMValue(std::size_t{1}), VMValue(std::size_t{2}), heap).ok());
+  REQUIRE(!add(VMValue(std::size_t{VMValue::PAYLOAD_MASK}), VMValue(1), heap).ok());
+  REQUIRE(sub(VMValue(std::size_t{2}), VMValue(std::size_t{1}), heap).result() == VMValue(std::size_t{1}));
+  REQUIRE(!heap.box(VMPrimitive(std::size_t{VMValue::PAYLOAD_MASK + 1})).ok());
+  std::size_t wide = VMValue::PAYLOAD_MASK + 1;
+  REQUIRE(!load_memory(reinterpret_cast<const std::byte*>(&wide), VMTypeKind::VM_SIZE_T).ok());
+  REQUIRE(!load_memory(reinterpret_cast<const std::byte*>(&wide), VMTypeKind::VM_ADDRESS).ok());
+  REQUIRE(!VMStructShape::convert({.kind = VMTypeKind::VM_SIZE_T, .offset = 0}, VMValue(-1)));
+
+  auto text = heap.make_string("a");
+  REQUIRE(compare(text, heap.make_string("a"), 2, heap));
+  REQUIRE(!sub(text, VMValue(1), heap).ok());
+  REQUIRE(std::get<int>(std::get<VMPrimitive>(sub(VMPrimitive(5), VMPrimitive(7)).result())) == -2);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineStructTest) {
+  std::vector<VMStructTypes> fields = {VMPrimitive(0), VMPrimitive(0.0), VMPrimitive(std::string("none")),
+                                       VMPrimitive(false)};
+  VM vm({new StructCreate<VM>(1, fields), new SetField<VM>(1, 0, VMPrimitive(7)), new SetField<VM>(1, 1, VMPrimitive(2)),
+         new SetField<VM>(1, 2, VMPrimitive(std::string("name"))), new GetField<VM>(2, 1, 0),
+         new GetField<VM>(3, 1, 1), new GetField<VM>(4, 1, 2), new GetField<VM>(5, 1, 3),
+         new StructCreate<VM>(6, fields), new GetField<VM>(7, 6, 2), new Halt<VM>()},
+        4096);
+  vm.run();
+  REQUIRE(vm.registers()[2] == VMValue(7));
+  REQUIRE(vm.registers()[3] == VMValue(2.0));
+  REQUIRE(vm.heap().string(vm.registers()[4]) == "name");
+  REQUIRE(vm.registers()[5] == VMValue(false));
+  REQUIRE(vm.heap().string(vm.registers()[7]) == "none");
+
+  // header, int, padding, double, string, bool
+  REQUIRE(vm.heap().shape_count() == 1);
+  const auto& shape = vm.heap().shape(0);
+  REQUIRE(shape.size() == 33);
+  REQUIRE(shape.fields()[1].offset == 16);
+  std::vector<std::byte> instance(shape.instance().begin(), shape.instance().end());
+  REQUIRE(VMStructShape::store(instance.data(), shape.fields()[1], VMValue(1.5f)));
+  REQUIRE(VMStructShape::load(instance.data(), shape.fields()[1]) == VMValue(1.5));
+  REQUIRE(!VMStructShape::store(instance.data(), shape.fields()[0], VMValue(1.5)));
+  REQUIRE(!VMStructShape::store(instance.data(), shape.fields()[3], VMValue(1)));
+
+  auto copy = vm.heap().unbox(vm.registers()[1]);
+  REQUIRE(std::get<VMStruct>(copy).bytes.size() == 33);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineStructLifetimeTest) {
+  // 10000 instances do not fit into 4096 bytes, Deallocate frees each one
+  std::vector<VMStructTypes> fields = {VMPrimitive(0), VMPrimitive(0.0), VMPrimitive(std::string("none"))};
+  VM vm({new MovRI<VM>(2, VMPrimitive(0)), new CmpBrI<VM>(5, 2, VMPrimitive(10'000), 6),
+         new StructCreate<VM>(1, fields), new Deallocate<VM>(1), new IncReg<VM>(2, VMPrimitive(1)), new Goto<VM>(1),
+         new Halt<VM>()},
+        4096);
+  vm.run();
+  REQUIRE(vm.registers()[1].is_struct());
+  REQUIRE(vm.registers()[1].handle() == 0);
+  REQUIRE(!vm.is_instance(vm.registers()[1]));
+  REQUIRE(!vm.is_instance(vm.heap().box(VMStruct{{std::byte{0}}}).result()));
+
+  // fields are only read from instances, not from boxed struct constants
+  vm.registers()[1] = vm.heap().box(VMStruct{{std::byte{0}}}).result();
+  REQUIRE(!GetField<VM>::execute(&vm, {.op = OpCode::GET_FIELD, .a = 2, .b = 1, .c = 0}).ok());
+  vm.collect_garbage();
+  REQUIRE(std::get<VMStruct>(vm.heap().unbox(vm.registers()[1])).bytes.size() == 1);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineCallNativeTest) {
+  VM vm(128);
+  vm.add_native_function(
+      "sub",
+      [](VM* machine, std::span<const VMValue> args) -> ResultOr<bool> {
+        machine->stack_push(VMValue(args[0].as_int() - args[1].as_int()));
+        return true;
+      },
+      2);
+  vm.add_program({new Push<VM>(VMPrimitive(44)), new Push<VM>(VMPrimitive(2)),
+                  new CallNative<VM>(VMPrimitive(std::string("sub"))), new Halt<VM>()});
+  vm.run();
+  REQUIRE(vm.bytecode()[2].c == vm.link_native_function("sub"));
+  REQUIRE(vm.stack_pointer() == 0);
+  REQUIRE(vm.stack_top() == VMValue(42));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineRegisterWindowTest) {
+  // c(1) = fib(c(1)), fib calls itself in overlapping register windows
+  VM vm(128);
+  vm.add_program({new MovRI<VM>(1, VMPrimitive(15)), new MovRI<VM>(0, VMPrimitive(7)),
+                  new CallR<VM>(VMPrimitive(std::string("fib")), 1), new Halt<VM>()});
+  vm.add_function("fib",
+                  {new CmpBrI<VM>(4, 0, VMPrimitive(1), 10), new SubRRI<VM>(2, 0, VMPrimitive(1)),
+                   new CallR<VM>(VMPrimitive(std::string("fib")), 2), new SubRRI<VM>(3, 0, VMPrimitive(2)),
+                   new CallR<VM>(VMPrimitive(std::string("fib")), 3), new AddRRR<VM>(0, 2, 3), new Return<VM>(0)},
+                  1);
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(610));
+  REQUIRE(vm.registers()[0] == VMValue(7));
+  REQUIRE(vm.stack_pointer() == -1);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineBulkMemoryTest) {
+  constexpr auto FLOAT = static_cast<std::size_t>(VMTypeKind::VM_FLOAT);
+  constexpr auto INT = static_cast<std::size_t>(VMTypeKind::VM_INT);
+  constexpr auto DOUBLE = static_cast<std::size_t>(VMTypeKind::VM_DOUBLE);
+  VM vm({new Allocate<VM>(32, 1), new Allocate<VM>(32), new MovRI<VM>(2, VMPrimitive(7)),
+         new MovRI<VM>(3, VMPrimitive(16)), new MemSet<VM>(1, 2, 3), new MemCopy<VM>(9, 1, 3),
+         new MemCmp<VM>(4, 1, 9, 3), new MovRI<VM>(5, VMPrimitive(2.5)),
+         new StoreMem<VM>(5, {.base = 1, .offset = 8}, DOUBLE), new LoadMem<VM>(6, {.base = 1, .offset = 8}, DOUBLE),
+         new MovRI<VM>(7, VMPrimitive(3)),
+         new StoreMem<VM>(7, {.base = 1}, FLOAT), new LoadMem<VM>(8, {.base = 1}, FLOAT), new MemCmp<VM>(5, 1, 9, 3),
+         new LoadMem<VM>(7, {.base = 9, .offset = 12}, INT), new Deallocate<VM>(1), new Halt<VM>()},
+        4096);
+  vm.run();
+  REQUIRE(vm.registers()[4] == VMValue(0));
+  REQUIRE(vm.registers()[6] == VMValue(2.5));
+  REQUIRE(vm.registers()[8] == VMValue(3.0f));
+  REQUIRE(vm.registers()[5] == VMValue(-1));
+  REQUIRE(vm.registers()[7] == VMValue(0x0707'0707));
+
+  // byte counts which leave the committed memory are rejected
+  vm.registers()[3] = VMValue(64 * 1024 * 1024);
+  REQUIRE(!MemSet<VM>::execute(&vm, {.op = OpCode::MEM_SET, .a = 9, .b = 2, .c = 3}).ok());
+  REQUIRE(!MemCopy<VM>::execute(&vm, {.op = OpCode::MEM_COPY, .a = 9, .b = 9, .c = 3}).ok());
+  vm.registers()[3] = VMValue(std::numeric_limits<int>::max());
+  REQUIRE(!MemCmp<VM>::execute(&vm, {.op = OpCode::MEM_CMP, .a = 4, .b = 9 | (9 << 16), .c = 3}).ok());
+  vm.registers()[3] = VMValue(16);
+  REQUIRE(MemSet<VM>::execute(&vm, {.op = OpCode::MEM_SET, .a = 9, .b = 2, .c = 3}).ok());
+}
+
+SIMPLE_TEST_CASE(VirtualMachineIndexedMemoryTest) {
+  // a[i] = i * i for i < 8, then r4 = a[7] read through [a + 1*8 + 48]
+  constexpr auto INT = static_cast<std::size_t>(VMTypeKind::VM_INT);
+  VM vm({new Allocate<VM>(32, 1), new MovRI<VM>(2, VMPrimitive(0)), new CmpBrI<VM>(5, 2, VMPrimitive(8), 7),
+         new MulRRR<VM>(3, 2, 2), new StoreMem<VM>(3, {.base = 1, .index = 2, .scale = 4}, INT),
+         new IncReg<VM>(2, VMPrimitive(1)), new Goto<VM>(2), new MovRI<VM>(2, VMPrimitive(1)),
+         new LoadMem<VM>(4, {.base = 1, .index = 2, .scale = 8, .offset = 20}, INT),
+         new LoadMem<VM>(5, {.base = 1, .index = 2, .scale = 4, .offset = -4}, INT), new Halt<VM>()},
+        4096);
+  vm.run();
+  REQUIRE(vm.registers()[4] == VMValue(49));
+  REQUIRE(vm.registers()[5] == VMValue(0));
+
+  // the value has to lie in the committed memory, below base as well as behind it
+  constexpr auto DOUBLE = static_cast<std::size_t>(VMTypeKind::VM_DOUBLE);
+  auto load = [&vm](const MemoryOperand& adr, std::size_t kind) {
+    return LoadMem<VM>::execute(&vm, {.op = OpCode::LOAD_MEM, .a = 4, .b = memory_operand(adr, kind),
+                                      .c = static_cast<std::uint64_t>(adr.offset)})
+        .ok();
+  };
+  REQUIRE(load({.base = 1, .offset = 4088}, DOUBLE));
+  REQUIRE(!load({.base = 1, .offset = 4089}, DOUBLE));
+  REQUIRE(!load({.base = 1, .offset = -1}, INT));
+  vm.registers()[2] = VMValue(std::numeric_limits<int>::max());
+  REQUIRE(!load({.base = 1, .index = 2, .scale = 8}, INT));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineStringCollectionTest) {
+  // every iteration drops the string of the last one, handles are reused
+  VM vm({new MovRI<VM>(2, VMPrimitive(std::string("s"))), new AddRRI<VM>(4, 2, VMPrimitive(std::string("y"))),
+         new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(10'000), 7),
+         new AddRRI<VM>(3, 2, VMPrimitive(std::string("x"))), new IncReg<VM>(1, VMPrimitive(1)), new Goto<VM>(3),
+         new Halt<VM>()},
+        128);
+  vm.run();
+  REQUIRE(vm.heap().string_count() < 2048);
+  REQUIRE(vm.heap().string(vm.registers()[3]) == "sx");
+  REQUIRE(vm.heap().string(vm.registers()[4]) == "sy");
+  REQUIRE(vm.heap().string(vm.registers()[2]) == "s");
+  vm.collect_garbage();
+  vm.registers()[3] = VMValue(0);
+  auto live = vm.heap().live_strings();
+  REQUIRE(vm.collect_garbage() == 1);
+  REQUIRE(vm.heap().live_strings() == live - 1);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineStackTest) {
+  // 100000 pushes stay in the reserved stack, no reallocation moves the values
+  VM vm({new MovRI<VM>(1, VMPrimitive(0)), new CmpBrI<VM>(5, 1, VMPrimitive(100'000), 5), new Push<VM>(VMPrimitive(3)),
+         new IncReg<VM>(1, VMPrimitive(1)), new Goto<VM>(1), new SLoad<VM>(2), new Halt<VM>()},
+        128);
+  vm.run();
+  REQUIRE(vm.stack_pointer() == 99'998);
+  REQUIRE(vm.registers()[0] == VMValue(3));
+
+  VMStack<VMValue> stack(4);
+  stack.push(VMValue(1));
+  stack.push(VMValue(2));
+  REQUIRE(stack.pop() == VMValue(2));
+  REQUIRE(stack.top() == VMValue(1));
+  REQUIRE(stack.pointer() == 0);
+  REQUIRE(stack.guard(stack.data() - 1) == StackGuard::LOWER);
+  REQUIRE(!stack.is_guard(stack.data()));
+}
+
+// calls sum(n) = 0 + 1 + ... + n - 1 200 times, c(3) = 200 * sum(n)
+auto jit_program(VM& vm, VMPrimitive n) {
+  vm.add_program({new MovRI<VM>(4, VMPrimitive(0)), new MovRI<VM>(3, VMPrimitive(0)),
+                  new CmpBrI<VM>(5, 4, VMPrimitive(200), 8), new MovRI<VM>(5, n),
+                  new CallR<VM>(VMPrimitive(std::string("sum")), 5), new AddRRR<VM>(3, 3, 5),
+                  new AddRRI<VM>(4, 4, VMPrimitive(1)), new Goto<VM>(2), new Halt<VM>()});
+  vm.add_function("sum",
+                  {new MovRI<VM>(1, VMPrimitive(0)), new MovRI<VM>(2, VMPrimitive(0)), new CmpBr<VM>(5, 1, 0, 15),
+                   new AddRRR<VM>(2, 2, 1), new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(11),
+                   new Return<VM>(2)},
+                  1);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineJitTest) {
+  VM vm(128);
+  jit_program(vm, VMPrimitive(10));
+  vm.run();
+  REQUIRE(vm.registers()[3] == VMValue(9000));
+  REQUIRE(vm.function_entry("sum").calls() == 200);
+  REQUIRE(vm.is_compiled(0) == (PALLADIUM_JIT == 1));
+
+  // i < n with a double n fails the int guard, sum falls back to the interpreter
+  VM deopt(128);
+  jit_program(deopt, VMPrimitive(10.0));
+  deopt.run();
+  REQUIRE(deopt.registers()[3] == VMValue(9000));
+  REQUIRE(!deopt.is_compiled(0));
+
+  VM interpreted(128);
+  jit_program(interpreted, VMPrimitive(10));
+  interpreted.enable_jit(false);
+  interpreted.run();
+  REQUIRE(interpreted.registers()[3] == VMValue(9000));
+  REQUIRE(!interpreted.is_compiled(0));
+}
+
+SIMPLE_TEST_CASE(VirtualMachineJitCollectionTest) {
+  // cat is compiled after 100 calls, its loop drops 20000 strings in the last one
+  VM vm({new MovRI<VM>(4, VMPrimitive(0)), new CmpBrI<VM>(5, 4, VMPrimitive(101), 6), new MovRI<VM>(5, VMPrimitive(1)),
+         new CallR<VM>(VMPrimitive(std::string("cat")), 5), new AddRRI<VM>(4, 4, VMPrimitive(1)), new Goto<VM>(1),
+         new MovRI<VM>(5, VMPrimitive(20'000)), new CallR<VM>(VMPrimitive(std::string("cat")), 5), new Halt<VM>()},
+        128);
+  vm.add_function("cat",
+                  {new MovRI<VM>(2, VMPrimitive(std::string("s"))), new MovRI<VM>(1, VMPrimitive(0)),
+                   new CmpBr<VM>(5, 1, 0, 15), new AddRRI<VM>(3, 2, VMPrimitive(std::string("x"))),
+                   new AddRRI<VM>(1, 1, VMPrimitive(1)), new Goto<VM>(11), new Return<VM>(3)},
+                  1);
+  vm.run();
+  REQUIRE(vm.is_compiled(0) == (PALLADIUM_JIT == 1));
+  REQUIRE(vm.heap().string(vm.registers()[5]) == "sx");
+  REQUIRE(vm.heap().live_strings() < 2048);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineTraceTest) {
+  // c(2) = 3 * (0 + 1 + ... + 999) + 1000, the branch at c(1) == 700 leaves the trace
+  auto program = [] {
+    return std::vector<VM::InstructionTypeV*>{
+        new MovRI<VM>(1, VMPrimitive(0)), new MovRI<VM>(2, VMPrimitive(0)),
+        new CmpBrI<VM>(5, 1, VMPrimitive(1000), 10), new CmpBrI<VM>(2, 1, VMPrimitive(700), 8),
+        new MulRRI<VM>(3, 1, VMPrimitive(3)), new AddRRR<VM>(2, 2, 3), new AddRRI<VM>(1, 1, VMPrimitive(1)),
+        new Goto<VM>(2), new AddRRI<VM>(2, 2, VMPrimitive(1000)), new Goto<VM>(4), new Halt<VM>()};
+  };
+  VM vm(program(), 128);
+  vm.run();
+  REQUIRE(vm.registers()[2] == VMValue(1'499'500));
+  REQUIRE(vm.registers()[1] == VMValue(1000));
+  REQUIRE(vm.trace_count() == (PALLADIUM_JIT == 1 ? 1 : 0));
+
+  VM interpreted(program(), 128);
+  interpreted.enable_jit(false);
+  interpreted.run();
+  REQUIRE(interpreted.registers()[2] == VMValue(1'499'500));
+  REQUIRE(interpreted.trace_count() == 0);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineQuickenTest) {
+  // c(0) counts to 100 in steps of c(2), first with an int step, then with a double step
+  VM vm({new MovRI<VM>(2, VMPrimitive(1)), new MovRI<VM>(3, VMPrimitive(0)), new CLoad<VM>(VMPrimitive(0)),
+         new If<VM>(5, VMPrimitive(100), 6), new Add<VM>(2), new Goto<VM>(3), new CmpBrI<VM>(2, 3, VMPrimitive(1), 10),
+         new MovRI<VM>(2, VMPrimitive(1.0)), new MovRI<VM>(3, VMPrimitive(1)), new Goto<VM>(2), new Halt<VM>()},
+        128);
+  vm.enable_jit(false);
+  vm.run();
+  REQUIRE(vm.registers()[0] == VMValue(100.0));
+  // Add and If are quickened in the first round, the double step makes both
+  // fail their guards and Add is quickened again for two doubles
+  REQUIRE(vm.quicken_rewrites() == 3);
+  REQUIRE(vm.quicken_deopts() == 2);
+  REQUIRE(vm.bytecode()[3].op == OpCode::IF);
+  REQUIRE(vm.bytecode()[4].op == OpCode::ADD_DOUBLE_DOUBLE);
+
+  // the image of the run holds the generic records, a mapped image is copied
+  // on the first rewrite and continues on the copy
+  auto path = (std::filesystem::temp_directory_path() / "palladium_vm_quicken.pbc").string();
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    REQUIRE(write_pbc(out, vm.image().result()).ok());
+  }
+  auto file = PbcFile::open(path);
+  REQUIRE(file.ok());
+  VM mapped(128);
+  mapped.enable_jit(false);
+  REQUIRE(mapped.load(file.result()).ok());
+  mapped.run();
+  REQUIRE(mapped.registers()[0] == VMValue(100.0));
+  REQUIRE(mapped.quicken_rewrites() == 3);
+  REQUIRE(mapped.bytecode().data() != file.result().code().data());
+  REQUIRE(file.result().code()[4].op == OpCode::ADD);
+  std::filesystem::remove(path);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineTracingTest) {
+  // the trace line is only built if the policy enables tracing
+  bool built = false;
+  AggresivPolicy::print_dbg([&] {
+    built = true;
+    return std::string("Halt");
+  });
+  REQUIRE(!built);
+  REQUIRE(DebugPolicy::tracing_enabled);
+}
+
+struct GuardedPolicy : public AggresivPolicy {
+  static constexpr bool guard_stacks = true;
+};
+
+SIMPLE_TEST_CASE(VirtualMachineStackOverflowTest) {
+  using GVM = VirtualMachine<GuardedPolicy>;
+  // f calls itself until the call stack runs into its guard page
+  GVM recursion(128);
+  recursion.add_program({new CallR<GVM>(VMPrimitive(std::string("f")), 1), new Halt<GVM>()});
+  recursion.add_function("f", {new CallR<GVM>(VMPrimitive(std::string("f")), 1), new Return<GVM>(0)}, 0);
+  auto res = recursion.run_checked();
+  REQUIRE(!res.ok());
+  REQUIRE(res.error_value().msg() == "Stack overflow in f");
+
+  GVM pushes({new Push<GVM>(VMPrimitive(1)), new Goto<GVM>(0)}, 128);
+  auto push_res = pushes.run_checked();
+  REQUIRE(!push_res.ok());
+  REQUIRE(push_res.error_value().msg() == "Stack overflow in main");
+
+  // SLoad on the empty stack reads the guard page below it
+  GVM pops({new SLoad<GVM>(1), new Halt<GVM>()}, 128);
+  auto pop_res = pops.run_checked();
+  REQUIRE(!pop_res.ok());
+  REQUIRE(pop_res.error_value().msg() == "Stack underflow in main");
+}
+
+SIMPLE_TEST_CASE(VirtualMachineProfilerTest) {
+  using PVM = VirtualMachine<ProfilingPolicy>;
+  PVM vm(128);
+  vm.add_program({new MovRI<PVM>(1, VMPrimitive(10)), new CallR<PVM>(VMPrimitive(std::string("fib")), 1),
+                  new Halt<PVM>()});
+  vm.add_function("fib",
+                  {new CmpBrI<PVM>(4, 0, VMPrimitive(1), 9), new SubRRI<PVM>(2, 0, VMPrimitive(1)),
+                   new CallR<PVM>(VMPrimitive(std::string("fib")), 2), new SubRRI<PVM>(3, 0, VMPrimitive(2)),
+                   new CallR<PVM>(VMPrimitive(std::string("fib")), 3), new AddRRR<PVM>(0, 2, 3), new Return<PVM>(0)},
+                  1);
+  std::stringstream json;
+  vm.profiler().output(&json);
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(55));
+
+  const auto& profiler = vm.profiler();
+  REQUIRE(profiler.opcode(OpCode::CALL_R).count == 177);
+  REQUIRE(profiler.opcode(OpCode::RETURN).count == 177);
+  REQUIRE(profiler.opcode(OpCode::HALT).count == 1);
+  REQUIRE(profiler.functions().size() == 1);
+  REQUIRE(profiler.functions()[0].calls == 177);
+  REQUIRE(profiler.pc_histogram()[3] == 177);
+  REQUIRE(json.str().find("\"name\": \"fib\", \"calls\": 177") != std::string::npos);
+  REQUIRE(json.str().find("\"name\": \"CallR\"") != std::string::npos);
+
+  std::stringstream folded;
+  profiler.write_folded(folded);
+  REQUIRE(folded.str().find("main;fib;fib;fib ") != std::string::npos);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineFieldCacheTest) {
+  // one SetField site sees shape a three times, then shape b
+  using PVM = VirtualMachine<ProfilingPolicy>;
+  PVM vm(4096);
+  vm.add_program({new StructCreate<PVM>(1, {VMPrimitive(0), VMPrimitive(false)}),
+                  new StructCreate<PVM>(2, {VMPrimitive(0.0)}), new CallR<PVM>(VMPrimitive(std::string("set")), 1),
+                  new CallR<PVM>(VMPrimitive(std::string("set")), 1), new CallR<PVM>(VMPrimitive(std::string("set")), 1),
+                  new CallR<PVM>(VMPrimitive(std::string("set")), 2), new GetField<PVM>(3, 1, 0),
+                  new GetField<PVM>(4, 2, 0), new Halt<PVM>()});
+  vm.add_function("set", {new SetField<PVM>(0, 0, VMPrimitive(5)), new Return<PVM>(0)}, 1);
+  vm.run();
+  REQUIRE(vm.registers()[3] == VMValue(5));
+  REQUIRE(vm.registers()[4] == VMValue(5.0));
+  REQUIRE(vm.profiler().opcode(OpCode::SET_FIELD).cache_hits == 2);
+  REQUIRE(vm.profiler().opcode(OpCode::SET_FIELD).cache_misses == 2);
+}
+
+SIMPLE_TEST_CASE(VirtualMachineOutputTest) {
+  std::stringstream out;
+  VM vm({new Push<VM>(VMPrimitive(7)), new Print<VM>(), new Push<VM>(VMPrimitive(2.5)), new Print<VM>(),
+         new Push<VM>(VMPrimitive(std::string(" ab"))), new Print<VM>(), new Halt<VM>()},
+        128);
+  vm.output().set_stream(&out);
+  vm.run();
+  REQUIRE(out.str() == "72.500000 ab");
+
+  // written once the buffer is full, at once when unbuffered
+  std::stringstream small;
+  VMOutput output(&small, 4);
+  output.write("abc");
+  REQUIRE(small.str().empty());
+  output.write("de");
+  REQUIRE(small.str() == "abc");
+  REQUIRE(output.pending() == 2);
+  output.set_capacity(0);
+  output.write(VMValue(-12), vm.heap());
+  REQUIRE(small.str() == "abcde-12");
+}
+
+SIMPLE_TEST_CASE(VirtualMachinePbcTest) {
+  auto path = (std::filesystem::temp_directory_path() / "palladium_vm_test.pbc").string();
+  {
+    VM vm(128);
+    vm.add_program({new MovRI<VM>(1, VMPrimitive(15)), new CallR<VM>(VMPrimitive(std::string("fib")), 1),
+                    new CLoad<VM>(VMPrimitive(std::string("done"))), new Halt<VM>()});
+    vm.add_function("fib",
+                    {new CmpBrI<VM>(4, 0, VMPrimitive(1), 10), new SubRRI<VM>(2, 0, VMPrimitive(1)),
+                     new CallR<VM>(VMPrimitive(std::string("fib")), 2), new SubRRI<VM>(3, 0, VMPrimitive(2)),
+                     new CallR<VM>(VMPrimitive(std::string("fib")), 3), new AddRRR<VM>(0, 2, 3), new Return<VM>(0)},
+                    1);
+    auto image = vm.image();
+    REQUIRE(image.ok());
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    REQUIRE(write_pbc(out, image.result()).ok());
+  }
+
+  auto file = PbcFile::open(path);
+  REQUIRE(file.ok());
+  REQUIRE(file.result().functions().size() == 1);
+  REQUIRE(file.result().strings().size() == 1);
+  VM vm(128);
+  REQUIRE(vm.load(file.result()).ok());
+  REQUIRE(vm.bytecode().data() == file.result().code().data());
+  REQUIRE(vm.function_entry("fib").argument_count() == 1);
+  vm.run();
+  REQUIRE(vm.registers()[1] == VMValue(610));
+  REQUIRE(vm.heap().string(vm.registers()[0]) == "done");
+  // executed in place, nothing was quickened
+  REQUIRE(vm.bytecode().data() == file.result().code().data());
+
+  // operands have to name registers of the window, natives and strings of the file
+  auto opens = [&path](const PbcImage& image) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    write_pbc(out, image);
+    out.close();
+    return PbcFile::open(path).ok();
+  };
+  auto with_record = [](Bytecode record) {
+    return PbcImage{.functions = {}, .constants = {}, .strings = {"s"}, .code = {record, {.op = OpCode::HALT}}};
+  };
+  REQUIRE(opens(with_record({.op = OpCode::MOV_RI, .a = 1, .c = VMValue::string_handle(0).bits()})));
+  REQUIRE(!opens(with_record({.op = OpCode::MOV_RI, .a = 12, .c = VMValue(1).bits()})));
+  REQUIRE(!opens(with_record({.op = OpCode::ADD_RRR, .a = 1, .b = 2, .c = 40})));
+  REQUIRE(!opens(with_record({.op = OpCode::CLOAD, .c = VMValue::string_handle(1).bits()})));
+  REQUIRE(!opens(with_record({.op = OpCode::CALL_NATIVE, .c = 0})));
+  REQUIRE(!opens(with_record({.op = OpCode::ADD_DOUBLE_DOUBLE, .a = 2})));
+  REQUIRE(opens(with_record({.op = OpCode::LOAD_MEM, .a = 1, .b = memory_operand({.base = 2, .scale = 8}, 3)})));
+  REQUIRE(!opens(with_record({.op = OpCode::LOAD_MEM, .a = 1, .b = 2 | (64 << 16)})));
+  REQUIRE(!opens(with_record({.op = OpCode::STORE_MEM, .a = 1, .b = 2 | (5u << 24)})));
+
+  // a failed load leaves the VM untouched
+  auto native = with_record({.op = OpCode::CALL_NATIVE, .c = 0});
+  native.functions.push_back({.name = "missing", .argument_count = 0, .address = 0, .kind = PbcFunction::NATIVE});
+  REQUIRE(opens(native));
+  VM fresh(128);
+  REQUIRE(!fresh.load(PbcFile::open(path).result()).ok());
+  REQUIRE(fresh.heap().string_count() == 0);
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "not a pbc file, just some text long enough for the header of a pbc file";
+  }
+  REQUIRE(!PbcFile::open(path).ok());
+  std::filesystem::remove(path);
+}
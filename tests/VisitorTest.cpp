@@ -24,8 +24,41 @@ SIMPLE_TEST_CASE(TEST_1) {
   VMPtr vm = visitor->vm();
   REQUIRE(vm->function_entry("main").name() == "main");
   vm->run();
-  REQUIRE(std::get<VMPrimitive>(vm->stack_top()) == VMPrimitive(22));
+  REQUIRE(vm->stack_top() == VMValue(22));
   std::cout << vm->to_string() << std::endl;
 
   vm->print_stack();
 }
+
+SIMPLE_TEST_CASE(TEST_THREE_ADDRESS) {
+  Parser p("fn main() -> i32 { let a: i32 = 2; let b: i32 = 13; let c: i32 = 14; a = b + c + 1; return a + b + c; }");
+  auto res = p.parse();
+  REQUIRE(res.ok());
+  auto visitor = std::make_shared<TranslationUnitVisitor>();
+  res.result()->accept(visitor);
+  REQUIRE(visitor->result().ok());
+  VMPtr vm = visitor->vm();
+  vm->run();
+  REQUIRE(vm->stack_top() == VMValue(55));
+  // Call, Halt + 3 MovRI, AddRRI, AddRRR, AddRRR, AddRRR, Return
+  REQUIRE(vm->bytecode().size() == 10);
+}
+
+SIMPLE_TEST_CASE(TEST_CODEGEN_ERRORS) {
+  auto generate = [](const std::string& source) -> VisitResult {
+    Parser p(source);
+    auto res = p.parse();
+    if (!res.ok()) {
+      return res.error_value();
+    }
+    auto visitor = std::make_shared<TranslationUnitVisitor>();
+    res.result()->accept(visitor);
+    return visitor->result();
+  };
+  auto unknown = generate("fn main() -> i32 { let a: i32 = 2; a = b + 1; return a + 1; }");
+  REQUIRE(!unknown.ok());
+  REQUIRE(unknown.error_value().msg() == "Unknown variable b");
+  auto in_return = generate("fn main() -> i32 { return c + 1; }");
+  REQUIRE(!in_return.ok());
+  REQUIRE(in_return.error_value().msg() == "Unknown variable c");
+}